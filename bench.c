@@ -0,0 +1,238 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "main.h"
+
+// Microbenchmarks for the functions on the message path. Built and run with `make bench`.
+//
+// Every benchmark prints one JSON object per line with the nanoseconds, allocations and bytes per
+// operation, so that the results of two builds can be compared by a script. Connections to other
+// nodes write to /dev/null, so the benchmarks include the cost of the write() calls but not of the
+// network.
+//
+// The allocations are counted by wrapping malloc(), calloc() and realloc() at link time, so only
+// the calls made by the program itself are counted, not the ones inside the C library.
+
+// Each benchmark runs for at least this long
+#define BENCH_MIN_TIME_NS 200000000LL
+
+static unsigned long allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+	allocations++;
+	return __real_malloc(size);
+}
+void *__wrap_calloc(size_t count, size_t size) {
+	allocations++;
+	return __real_calloc(count, size);
+}
+void *__wrap_realloc(void *p, size_t size) {
+	allocations++;
+	return __real_realloc(p, size);
+}
+
+static long long now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Runs `iterations` operations and returns the number of bytes they processed
+typedef long (*BenchFunction)(long iterations);
+
+static void run_benchmark(const char *name, BenchFunction function) {
+	// Warm up, then double the iterations until the run is long enough
+	function(1);
+	long iterations = 1;
+	while (true) {
+		unsigned long start_allocations = allocations;
+		long long start = now_ns();
+		long bytes = function(iterations);
+		long long elapsed = now_ns() - start;
+
+		if (elapsed >= BENCH_MIN_TIME_NS) {
+			printf("{\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.1f, \"allocs_per_op\": %.3f, \"bytes_per_op\": %.1f, \"mb_per_s\": %.2f}\n",
+				name, iterations, (double) elapsed / iterations, (double) (allocations - start_allocations) / iterations,
+				(double) bytes / iterations, bytes / (elapsed / 1e9) / 1e6);
+			fflush(stdout);
+			return;
+		}
+		iterations *= 2;
+	}
+}
+
+static struct Connection *open_fake_connection(NodeID node_id) {
+	int fd = open("/dev/null", O_WRONLY);
+	if (fd == -1) {
+		error("Couldn't open /dev/null: %s\n", strerror(errno));
+	}
+	struct Connection *conn = add_connection(fd);
+	conn->node_id = node_id;
+	return conn;
+}
+
+
+// read_lines(): framing of CHAT lines read from a pipe. One operation is one line.
+
+#define READ_LINES_CHUNK_LINES 64
+static int pipe_fds[2];
+static char read_buffer[MAX_NODE_MESSAGE_SIZE];
+static int read_buffer_index;
+static long lines_read;
+
+static bool count_line(int fd, char *line) {
+	(void) fd;
+	(void) line;
+	lines_read++;
+	return true;
+}
+
+static long bench_read_lines(long iterations) {
+	static char chunk[READ_LINES_CHUNK_LINES * 64];
+	static int chunk_length;
+	if (chunk_length == 0) {
+		for (int i = 0; i < READ_LINES_CHUNK_LINES; i++) {
+			chunk_length += sprintf(chunk + chunk_length, "CHAT 01 02 a typical chat message number %02d\n", i);
+		}
+	}
+
+	long bytes = 0;
+	for (long done = 0; done < iterations; done += READ_LINES_CHUNK_LINES) {
+		if (write(pipe_fds[1], chunk, chunk_length) != chunk_length) {
+			error("Couldn't write to the pipe: %s\n", strerror(errno));
+		}
+		lines_read = 0;
+		while (lines_read < READ_LINES_CHUNK_LINES) {
+			read_lines(pipe_fds[0], read_buffer, &read_buffer_index, MAX_NODE_MESSAGE_SIZE, count_line);
+		}
+		bytes += chunk_length;
+	}
+	return bytes;
+}
+
+
+// handle_message(): ROUTE and CHAT messages from a chord neighbor
+
+static struct Connection *chord_conn;
+
+static long handle_lines(long iterations, const char *const *lines, int line_count) {
+	char message[MAX_NODE_MESSAGE_SIZE];
+	long bytes = 0;
+	for (long i = 0; i < iterations; i++) {
+		const char *line = lines[i % line_count];
+		size_t length = strlen(line);
+		// The handlers modify the message in place
+		memcpy(message, line, length + 1);
+		handle_message(chord_conn->socket, message);
+		bytes += length + 1;
+	}
+	return bytes;
+}
+
+static long bench_chat_relay(long iterations) {
+	static const char *const lines[] = { "CHAT 01 05 a typical chat message" };
+	return handle_lines(iterations, lines, 1);
+}
+
+static long bench_route_unchanged(long iterations) {
+	static const char *const lines[] = { "ROUTE 01 07 01-03-07" };
+	return handle_lines(iterations, lines, 1);
+}
+
+// Every message changes the shortest path, so it's announced to the neighbors
+static long bench_route_changed(long iterations) {
+	static const char *const lines[] = { "ROUTE 01 09 01-09", "ROUTE 01 09 01-03-04-09" };
+	return handle_lines(iterations, lines, 2);
+}
+
+
+// update_routing_given_new_path() on a full table, alternating between a short and a long path
+
+static long bench_update_routing(long iterations) {
+	Path short_path = { .hop_count = 1 };
+	Path long_path = { .hop_count = 4, .nodes = { 0, 61, 62, 63 } };
+	for (long i = 0; i < iterations; i++) {
+		NodeID neighbor_id = 20 + i % MAX_NEIGHBORS;
+		NodeID recipient_id = 40 + (i / MAX_NEIGHBORS) % MAX_RECIPIENTS;
+		Path *path = (i / (MAX_NEIGHBORS * MAX_RECIPIENTS)) % 2 == 0 ? &short_path : &long_path;
+		path->nodes[0] = neighbor_id;
+		update_routing_given_new_path(neighbor_id, recipient_id, path);
+	}
+	return 0;
+}
+
+static long bench_path_to_string(long iterations) {
+	Path path = { .hop_count = MAX_NODES - 2 };
+	for (int i = 0; i < path.hop_count; i++) {
+		path.nodes[i] = 10 + i;
+	}
+	char str[MAX_PATH_STR_SIZE];
+	long bytes = 0;
+	for (long i = 0; i < iterations; i++) {
+		bytes += path_to_string(str, 99, &path);
+	}
+	return bytes;
+}
+
+// The whole table, which has a path to every recipient
+static long bench_send_shortest_paths(long iterations) {
+	unsigned long before = ctx->metrics.bytes_out[chord_conn->node_id];
+	for (long i = 0; i < iterations; i++) {
+		send_shortest_paths(chord_conn);
+	}
+	return ctx->metrics.bytes_out[chord_conn->node_id] - before;
+}
+
+static void fill_routing_table(void) {
+	init_routing();
+	Path path = { .hop_count = 2 };
+	for (int n = 0; n < MAX_NEIGHBORS; n++) {
+		for (int r = 0; r < MAX_RECIPIENTS; r++) {
+			path.nodes[0] = 20 + n;
+			path.nodes[1] = 60 + r;
+			update_routing_given_new_path(20 + n, 40 + r, &path);
+		}
+	}
+}
+
+int main(void) {
+	ctx = new_context();
+	init_connections_array();
+	ctx->self.id = 0;
+	ctx->connection_state = CONNECTED;
+
+	if (pipe(pipe_fds) == -1) {
+		error("Couldn't create a pipe: %s\n", strerror(errno));
+	}
+	run_benchmark("read_lines", bench_read_lines);
+
+	// Neighbor 01 sends the messages, and the CHAT messages are relayed to node 05 through neighbor 02
+	init_routing();
+	chord_conn = open_fake_connection(1);
+	struct Connection *relay_conn = open_fake_connection(2);
+	update_routing_given_new_path(1, 1, &(Path) { .hop_count = 0 });
+	update_routing_given_new_path(2, 2, &(Path) { .hop_count = 0 });
+	update_routing_given_new_path(2, 5, &(Path) { .hop_count = 1, .nodes = { 2 } });
+	run_benchmark("handle_message_chat_relay", bench_chat_relay);
+	run_benchmark("handle_message_route_unchanged", bench_route_unchanged);
+	run_benchmark("handle_message_route_changed", bench_route_changed);
+	close_connection(relay_conn);
+
+	fill_routing_table();
+	run_benchmark("update_routing_given_new_path", bench_update_routing);
+	run_benchmark("path_to_string", bench_path_to_string);
+	fill_routing_table();
+	run_benchmark("send_shortest_paths", bench_send_shortest_paths);
+
+	return 0;
+}
@@ -1,4 +1,6 @@
 #define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
 #include <unistd.h>
@@ -7,83 +9,160 @@
 
 #include "main.h"
 
-struct Connection connections[MAX_CONNECTIONS];
-struct Connection *new_node_conn, *pred_conn, *succ_conn, *outbound_chord_conn;
-
-extern fd_set select_inputs;
-
 void init_connections_array(void) {
 	for (int i = 0; i < MAX_CONNECTIONS; i++) {
-		connections[i].socket = -1;
+		ctx->connections[i].socket = -1;
 	}
 }
 
 struct Connection *add_connection(int socket) {
-	FD_SET(socket, &select_inputs);
 	for (int i = 0; i < MAX_CONNECTIONS; i++) {
-		struct Connection *conn = &connections[i];
+		struct Connection *conn = &ctx->connections[i];
 		if (conn->socket == -1) {
+			FD_SET(socket, &select_inputs);
 			conn->socket = socket;
 			conn->node_id = -1;
+			conn->pending = false;
+			conn->connecting = false;
+			conn->connect_queue = NULL;
+			conn->connect_queue_length = 0;
 			conn->buffer_index = 0;
 			conn->ip_addr[0] = '\0';
 			conn->tcp_port[0] = '\0';
+			conn->sync_state = SYNC_NONE;
+			conn->peer_seen_epoch = 0;
+			conn->peer_seen_version = 0;
+			conn->last_received_ms = monotonic_ms();
+			conn->missed_probes = 0;
+			conn->heartbeat_capable = false;
+			conn->heartbeat_checked = false;
+			conn->leaving = false;
+			conn->outbound_chord = NO_OUTBOUND_CHORD;
+			rate_limit_init(&conn->limiter);
 			return conn;
 		}
 	}
-	error("add_connection(): no space left!\n");
+	return NULL;
+}
+
+int count_pending_connections(void) {
+	int count = 0;
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		if (ctx->connections[i].socket != -1 && ctx->connections[i].pending) {
+			count++;
+		}
+	}
+	return count;
 }
 
 int close_connection(struct Connection *connection) {
 	if (connection == NULL || connection->socket == -1) return 0;
-	int ret = close(connection->socket);
+	rate_limit_discard(connection);
+	free(connection->connect_queue);
+	connection->connect_queue = NULL;
+	connection->connect_queue_length = 0;
+	connection->connecting = false;
+	int ret = transport->close(connection->socket);
 	FD_CLR(connection->socket, &select_inputs);
+	FD_CLR(connection->socket, &select_outputs);
 	connection->socket = -1;
-	if (new_node_conn == connection) new_node_conn = NULL;
-	if (pred_conn == connection) pred_conn = NULL;
-	if (succ_conn == connection) succ_conn = NULL;
-	if (outbound_chord_conn == connection) outbound_chord_conn = NULL;
+	connection->generation++;
+	if (ctx->pred_conn == connection) ctx->pred_conn = NULL;
+	if (ctx->succ_conn == connection) ctx->succ_conn = NULL;
+	if (ctx->standby_conn == connection) ctx->standby_conn = NULL;
 	return ret;
 }
 
 struct Connection *find_connection_by_socket(int socket) {
 	for (int i = 0; i < MAX_CONNECTIONS; i++) {
-		if (connections[i].socket == socket) {
-			return &connections[i];
+		if (ctx->connections[i].socket == socket) {
+			return &ctx->connections[i];
 		}
 	}
 	return NULL;
 }
 struct Connection *find_connection_by_node_id(NodeID node_id) {
 	for (int i = 0; i < MAX_CONNECTIONS; i++) {
-		if (connections[i].socket != -1 && connections[i].node_id == node_id) {
-			return &connections[i];
+		if (ctx->connections[i].socket != -1 && ctx->connections[i].node_id == node_id && !ctx->connections[i].leaving) {
+			return &ctx->connections[i];
 		}
 	}
 	return NULL;
 }
 
+void get_connected_node_ids(bool connected[MAX_NODE_ID + 1]) {
+	for (int i = 0; i <= MAX_NODE_ID; i++) {
+		connected[i] = false;
+	}
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		NodeID id = ctx->connections[i].node_id;
+		if (ctx->connections[i].socket != -1 && id >= 0 && id <= MAX_NODE_ID && !ctx->connections[i].leaving) {
+			connected[id] = true;
+		}
+	}
+}
+
 bool is_inbound_chord(struct Connection *conn) {
-	return conn != new_node_conn && conn != pred_conn && conn != succ_conn && conn != outbound_chord_conn;
+	return !conn->leaving && !conn->pending && conn->outbound_chord == NO_OUTBOUND_CHORD && conn != ctx->pred_conn && conn != ctx->succ_conn && conn != ctx->standby_conn;
+}
+
+bool supports_extensions(struct Connection *conn) {
+	return conn->sync_state == SYNC_ENABLED || conn->heartbeat_capable;
+}
+
+static int write_all(int socket, const char *data, int length) {
+	int written = 0;
+	while (written < length) {
+		ssize_t n = transport->write(socket, data + written, length - written);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			handle_broken_socket(socket);
+			return -1;
+		}
+		written += n;
+	}
+	return written;
+}
+
+int conn_write(int socket, const char *data, int length) {
+	struct Connection *conn = find_connection_by_socket(socket);
+	count_messages_out(conn, data, length);
+	if (conn != NULL && conn->node_id != -1) {
+		vv_printf("Sending message to node "NODE_ID_OUT": %.*s", conn->node_id, length, data);
+	} else {
+		vv_printf("Sending message to the new client node: %.*s", length, data);
+	}
+	if (conn != NULL && conn->connecting) {
+		char *queue = realloc(conn->connect_queue, conn->connect_queue_length + length);
+		if (queue == NULL) {
+			error("Allocation failed.");
+		}
+		memcpy(queue + conn->connect_queue_length, data, length);
+		conn->connect_queue = queue;
+		conn->connect_queue_length += length;
+		return length;
+	}
+	return write_all(socket, data, length);
+}
+
+int flush_connect_queue(struct Connection *conn) {
+	char *queue = conn->connect_queue;
+	int length = conn->connect_queue_length;
+	conn->connect_queue = NULL;
+	conn->connect_queue_length = 0;
+	int ret = length > 0 ? write_all(conn->socket, queue, length) : 0;
+	free(queue);
+	return ret;
 }
 
 int conn_printf(int socket, const char *format, ...) {
 	va_list args;
 	va_start(args, format);
 	char message[MAX_NODE_MESSAGE_SIZE];
-	vsnprintf(message, MAX_NODE_MESSAGE_SIZE, format, args);
-	if (verbose_level >= 2) {
-		struct Connection *conn = find_connection_by_socket(socket);
-		if (conn != NULL && conn->node_id != -1) {
-			vv_printf("Sending message to node "NODE_ID_OUT": %s", conn->node_id, message);
-		} else {
-			vv_printf("Sending message to the new client node: %s", message);
-		}
-	}
-	int ret = dprintf(socket, "%s", message);
-	if (ret < 0) {
-		handle_broken_socket(socket);
-	}
+	int length = vsnprintf(message, MAX_NODE_MESSAGE_SIZE, format, args);
 	va_end(args);
-	return ret;
+	if (length >= MAX_NODE_MESSAGE_SIZE) {
+		length = MAX_NODE_MESSAGE_SIZE - 1;
+	}
+	return conn_write(socket, message, length);
 }
@@ -4,12 +4,48 @@
 #include <sys/select.h>
 
 #include "main.h"
+#include "rate-limit.h"
+
+// Versioned routing table synchronization with a neighbor. See routing.c
+enum SyncState {
+	// The peer may not support versioned synchronization, so tables are sent in full without version information
+	SYNC_NONE,
+	// We sent a SYNC message as the connecting node and are waiting for the peer's SYNC message to send our table
+	SYNC_AWAITING_PEER,
+	// The connecting node sent a SYNC message and we haven't sent our table yet
+	SYNC_REQUESTED,
+	// Our table was sent with version information. Later versions are announced with VERSION messages.
+	SYNC_ENABLED
+};
+
+enum OutboundChord {
+	// Not an outbound chord (the standby connection isn't counted either)
+	NO_OUTBOUND_CHORD,
+	// Created with a user command
+	USER_CHORD,
+	// Chosen automatically by the finger table. See fingers.c
+	FINGER_CHORD,
+	// Chosen automatically from the forwarded traffic. See traffic.c
+	TRAFFIC_CHORD
+};
 
 typedef struct Connection {
 	// The socket file descriptor.
 	int socket;
+	// Incremented whenever the connection is closed, so that a reused slot can be told apart
+	unsigned long generation;
 	// The node ID. Equal to `-1` if it isn't yet known.
 	NodeID node_id;
+	// Whether the node connected to us and didn't yet say what the connection is for (ENTRY, PRED or CHORD)
+	bool pending;
+	// When a pending connection is closed if it's still pending. See ring.c
+	long long handshake_deadline_ms;
+	// Whether our connect() is still in progress. What is written meanwhile is queued in
+	// `connect_queue` and sent once it's established. See ring.c
+	bool connecting;
+	long long connect_deadline_ms;
+	char *connect_queue;
+	int connect_queue_length;
 	// See read-lines.c
 	char buffer[MAX_NODE_MESSAGE_SIZE];
 	int buffer_index;
@@ -17,19 +53,51 @@ typedef struct Connection {
 	char ip_addr[IPV4_ADDR_STR_SIZE];
 	// The destination TCP port. Only valid for outbound connections.
 	char tcp_port[TCP_PORT_STR_SIZE];
+	enum SyncState sync_state;
+	// The version of our table which the peer said it has (`0` if it has none)
+	unsigned int peer_seen_epoch;
+	unsigned long peer_seen_version;
+	// Failure detection. See heartbeat.c
+	long long last_received_ms;
+	int missed_probes;
+	// Whether the node answers PING messages
+	bool heartbeat_capable;
+	// Whether a PING was sent to find out if the node answers them
+	bool heartbeat_checked;
+	// Who decided to open this connection if it's an outbound chord
+	enum OutboundChord outbound_chord;
+	// Whether the connection no longer has a role in the ring, because the node sent a LEAVE message
+	// or is our old predecessor. It's only kept open until the node closes it, to receive the
+	// messages it is still relaying, or until `leaving_deadline_ms`. See ring.c
+	bool leaving;
+	long long leaving_deadline_ms;
+	// Queue for relayed messages. See rate-limit.c
+	RateLimiter limiter;
 } Connection;
 
 #define MAX_INBOUND_CHORDS (MAX_NODES - 2)
-#define MAX_CONNECTIONS (MAX_INBOUND_CHORDS + 4)
-extern struct Connection connections[MAX_CONNECTIONS];
-extern struct Connection *new_node_conn, *pred_conn, *succ_conn, *outbound_chord_conn;
+// Accepted connections which are still in the handshake
+#define MAX_PENDING_CONNECTIONS 8
+#define MAX_CONNECTIONS (MAX_INBOUND_CHORDS + 4 + MAX_PENDING_CONNECTIONS)
 
 void init_connections_array(void);
+// Returns NULL if there's no space left
 struct Connection *add_connection(int socket);
+int count_pending_connections(void);
 int close_connection(struct Connection *connection);
 struct Connection *find_connection_by_socket(int socket);
+// Connections with leaving nodes are ignored
 struct Connection *find_connection_by_node_id(NodeID node_id);
+// Sets `connected[id]` for every node which `find_connection_by_node_id()` would find
+void get_connected_node_ids(bool connected[MAX_NODE_ID + 1]);
 bool is_inbound_chord(struct Connection *conn);
+// Whether the node implements the messages which aren't part of the base protocol
+bool supports_extensions(struct Connection *conn);
+// Writes raw data to a node. Returns -1 and handles the broken socket if the write fails.
+int conn_write(int socket, const char *data, int length);
+// Sends what was written while the connection was being established. Returns -1 and handles the
+// broken socket if the write fails.
+int flush_connect_queue(struct Connection *conn);
 int conn_printf(int socket, const char *format, ...);
 
 #endif
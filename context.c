@@ -0,0 +1,25 @@
+#include <string.h>
+#include <sys/select.h>
+
+#include "main.h"
+
+NodeContext *ctx;
+
+NodeContext *new_context(void) {
+	NodeContext *context = malloc_f(sizeof(NodeContext));
+	memset(context, 0, sizeof(NodeContext));
+
+	context->input_state = COMMAND;
+	context->connection_state = DISCONNECTED;
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		context->connections[i].socket = -1;
+	}
+	context->heartbeat_interval_ms = DEFAULT_HEARTBEAT_INTERVAL_MS;
+	context->heartbeat_threshold = DEFAULT_HEARTBEAT_THRESHOLD;
+	context->ns_socket = -1;
+	context->store_entry = -1;
+	context->missing_id = -1;
+	context->slow_handler_threshold_us = DEFAULT_SLOW_HANDLER_MS * 1000LL;
+	context->metrics_socket = -1;
+	return context;
+}
@@ -0,0 +1,142 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include "main.h"
+
+struct addrinfo;
+
+// Everything which makes up the state of a node in a ring. The modules work on the node `ctx` points
+// to, so that one process can host several nodes sharing one event loop: the loop points `ctx` at a
+// node before it handles an event of that node. COR hosts one node for each ring it's in, and the
+// simulator (see sim.c) hosts many.
+typedef struct NodeContext {
+	// main.c
+	enum InputState input_state;
+	// Active timers, in no particular order
+	Timer *timers;
+	Timer timeout_timer;
+
+	// ring.c
+	enum ConnectionState connection_state;
+	// The successor's ID is also stored in `succ.id`
+	Node self, succ, second_succ;
+	// CONNECTING only
+	// Whether we are waiting for the successor to tell us who our second successor is via a SUCC message
+	bool awaiting_succ;
+	// Whether we are waiting for the predecessor to tell us what its ID is via a PRED message
+	bool awaiting_pred;
+	// This is an empty string if we connected to another node or another node connected to us using the direct join command.
+	char ring_id_str[4];
+	// The ring named in the RING message when we connect to a node, so that a process in several
+	// rings knows which one the connection is for. Set by the join and ring commands. See main.c
+	char ring_tag[4];
+	// Whether a standby connection to the second successor should be kept. See ring.c
+	bool standby_enabled;
+	// Closes the connections once the grace period of a graceful leave is over
+	Timer leave_timer;
+	// Closes the pending connections whose handshake deadline passed
+	Timer handshake_timer;
+	// Gives up on the connections we opened which weren't established in time
+	Timer connect_timer;
+	// Closes the connections which lost their role if the nodes didn't close them in time
+	Timer leaving_timer;
+
+	// connections.c
+	struct Connection connections[MAX_CONNECTIONS];
+	// `standby_conn` is an outbound chord to the second successor used for fast failover. See ring.c
+	struct Connection *pred_conn, *succ_conn, *standby_conn;
+
+	// routing.c
+	// The nodes which the rows and columns of the routing table correspond to. See routing.c
+	NodeID recipient_ids[MAX_RECIPIENTS];
+	NodeIndex neighbor_ids[MAX_NEIGHBORS];
+	RoutingTable routing_table;
+	ForwardingTable forwarding_table;
+	// Indexed by recipient ID. Kept across joins.
+	TrafficStats traffic_stats[MAX_NODE_ID + 1];
+	unsigned int table_epoch;
+	unsigned long table_version;
+	NodeID table_history[ROUTING_HISTORY_SIZE];
+	// Indexed by neighbor ID
+	PeerTable peer_tables[MAX_NODE_ID + 1];
+	// Recipients whose shortest path changed while restoring a stored table and wasn't announced yet
+	bool pending_announcements[MAX_NODE_ID + 1];
+	Timer version_timer;
+	// ROUTE messages with our shortest paths, indexed by recipient index, so that announcements and
+	// table dumps don't need to format them again. An entry is rebuilt when its length is 0, which is
+	// set whenever the forwarding entry for the recipient changes.
+	char route_messages[MAX_RECIPIENTS][MAX_ROUTE_MSG_SIZE];
+	int route_message_lengths[MAX_RECIPIENTS];
+
+	// rate-limit.c
+	RateLimitConfig default_rate_limit;
+	RateLimitConfig neighbor_rate_limits[MAX_NODE_ID + 1];
+	// Indexed by neighbor ID, so that they survive reconnections
+	RateLimitStats rate_limit_stats[MAX_NODE_ID + 1];
+	Timer drain_timer;
+
+	// heartbeat.c
+	long int heartbeat_interval_ms;
+	int heartbeat_threshold;
+	Timer heartbeat_timer;
+
+	// node-server.c
+	int ns_socket;
+	// Node server address
+	struct addrinfo *ns_addrinfo;
+	// The nodes shown to the user to choose from
+	NodeArray node_arr;
+	enum NodeListAction node_list_action;
+	NodeListCacheEntry node_list_cache[NODE_LIST_CACHE_SIZE];
+	Timer refresh_timer;
+	// Gives up on the node list requested by the user
+	Timer request_timer;
+	char requested_ring_id_str[4];
+	Registration registrations[MAX_PENDING_REGISTRATIONS];
+	unsigned long next_registration_sequence;
+	Timer registration_timer;
+
+	// fingers.c
+	bool auto_chords_enabled;
+	Timer finger_timer;
+	// The reachable nodes and the node list version when the fingers were last chosen
+	bool known_members[MAX_NODE_ID + 1];
+	unsigned long known_version;
+
+	// traffic.c
+	bool traffic_chords_enabled;
+	Timer policy_timer;
+	// Messages per interval, halved every interval
+	double traffic_rates[MAX_NODE_ID + 1];
+	unsigned long counted_messages[MAX_NODE_ID + 1];
+	// The last node which wasn't in the node list, or `-1`
+	NodeID missing_id;
+
+	// routing-store.c
+	// The entry of the state file which the ring is saved in, or `-1`
+	int store_entry;
+	// Whether the tables changed since they were last saved
+	bool store_dirty;
+	Timer store_timer;
+	// The neighbors whose restored routes weren't confirmed yet, indexed by neighbor ID
+	bool restored_neighbors[MAX_NODE_ID + 1];
+	// Drops the restored routes which weren't confirmed in time
+	Timer revalidation_timer;
+
+	// trace.c
+	unsigned long next_trace_id;
+
+	// metrics.c
+	Metrics metrics;
+	long long slow_handler_threshold_us;
+	int metrics_socket;
+	int metrics_clients[MAX_METRICS_CLIENTS];
+} NodeContext;
+
+// The node whose events are being handled
+extern NodeContext *ctx;
+
+// Allocates a node in its initial state. It doesn't become the current node.
+NodeContext *new_context(void);
+
+#endif
@@ -0,0 +1,111 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+
+#include "main.h"
+
+// Automatic chords, chosen like the finger table of the Chord protocol.
+//
+// Finger k is the first ring member with an ID of at least `self.id + 2^k`, modulo the size of the
+// ID space. With N members spread over the ID space, that's about log2(N) distinct nodes at
+// exponentially growing distances, so every node is reachable in O(log N) hops instead of O(N).
+// We open a chord to every finger we aren't connected to yet and close the automatic chords to
+// nodes which are no longer fingers.
+//
+// The addresses come from the cached node list, so this only works in rings joined through the
+// node server. Only the nodes which are reachable according to our routing table are used, since
+// the node list may still contain nodes which left without unregistering. The fingers are chosen
+// again whenever the set of reachable nodes or the node list changes, and a change in the set of
+// reachable nodes also invalidates the node list, since it may be missing a new node.
+
+static void close_auto_chord(struct Connection *conn) {
+	NodeID id = conn->node_id;
+	close_connection(conn);
+	if (find_connection_by_node_id(id) == NULL) {
+		remove_routing_neighbor(id);
+	}
+}
+
+static void update_fingers(void) {
+	start_timer(&ctx->finger_timer, FINGER_CHECK_INTERVAL_MS, update_fingers);
+	if (ctx->connection_state != CONNECTED || ctx->ring_id_str[0] == '\0') {
+		return;
+	}
+
+	bool members[MAX_NODE_ID + 1] = { false };
+	for (int i = 0; i < MAX_RECIPIENTS; i++) {
+		if (ctx->recipient_ids[i] != -1) {
+			members[ctx->recipient_ids[i]] = true;
+		}
+	}
+	bool members_changed = memcmp(members, ctx->known_members, sizeof(members)) != 0;
+	if (members_changed) {
+		memcpy(ctx->known_members, members, sizeof(members));
+		invalidate_node_list(ctx->ring_id_str);
+	}
+
+	unsigned long version;
+	const NodeArray *list = get_node_list(ctx->ring_id_str, &version);
+	if (list == NULL || (!members_changed && version == ctx->known_version)) {
+		return;
+	}
+	ctx->known_version = version;
+
+	const Node *fingers[MAX_NODE_ID + 1] = { NULL };
+	for (int step = 1; step <= MAX_NODE_ID; step *= 2) {
+		int start = (ctx->self.id + step) % (MAX_NODE_ID + 1);
+		const Node *finger = NULL;
+		int finger_distance = 0;
+		for (int i = 0; i < list->length; i++) {
+			const Node *node = &list->nodes[i];
+			if (node->id == ctx->self.id || node->id < 0 || node->id > MAX_NODE_ID || !members[node->id]) continue;
+
+			int distance = (node->id - start + MAX_NODE_ID + 1) % (MAX_NODE_ID + 1);
+			if (finger == NULL || distance < finger_distance) {
+				finger = node;
+				finger_distance = distance;
+			}
+		}
+		if (finger != NULL) {
+			fingers[finger->id] = finger;
+		}
+	}
+
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		struct Connection *conn = &ctx->connections[i];
+		if (conn->socket != -1 && conn->outbound_chord == FINGER_CHORD && fingers[conn->node_id] == NULL) {
+			v_printf("Node "NODE_ID_OUT" is no longer one of our fingers. Closing the automatic chord.\n", conn->node_id);
+			close_auto_chord(conn);
+		}
+	}
+
+	for (NodeID id = 0; id <= MAX_NODE_ID; id++) {
+		// Nodes we are already connected to, e.g. the successor, don't need a chord
+		if (fingers[id] == NULL || find_connection_by_node_id(id) != NULL) continue;
+
+		Node finger = *fingers[id];
+		struct Connection *conn = open_chord(&finger);
+		if (conn == NULL) {
+			v_printf("Couldn't open an automatic chord to node "NODE_ID_OUT".\n", id);
+			continue;
+		}
+		conn->outbound_chord = FINGER_CHORD;
+	}
+}
+
+void set_auto_chords(bool enabled) {
+	ctx->auto_chords_enabled = enabled;
+	if (enabled) {
+		// Choose the fingers on the next check
+		memset(ctx->known_members, 0, sizeof(ctx->known_members));
+		start_timer(&ctx->finger_timer, 0, update_fingers);
+		return;
+	}
+
+	stop_timer(&ctx->finger_timer);
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		if (ctx->connections[i].socket != -1 && ctx->connections[i].outbound_chord == FINGER_CHORD) {
+			close_auto_chord(&ctx->connections[i]);
+		}
+	}
+}
@@ -0,0 +1,12 @@
+#ifndef FINGERS_H
+#define FINGERS_H
+
+#include "main.h"
+
+// How often the set of reachable nodes and the node list are checked for changes while automatic chords are enabled
+#define FINGER_CHECK_INTERVAL_MS 1000
+
+// Enables or disables the automatic chords. Disabling them closes them.
+void set_auto_chords(bool enabled);
+
+#endif
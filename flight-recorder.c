@@ -0,0 +1,407 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "util.h"
+#include "flight-recorder.h"
+
+// Flight recorder: an in-memory ring of the most recent log messages, kept in binary form.
+//
+// Recording a message only copies the pointer to its format string, a timestamp and the raw values
+// of its arguments, so verbose logging stays cheap on the forwarding path even when nothing is
+// printed. The messages are formatted when the recorder is dumped with the "dump log" command.
+// The program is single-threaded, so the ring needs no locks.
+//
+// The format strings must be string literals, since only the pointers are kept. Every logging macro
+// in util.h passes a literal. Strings are copied, since they're usually buffers on the stack.
+
+typedef struct LogRecord {
+	long long time_us;
+	const char *format;
+	// Bytes used in `args`. Arguments which didn't fit or had an unsupported type are left out.
+	unsigned char args_length;
+	unsigned char level;
+	unsigned char args[FLIGHT_RECORDER_ARGS_SIZE];
+} LogRecord;
+
+enum ArgType {
+	ARG_NONE,
+	ARG_INT,
+	ARG_LONG,
+	ARG_LONG_LONG,
+	ARG_SIZE,
+	ARG_DOUBLE,
+	ARG_POINTER,
+	// Stored as a length byte followed by the characters
+	ARG_STRING,
+	ARG_UNSUPPORTED,
+};
+
+// The longest conversion specification that is replayed, e.g. "%-08.3lld"
+#define MAX_SPEC_LENGTH 16
+// Arguments after these aren't recorded
+#define MAX_RECORDED_ARGS 16
+// Must be a power of two
+#define FORMAT_CACHE_SIZE 256
+// Precisions of a conversion which has none, and of one whose precision is a '*' argument
+#define NO_PRECISION -1
+#define STAR_PRECISION -2
+
+// The argument types of a format string, so that it's only parsed the first time it's recorded
+typedef struct FormatInfo {
+	const char *format;
+	unsigned char arg_count;
+	unsigned char types[MAX_RECORDED_ARGS];
+	// Of the strings, which may not be terminated when a precision is given
+	int precisions[MAX_RECORDED_ARGS];
+} FormatInfo;
+
+int record_level = DEFAULT_RECORD_LEVEL;
+
+static FormatInfo format_cache[FORMAT_CACHE_SIZE];
+static LogRecord records[FLIGHT_RECORDER_SIZE];
+// Records written since the start. The next one goes to `records[record_count % FLIGHT_RECORDER_SIZE]`.
+static unsigned long record_count;
+
+// Parses the conversion specification which starts at `spec[0] == '%'`. Returns its length.
+// `*star_count` is set to the number of '*' widths and precisions, which take an int argument each.
+// `*precision` is set to NO_PRECISION, STAR_PRECISION or the precision given in the specification.
+static int parse_conversion(const char *spec, enum ArgType *type, int *star_count, int *precision) {
+	int i = 1;
+	*star_count = 0;
+	*precision = NO_PRECISION;
+	while (spec[i] != '\0' && strchr("-+ #0", spec[i]) != NULL) i++;
+	if (spec[i] == '*') {
+		(*star_count)++;
+		i++;
+	}
+	while (spec[i] >= '0' && spec[i] <= '9') i++;
+	if (spec[i] == '.') {
+		i++;
+		if (spec[i] == '*') {
+			(*star_count)++;
+			*precision = STAR_PRECISION;
+			i++;
+		} else {
+			*precision = 0;
+		}
+		while (spec[i] >= '0' && spec[i] <= '9') {
+			if (*precision < 10000) *precision = *precision * 10 + spec[i] - '0';
+			i++;
+		}
+	}
+
+	enum ArgType integer_type = ARG_INT;
+	if (spec[i] == 'h') {
+		// Promoted to int
+		i++;
+		if (spec[i] == 'h') i++;
+	} else if (spec[i] == 'l') {
+		i++;
+		integer_type = ARG_LONG;
+		if (spec[i] == 'l') {
+			i++;
+			integer_type = ARG_LONG_LONG;
+		}
+	} else if (spec[i] == 'z') {
+		i++;
+		integer_type = ARG_SIZE;
+	} else if (spec[i] != '\0' && strchr("jtL", spec[i]) != NULL) {
+		i++;
+		integer_type = ARG_UNSUPPORTED;
+	}
+
+	char conversion = spec[i];
+	if (conversion == '\0') {
+		*type = ARG_UNSUPPORTED;
+		return i;
+	}
+	i++;
+	if (strchr("diouxXc", conversion) != NULL) {
+		*type = integer_type;
+	} else if (strchr("eEfFgGaA", conversion) != NULL) {
+		*type = integer_type == ARG_INT ? ARG_DOUBLE : ARG_UNSUPPORTED;
+	} else if (conversion == 's') {
+		*type = ARG_STRING;
+	} else if (conversion == 'p') {
+		*type = ARG_POINTER;
+	} else if (conversion == '%') {
+		*type = ARG_NONE;
+	} else {
+		*type = ARG_UNSUPPORTED;
+	}
+	return i;
+}
+
+static bool store(LogRecord *record, const void *value, size_t size) {
+	if (record->args_length + size > FLIGHT_RECORDER_ARGS_SIZE) {
+		return false;
+	}
+	memcpy(record->args + record->args_length, value, size);
+	record->args_length += size;
+	return true;
+}
+
+// A negative `precision` means the whole string is recorded
+static bool store_arg(LogRecord *record, enum ArgType type, int precision, va_list *args) {
+	switch (type) {
+		case ARG_INT: {
+			int value = va_arg(*args, int);
+			return store(record, &value, sizeof(value));
+		}
+		case ARG_LONG: {
+			long value = va_arg(*args, long);
+			return store(record, &value, sizeof(value));
+		}
+		case ARG_LONG_LONG: {
+			long long value = va_arg(*args, long long);
+			return store(record, &value, sizeof(value));
+		}
+		case ARG_SIZE: {
+			size_t value = va_arg(*args, size_t);
+			return store(record, &value, sizeof(value));
+		}
+		case ARG_DOUBLE: {
+			double value = va_arg(*args, double);
+			return store(record, &value, sizeof(value));
+		}
+		case ARG_POINTER: {
+			void *value = va_arg(*args, void *);
+			return store(record, &value, sizeof(value));
+		}
+		case ARG_STRING: {
+			const char *value = va_arg(*args, const char *);
+			if (value == NULL) value = "(null)";
+			size_t room = FLIGHT_RECORDER_ARGS_SIZE - record->args_length;
+			if (room < 1) return false;
+			size_t max_length = room - 1;
+			if (precision >= 0 && (size_t) precision < max_length) max_length = precision;
+			// Doesn't read past the precision, since the characters after it needn't be terminated
+			size_t length = strnlen(value, max_length);
+			if (length > 255) length = 255;
+			unsigned char length_byte = length;
+			store(record, &length_byte, 1);
+			store(record, value, length);
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+static const FormatInfo *get_format_info(const char *format) {
+	FormatInfo *info = &format_cache[((size_t) format >> 3) & (FORMAT_CACHE_SIZE - 1)];
+	if (info->format == format) {
+		return info;
+	}
+
+	info->format = format;
+	info->arg_count = 0;
+	for (const char *c = format; *c != '\0'; c++) {
+		if (*c != '%') continue;
+		enum ArgType type;
+		int star_count;
+		int precision;
+		c += parse_conversion(c, &type, &star_count, &precision) - 1;
+		if (type == ARG_NONE) continue;
+		if (type == ARG_UNSUPPORTED || info->arg_count + star_count + 1 > MAX_RECORDED_ARGS) break;
+
+		// The '*' widths and precisions come before the value
+		for (int i = 0; i < star_count; i++) {
+			info->precisions[info->arg_count] = NO_PRECISION;
+			info->types[info->arg_count++] = ARG_INT;
+		}
+		info->precisions[info->arg_count] = precision;
+		info->types[info->arg_count++] = type;
+	}
+	return info;
+}
+
+void record_log_va(int level, const char *format, va_list args) {
+	LogRecord *record = &records[record_count % FLIGHT_RECORDER_SIZE];
+	record_count++;
+	record->time_us = monotonic_us();
+	record->format = format;
+	record->level = level;
+	record->args_length = 0;
+
+	const FormatInfo *info = get_format_info(format);
+	// va_list may be an array type, so it's passed to the helpers by pointer to a copy
+	va_list args_copy;
+	va_copy(args_copy, args);
+	for (int i = 0; i < info->arg_count; i++) {
+		int precision = info->precisions[i];
+		if (precision == STAR_PRECISION) {
+			// The '*' precision is the int stored just before the value
+			memcpy(&precision, record->args + record->args_length - sizeof(int), sizeof(int));
+		}
+		if (!store_arg(record, info->types[i], precision, &args_copy)) break;
+	}
+	va_end(args_copy);
+}
+
+void log_message(int level, const char *format, ...) {
+	va_list args;
+	if (level <= record_level) {
+		va_start(args, format);
+		record_log_va(level, format, args);
+		va_end(args);
+	}
+	if (level <= verbose_level) {
+		va_start(args, format);
+		vprintf(format, args);
+		va_end(args);
+	}
+}
+
+void log_warning(const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	record_log_va(0, format, args);
+	va_end(args);
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+}
+
+// Reads the next argument of a record. Returns `false` if there are no more.
+static bool load(const LogRecord *record, int *offset, void *value, size_t size) {
+	if (*offset + size > record->args_length) {
+		return false;
+	}
+	memcpy(value, record->args + *offset, size);
+	*offset += size;
+	return true;
+}
+
+// Formats one conversion with its stored argument. Returns `false` if the argument is missing, or if
+// `spec` isn't a single conversion of the type the argument was recorded with.
+static bool format_arg(FILE *file, const LogRecord *record, int *offset, const char *spec, enum ArgType type, int star_count) {
+	enum ArgType spec_type;
+	int spec_star_count;
+	int precision;
+	if (parse_conversion(spec, &spec_type, &spec_star_count, &precision) != (int) strlen(spec) ||
+		spec_type != type || spec_star_count != star_count || star_count > 2) {
+		return false;
+	}
+
+	int stars[2] = {0, 0};
+	for (int i = 0; i < star_count; i++) {
+		if (!load(record, offset, &stars[i], sizeof(int))) return false;
+	}
+
+	// `spec` was checked above, so the arguments match it even though it isn't a literal
+	#pragma GCC diagnostic push
+	#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+	// Prints `value` with the specification and the star arguments
+	#define PRINT_VALUE(value) ( \
+		star_count == 0 ? fprintf(file, spec, value) : \
+		star_count == 1 ? fprintf(file, spec, stars[0], value) : \
+		fprintf(file, spec, stars[0], stars[1], value))
+
+	switch (type) {
+		case ARG_NONE:
+			fputc('%', file);
+			return true;
+		case ARG_INT: {
+			int value;
+			if (!load(record, offset, &value, sizeof(value))) return false;
+			PRINT_VALUE(value);
+			return true;
+		}
+		case ARG_LONG: {
+			long value;
+			if (!load(record, offset, &value, sizeof(value))) return false;
+			PRINT_VALUE(value);
+			return true;
+		}
+		case ARG_LONG_LONG: {
+			long long value;
+			if (!load(record, offset, &value, sizeof(value))) return false;
+			PRINT_VALUE(value);
+			return true;
+		}
+		case ARG_SIZE: {
+			size_t value;
+			if (!load(record, offset, &value, sizeof(value))) return false;
+			PRINT_VALUE(value);
+			return true;
+		}
+		case ARG_DOUBLE: {
+			double value;
+			if (!load(record, offset, &value, sizeof(value))) return false;
+			PRINT_VALUE(value);
+			return true;
+		}
+		case ARG_POINTER: {
+			void *value;
+			if (!load(record, offset, &value, sizeof(value))) return false;
+			PRINT_VALUE(value);
+			return true;
+		}
+		case ARG_STRING: {
+			unsigned char length;
+			if (!load(record, offset, &length, 1) || *offset + length > record->args_length) return false;
+			char value[256];
+			memcpy(value, record->args + *offset, length);
+			value[length] = '\0';
+			*offset += length;
+			PRINT_VALUE(value);
+			return true;
+		}
+		default:
+			return false;
+	}
+	#undef PRINT_VALUE
+	#pragma GCC diagnostic pop
+}
+
+static void format_record(FILE *file, const LogRecord *record) {
+	fprintf(file, "[%lld.%06lld] ", record->time_us / 1000000, record->time_us % 1000000);
+
+	int offset = 0;
+	const char *c = record->format;
+	bool ends_with_line_feed = false;
+	while (*c != '\0') {
+		if (*c != '%') {
+			fputc(*c, file);
+			ends_with_line_feed = *c == '\n';
+			c++;
+			continue;
+		}
+
+		enum ArgType type;
+		int star_count;
+		int precision;
+		int length = parse_conversion(c, &type, &star_count, &precision);
+		char spec[MAX_SPEC_LENGTH + 1];
+		if (length <= MAX_SPEC_LENGTH) {
+			memcpy(spec, c, length);
+			spec[length] = '\0';
+		}
+		if (length > MAX_SPEC_LENGTH || !format_arg(file, record, &offset, spec, type, star_count)) {
+			// The argument wasn't recorded
+			fputs("...", file);
+			ends_with_line_feed = false;
+			break;
+		}
+		ends_with_line_feed = false;
+		c += length;
+	}
+	if (!ends_with_line_feed) {
+		fputc('\n', file);
+	}
+}
+
+void dump_flight_recorder(FILE *file, long count) {
+	unsigned long available = record_count < FLIGHT_RECORDER_SIZE ? record_count : FLIGHT_RECORDER_SIZE;
+	if (count < 0 || (unsigned long) count > available) {
+		count = available;
+	}
+	for (unsigned long i = record_count - count; i < record_count; i++) {
+		format_record(file, &records[i % FLIGHT_RECORDER_SIZE]);
+	}
+}
@@ -0,0 +1,20 @@
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <stdarg.h>
+#include <stdio.h>
+
+// Number of log records kept. Older records are overwritten.
+#define FLIGHT_RECORDER_SIZE 4096
+// Bytes for the arguments of a record. Longer strings are truncated.
+#define FLIGHT_RECORDER_ARGS_SIZE 108
+// Default for the -l option. Level 2 records every message sent, which costs a clock read and a copy
+// of the arguments per relayed message, so it's only kept when asked for.
+#define DEFAULT_RECORD_LEVEL 1
+
+// Keeps a log message in the flight recorder without formatting it
+void record_log_va(int level, const char *format, va_list args);
+// Formats and writes the last `count` records to `file`, oldest first. A negative count writes all of them.
+void dump_flight_recorder(FILE *file, long count);
+
+#endif
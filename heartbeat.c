@@ -0,0 +1,130 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "main.h"
+
+// Application-level failure detection for node connections.
+//
+// A neighbor from which nothing was received for `interval_ms` is sent a PING message, which it
+// answers with PONG. After `threshold` unanswered probes, the connection is handled as if the
+// neighbor had closed it, which makes us connect to the second successor if it was our successor.
+// Since other implementations don't answer PING, a neighbor is only probed after it sent us a PING
+// or PONG message. A PING is sent to every neighbor once it's identified to find out.
+//
+// TCP keepalive and TCP_USER_TIMEOUT are also set on the sockets of the neighbors which answer
+// probes, so that a link whose sent data isn't acknowledged is closed by the kernel in about a
+// second too. The sockets of other implementations are left with the system defaults.
+
+void set_keepalive_options(int socket) {
+	bool enabled = ctx->heartbeat_interval_ms > 0;
+	int timeout_s = (ctx->heartbeat_interval_ms * ctx->heartbeat_threshold + 999) / 1000;
+
+	int enable = enabled;
+	int idle = timeout_s;
+	int count = 3;
+	if (setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable)) < 0 || (
+		enabled && (
+			setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0 ||
+			setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof(idle)) < 0 ||
+			setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) < 0
+		)
+	)) {
+		warn("Couldn't set the TCP keepalive options: %s\n", strerror(errno));
+	}
+
+	#ifdef TCP_USER_TIMEOUT
+	// Time during which sent data may remain unacknowledged before the connection is closed. 0 is
+	// the system default.
+	unsigned int user_timeout_ms = 0;
+	if (enabled) {
+		user_timeout_ms = ctx->heartbeat_interval_ms * (ctx->heartbeat_threshold + 1);
+		if (user_timeout_ms < MIN_TCP_USER_TIMEOUT_MS) user_timeout_ms = MIN_TCP_USER_TIMEOUT_MS;
+	}
+	if (setsockopt(socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout_ms, sizeof(user_timeout_ms)) < 0) {
+		warn("Couldn't set the TCP user timeout: %s\n", strerror(errno));
+	}
+	#endif
+}
+
+static void send_probes(void) {
+	long long now = monotonic_ms();
+	if (now < 0) {
+		warn("Couldn't get current time: %s", strerror(errno));
+		return;
+	}
+
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		struct Connection *conn = &ctx->connections[i];
+		if (conn->socket == -1 || conn->node_id == -1 || conn->pending || conn->connecting) continue;
+
+		if (!conn->heartbeat_capable) {
+			if (!conn->heartbeat_checked) {
+				conn->heartbeat_checked = true;
+				conn_printf(conn->socket, "PING\n");
+			}
+			continue;
+		}
+
+		if (now - conn->last_received_ms < ctx->heartbeat_interval_ms * (conn->missed_probes + 1)) continue;
+
+		if (conn->missed_probes >= ctx->heartbeat_threshold) {
+			v_printf("Node "NODE_ID_OUT" didn't answer %d probes. Considering the connection broken.\n", conn->node_id, conn->missed_probes);
+			handle_broken_socket(conn->socket);
+			continue;
+		}
+		conn->missed_probes++;
+		conn_printf(conn->socket, "PING\n");
+	}
+
+	start_timer(&ctx->heartbeat_timer, ctx->heartbeat_interval_ms, send_probes);
+}
+
+void set_heartbeat(long int new_interval_ms, int new_threshold) {
+	ctx->heartbeat_interval_ms = new_interval_ms;
+	ctx->heartbeat_threshold = new_threshold < 1 ? 1 : new_threshold;
+
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		if (ctx->connections[i].socket != -1 && ctx->connections[i].heartbeat_capable) {
+			transport->configure(ctx->connections[i].socket);
+		}
+	}
+	init_heartbeat();
+}
+
+void heartbeat_on_receive(struct Connection *conn) {
+	conn->last_received_ms = monotonic_ms();
+	conn->missed_probes = 0;
+}
+
+static void set_heartbeat_capable(struct Connection *conn) {
+	if (!conn->heartbeat_capable) {
+		vv_printf("Node "NODE_ID_OUT" answers probes.\n", conn->node_id);
+		conn->heartbeat_capable = true;
+		transport->configure(conn->socket);
+	}
+}
+
+bool handle_heartbeat_message(struct Connection *conn, const char *message) {
+	if (strcmp(message, "PING") == 0) {
+		set_heartbeat_capable(conn);
+		conn_printf(conn->socket, "PONG\n");
+		return true;
+	}
+	if (strcmp(message, "PONG") == 0) {
+		set_heartbeat_capable(conn);
+		return true;
+	}
+	return false;
+}
+
+void init_heartbeat(void) {
+	if (ctx->heartbeat_interval_ms > 0) {
+		start_timer(&ctx->heartbeat_timer, ctx->heartbeat_interval_ms, send_probes);
+	} else {
+		stop_timer(&ctx->heartbeat_timer);
+	}
+}
@@ -0,0 +1,27 @@
+#ifndef HEARTBEAT_H
+#define HEARTBEAT_H
+
+#include "main.h"
+
+// Default time without receiving anything from a neighbor before it is probed, in milliseconds
+#define DEFAULT_HEARTBEAT_INTERVAL_MS 100
+// Default number of unanswered probes after which the connection is considered broken
+#define DEFAULT_HEARTBEAT_THRESHOLD 5
+// Lower bound of TCP_USER_TIMEOUT. With the minimum RTO of 200 ms, a lost segment is resent after
+// 200 ms and again 400 ms later, so a shorter timeout would drop links which only lost a segment.
+#define MIN_TCP_USER_TIMEOUT_MS 1000
+
+struct Connection;
+
+// Sets the keepalive and user timeout options on the socket of a node which answers probes
+void set_keepalive_options(int socket);
+// Sets the probe interval and the suspicion threshold, and applies them to the TCP timeouts of the
+// nodes which answer probes. An interval of 0 disables the probes and the TCP timeouts.
+void set_heartbeat(long int interval_ms, int threshold);
+// Must be called for every message received from a node
+void heartbeat_on_receive(struct Connection *conn);
+// If `message` is a PING or PONG message, this handles it and returns `true`
+bool handle_heartbeat_message(struct Connection *conn, const char *message);
+void init_heartbeat(void);
+
+#endif
@@ -0,0 +1,505 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "main.h"
+
+// Load generator: starts a ring of COR processes on 127.0.0.1, sends CHAT messages between random
+// pairs of nodes and reports the throughput and the end-to-end latency. Optionally kills some nodes
+// afterwards and measures how long the routing takes to converge again.
+//
+// The nodes are driven through their standard input with the same commands a user would type, and
+// a message counts as delivered when the recipient prints it. The ring is built with direct joins,
+// so no node server is needed.
+//
+// Convergence is measured with rounds of probe messages from every node to every other node, sent
+// every PROBE_INTERVAL_MS. The routing has converged when every probe of a round is delivered.
+
+#define DEFAULT_NODE_COUNT 8
+#define DEFAULT_BASE_PORT 58000
+#define DEFAULT_MESSAGE_COUNT 10000
+#define DEFAULT_RATE 1000
+#define DEFAULT_PAYLOAD_SIZE 16
+// Leaves room for "m <id> " in the command and for the CHAT header in the message
+#define MAX_PAYLOAD_SIZE (USER_COMMAND_BUF_SIZE - 56)
+
+// Time between starting two nodes, so that the joins don't overlap
+#define JOIN_INTERVAL_MS 300
+// Time for the chords to be established before the ring is probed
+#define CHORD_SETTLE_MS 500
+#define PROBE_INTERVAL_MS 100
+#define CONVERGENCE_TIMEOUT_MS 30000
+#define MAX_PROBE_ROUNDS (CONVERGENCE_TIMEOUT_MS / PROBE_INTERVAL_MS + 1)
+// Time to wait for messages still in flight after the last one was sent
+#define DRAIN_TIMEOUT_MS 2000
+
+// Lines printed by the nodes. Some warnings are longer than a node message.
+#define OUTPUT_BUFFER_SIZE 1024
+
+typedef struct Process {
+	NodeID id;
+	char tcp_port[TCP_PORT_STR_SIZE];
+	pid_t pid;
+	// Standard input of the node
+	int input;
+	// Standard output and standard error of the node
+	int output;
+	char buffer[OUTPUT_BUFFER_SIZE];
+	int buffer_index;
+	bool alive;
+} Process;
+
+static Process processes[MAX_NODE_ID + 1];
+static int process_count;
+static const char *cor_path = "./COR";
+static int base_port = DEFAULT_BASE_PORT;
+
+// Load messages, indexed by sequence number
+static long long *send_times_us;
+static bool *delivered;
+static long long *latencies_us;
+static long delivered_count;
+static long unroutable_count;
+static long long last_delivery_us;
+static long traffic_message_count;
+
+// Probe rounds of the current convergence measurement
+static int probe_phase;
+static int probes_expected[MAX_PROBE_ROUNDS];
+static int probes_received[MAX_PROBE_ROUNDS];
+static long long converged_us;
+
+static Process *find_process_by_output(int fd) {
+	for (int i = 0; i < process_count; i++) {
+		if (processes[i].alive && processes[i].output == fd) {
+			return &processes[i];
+		}
+	}
+	return NULL;
+}
+
+static bool handle_output_line(int fd, char *line) {
+	Process *process = find_process_by_output(fd);
+	if (process == NULL) return false;
+	vv_printf("["NODE_ID_OUT"] %s\n", process->id, line);
+
+	long long now = monotonic_us();
+	NodeID sender_id;
+	int payload_start = -1;
+	if (sscanf(line, "Node "NODE_ID_IN" said: \"%n", &sender_id, &payload_start) == 1 && payload_start != -1) {
+		char *payload = line + payload_start;
+		long sequence;
+		int phase, round;
+		if (sscanf(payload, "L%ld", &sequence) == 1) {
+			if (sequence >= 0 && sequence < traffic_message_count && !delivered[sequence]) {
+				delivered[sequence] = true;
+				latencies_us[delivered_count++] = now - send_times_us[sequence];
+				last_delivery_us = now;
+			}
+		} else if (sscanf(payload, "P%d.%d", &phase, &round) == 2) {
+			// Probes from an earlier measurement may still arrive
+			if (phase == probe_phase && round >= 0 && round < MAX_PROBE_ROUNDS) {
+				probes_received[round]++;
+				if (probes_received[round] == probes_expected[round] && converged_us == 0) {
+					converged_us = now;
+				}
+			}
+		}
+	} else if (strncmp(line, "Couldn't send a message", 23) == 0) {
+		unroutable_count++;
+	} else if (strncmp(line, "ERROR", 5) == 0 || strncmp(line, "WARNING", 7) == 0) {
+		v_printf("Node "NODE_ID_OUT": %s\n", process->id, line);
+	}
+	return true;
+}
+
+// Reads the output of the nodes until `deadline_us`, or until `done()` returns true.
+// The output which is already available is always read, even if the deadline has passed.
+static void pump_output(long long deadline_us, bool (*done)(void)) {
+	struct pollfd fds[MAX_NODE_ID + 1];
+	bool first = true;
+	while (done == NULL || !done()) {
+		long long now = monotonic_us();
+		if (now >= deadline_us && !first) break;
+		first = false;
+
+		int fd_count = 0;
+		for (int i = 0; i < process_count; i++) {
+			if (!processes[i].alive) continue;
+			fds[fd_count].fd = processes[i].output;
+			fds[fd_count].events = POLLIN;
+			fd_count++;
+		}
+
+		int timeout_ms = now < deadline_us ? (int) ((deadline_us - now + 999) / 1000) : 0;
+		int n = poll(fds, fd_count, timeout_ms);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			error("poll(): %s\n", strerror(errno));
+		}
+
+		for (int i = 0; i < fd_count && n > 0; i++) {
+			if (fds[i].revents == 0) continue;
+			n--;
+			Process *process = find_process_by_output(fds[i].fd);
+			enum RLResult result = read_lines(process->output, process->buffer, &process->buffer_index, OUTPUT_BUFFER_SIZE, handle_output_line);
+			if (result == RL_END || result == RL_ERROR) {
+				warn("Node "NODE_ID_OUT" exited unexpectedly.\n", process->id);
+				close(process->input);
+				close(process->output);
+				process->alive = false;
+			}
+		}
+	}
+}
+
+static void send_command(Process *process, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void send_command(Process *process, const char *format, ...) {
+	char command[USER_COMMAND_BUF_SIZE];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(command, sizeof(command), format, args);
+	va_end(args);
+
+	// The input is nonblocking. While a node's input is full, its output must still be read,
+	// or it would wait for us as we wait for it.
+	int written = 0;
+	while (written < length && process->alive) {
+		ssize_t n = write(process->input, command + written, length - written);
+		if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+			pump_output(monotonic_us() + 1000, NULL);
+		} else if (n == -1) {
+			warn("Couldn't write to node "NODE_ID_OUT": %s\n", process->id, strerror(errno));
+			return;
+		} else {
+			written += n;
+		}
+	}
+}
+
+static void start_process(Process *process, const char *initial_command) {
+	int input_pipe[2], output_pipe[2];
+	if (pipe(input_pipe) == -1 || pipe(output_pipe) == -1) {
+		error("Couldn't create a pipe: %s\n", strerror(errno));
+	}
+	// The nodes started later must not inherit our ends of the pipes
+	fcntl(input_pipe[1], F_SETFD, FD_CLOEXEC);
+	fcntl(output_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(input_pipe[1], F_SETFL, O_NONBLOCK);
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		error("fork(): %s\n", strerror(errno));
+	} else if (pid == 0) {
+		dup2(input_pipe[0], STDIN_FILENO);
+		dup2(output_pipe[1], STDOUT_FILENO);
+		dup2(output_pipe[1], STDERR_FILENO);
+		close(input_pipe[0]);
+		close(output_pipe[1]);
+		// The UDP port of the node server is never used, since the ring is built with direct joins
+		execl(cor_path, cor_path, "-v", "0", "-x", initial_command, "127.0.0.1", process->tcp_port, "127.0.0.1", process->tcp_port, (char *) NULL);
+		fprintf(stderr, "ERROR: Couldn't run %s: %s\n", cor_path, strerror(errno));
+		_exit(1);
+	}
+
+	close(input_pipe[0]);
+	close(output_pipe[1]);
+	process->pid = pid;
+	process->input = input_pipe[1];
+	process->output = output_pipe[0];
+	process->buffer_index = 0;
+	process->alive = true;
+}
+
+static void kill_process(Process *process) {
+	kill(process->pid, SIGKILL);
+	waitpid(process->pid, NULL, 0);
+	close(process->input);
+	close(process->output);
+	process->alive = false;
+}
+
+static void start_ring(int node_count) {
+	process_count = node_count;
+	for (int i = 0; i < node_count; i++) {
+		Process *process = &processes[i];
+		// Spread the IDs over the whole range
+		process->id = i * (MAX_NODE_ID + 1) / node_count;
+		sprintf(process->tcp_port, "%d", base_port + i);
+
+		char command[USER_COMMAND_BUF_SIZE];
+		sprintf(command, "dj "NODE_ID_OUT" "NODE_ID_OUT" 127.0.0.1 %s", process->id, processes[0].id, processes[0].tcp_port);
+		start_process(process, command);
+		pump_output(monotonic_us() + JOIN_INTERVAL_MS * 1000LL, NULL);
+	}
+}
+
+// Each node opens chords to `chords_per_node` random nodes which aren't its neighbors in the ring
+static void add_chords(int chords_per_node) {
+	if (process_count < 4) return;
+	for (int i = 0; i < process_count; i++) {
+		bool chosen[MAX_NODE_ID + 1] = {false};
+		for (int c = 0; c < chords_per_node; c++) {
+			int j = -1;
+			for (int attempt = 0; attempt < 4 * process_count; attempt++) {
+				int candidate = rand() % process_count;
+				int distance = (candidate - i + process_count) % process_count;
+				if (distance > 1 && distance < process_count - 1 && !chosen[candidate]) {
+					j = candidate;
+					break;
+				}
+			}
+			if (j == -1) break;
+			chosen[j] = true;
+			send_command(&processes[i], "dc "NODE_ID_OUT" 127.0.0.1 %s\n", processes[j].id, processes[j].tcp_port);
+		}
+	}
+	pump_output(monotonic_us() + CHORD_SETTLE_MS * 1000LL, NULL);
+}
+
+static bool is_converged(void) {
+	return converged_us != 0;
+}
+
+// Sends rounds of probes between every pair of live nodes until one round is fully delivered.
+// Returns the time from `start_us` until then in milliseconds, or -1 on timeout.
+static long long measure_convergence(long long start_us) {
+	probe_phase++;
+	converged_us = 0;
+	memset(probes_expected, 0, sizeof(probes_expected));
+	memset(probes_received, 0, sizeof(probes_received));
+
+	long long deadline_us = start_us + CONVERGENCE_TIMEOUT_MS * 1000LL;
+	for (int round = 0; round < MAX_PROBE_ROUNDS && !is_converged(); round++) {
+		long long round_start_us = monotonic_us();
+		if (round_start_us >= deadline_us) break;
+
+		int expected = 0;
+		for (int i = 0; i < process_count; i++) {
+			for (int j = 0; j < process_count; j++) {
+				if (i != j && processes[i].alive && processes[j].alive) expected++;
+			}
+		}
+		// Set before sending, since the first probes may be delivered while the others are sent
+		probes_expected[round] = expected;
+		for (int i = 0; i < process_count; i++) {
+			for (int j = 0; j < process_count; j++) {
+				if (i == j || !processes[i].alive || !processes[j].alive) continue;
+				send_command(&processes[i], "m "NODE_ID_OUT" P%d.%d\n", processes[j].id, probe_phase, round);
+			}
+			// Keeps the output pipes from filling up while probes are sent
+			pump_output(monotonic_us(), NULL);
+		}
+
+		pump_output(round_start_us + PROBE_INTERVAL_MS * 1000LL, is_converged);
+	}
+
+	return is_converged() ? (converged_us - start_us) / 1000 : -1;
+}
+
+static int compare_long_long(const void *a, const void *b) {
+	long long x = *(const long long *) a, y = *(const long long *) b;
+	return (x > y) - (x < y);
+}
+
+// `latencies` must be sorted
+static long long percentile(const long long *latencies, long count, double p) {
+	long index = (long) (p * count + 0.999999) - 1;
+	if (index < 0) index = 0;
+	if (index >= count) index = count - 1;
+	return latencies[index];
+}
+
+static bool all_delivered(void) {
+	return delivered_count + unroutable_count >= traffic_message_count;
+}
+
+static void run_traffic(long message_count, double rate, int payload_size) {
+	send_times_us = malloc_f(message_count * sizeof(long long));
+	latencies_us = malloc_f(message_count * sizeof(long long));
+	delivered = calloc(message_count, sizeof(bool));
+	if (delivered == NULL) {
+		error("Allocation failed.\n");
+	}
+	traffic_message_count = message_count;
+
+	char padding[MAX_PAYLOAD_SIZE + 1];
+	memset(padding, 'x', sizeof(padding) - 1);
+	padding[sizeof(padding) - 1] = '\0';
+
+	int live[MAX_NODE_ID + 1];
+	int live_count = 0;
+	for (int i = 0; i < process_count; i++) {
+		if (processes[i].alive) live[live_count++] = i;
+	}
+
+	long long start_us = monotonic_us();
+	for (long seq = 0; seq < message_count; seq++) {
+		if (rate > 0) {
+			long long due_us = start_us + (long long) (seq * 1e6 / rate);
+			pump_output(due_us, NULL);
+		} else if (seq % 64 == 0) {
+			pump_output(monotonic_us(), NULL);
+		}
+
+		int src = live[rand() % live_count];
+		int dst = live[rand() % (live_count - 1)];
+		if (dst == src) dst = live[live_count - 1];
+
+		// "L<seq>" followed by padding up to the payload size
+		char payload[MAX_PAYLOAD_SIZE + 32];
+		int length = sprintf(payload, "L%ld", seq);
+		if (payload_size > length + 1) {
+			sprintf(payload + length, " %s", padding + MAX_PAYLOAD_SIZE - (payload_size - length - 1));
+		}
+		send_times_us[seq] = monotonic_us();
+		send_command(&processes[src], "m "NODE_ID_OUT" %s\n", processes[dst].id, payload);
+	}
+	long long sent_us = monotonic_us();
+
+	pump_output(sent_us + DRAIN_TIMEOUT_MS * 1000LL, all_delivered);
+
+	double send_s = (sent_us - start_us) / 1e6;
+	double delivery_s = (last_delivery_us > start_us ? last_delivery_us - start_us : 1) / 1e6;
+	long lost = message_count - delivered_count - unroutable_count;
+	printf("Sent %ld messages of %d bytes in %.2f s (%.1f msg/s).\n", message_count, payload_size, send_s, message_count / send_s);
+	printf("Delivered %ld (%.2f%%), %ld unroutable, %ld lost.\n", delivered_count, 100.0 * delivered_count / message_count, unroutable_count, lost);
+	printf("Throughput: %.1f msg/s delivered.\n", delivered_count / delivery_s);
+
+	if (delivered_count > 0) {
+		qsort(latencies_us, delivered_count, sizeof(long long), compare_long_long);
+		printf("Latency (us): p50 %lld, p99 %lld, p999 %lld, max %lld\n",
+			percentile(latencies_us, delivered_count, 0.50), percentile(latencies_us, delivered_count, 0.99),
+			percentile(latencies_us, delivered_count, 0.999), latencies_us[delivered_count - 1]);
+	}
+
+	free(send_times_us);
+	free(latencies_us);
+	free(delivered);
+	traffic_message_count = 0;
+}
+
+static void kill_nodes(int kill_count) {
+	printf("Killing nodes");
+	for (int k = 0; k < kill_count; k++) {
+		int i;
+		do {
+			i = rand() % process_count;
+		} while (!processes[i].alive);
+		kill_process(&processes[i]);
+		printf(" "NODE_ID_OUT, processes[i].id);
+	}
+	printf(".\n");
+	fflush(stdout);
+}
+
+static void stop_ring(void) {
+	for (int i = 0; i < process_count; i++) {
+		if (processes[i].alive) {
+			kill(processes[i].pid, SIGTERM);
+		}
+	}
+	for (int i = 0; i < process_count; i++) {
+		if (processes[i].alive) {
+			waitpid(processes[i].pid, NULL, 0);
+			processes[i].alive = false;
+		}
+	}
+}
+
+static void usage(void) {
+	fprintf(stderr, "Usage: LOADGEN [-n <nodes>] [-c <chords per node>] [-m <messages>] [-r <messages per second, 0 for no limit>] [-s <payload size>] [-k <nodes to kill>] [-p <first TCP port>] [-b <path to COR>] [-v <verbosity level>]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	int node_count = DEFAULT_NODE_COUNT;
+	int chords_per_node = 0;
+	long message_count = DEFAULT_MESSAGE_COUNT;
+	double rate = DEFAULT_RATE;
+	int payload_size = DEFAULT_PAYLOAD_SIZE;
+	int kill_count = 0;
+
+	while (true) {
+		int opt = getopt(argc, argv, "n:c:m:r:s:k:p:b:v:");
+		if (opt == -1) break;
+		switch (opt) {
+			case 'n': node_count = atoi(optarg); break;
+			case 'c': chords_per_node = atoi(optarg); break;
+			case 'm': message_count = atol(optarg); break;
+			case 'r': rate = atof(optarg); break;
+			case 's': payload_size = atoi(optarg); break;
+			case 'k': kill_count = atoi(optarg); break;
+			case 'p': base_port = atoi(optarg); break;
+			case 'b': cor_path = optarg; break;
+			case 'v':
+				verbose_level = atoi(optarg);
+				if (verbose_level < 0) verbose_level = 0;
+				break;
+			default: usage(); break;
+		}
+	}
+	if (optind != argc) usage();
+
+	// All the nodes join one ring, whose routing tables have room for MAX_NODES nodes
+	if (node_count < 2 || node_count > MAX_NODES) {
+		error("The number of nodes must be between 2 and %d.\n", MAX_NODES);
+	}
+	if (kill_count < 0 || kill_count > node_count - 2) {
+		error("At least 2 nodes must be left after the kills.\n");
+	}
+	if (message_count < 0 || rate < 0 || chords_per_node < 0) {
+		usage();
+	}
+	if (payload_size < 1 || payload_size > MAX_PAYLOAD_SIZE) {
+		error("The payload size must be between 1 and %d bytes.\n", MAX_PAYLOAD_SIZE);
+	}
+
+	// Writing to a node which exited must not kill us
+	signal(SIGPIPE, SIG_IGN);
+	srand(time(NULL));
+
+	printf("Starting %d nodes on ports %d to %d.\n", node_count, base_port, base_port + node_count - 1);
+	fflush(stdout);
+	start_ring(node_count);
+	if (chords_per_node > 0) {
+		add_chords(chords_per_node);
+	}
+
+	long long converged_ms = measure_convergence(monotonic_us());
+	if (converged_ms < 0) {
+		stop_ring();
+		error("The ring didn't converge within %d ms.\n", CONVERGENCE_TIMEOUT_MS);
+	}
+	printf("Ring converged in %lld ms after the joins.\n", converged_ms);
+	fflush(stdout);
+
+	if (message_count > 0) {
+		run_traffic(message_count, rate, payload_size);
+	}
+
+	if (kill_count > 0) {
+		kill_nodes(kill_count);
+		long long kill_us = monotonic_us();
+		converged_ms = measure_convergence(kill_us);
+		if (converged_ms < 0) {
+			printf("Routing didn't converge within %d ms.\n", CONVERGENCE_TIMEOUT_MS);
+		} else {
+			printf("Routing converged in %lld ms after the kills.\n", converged_ms);
+		}
+	}
+
+	stop_ring();
+	return 0;
+}
@@ -2,6 +2,7 @@
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <signal.h>
@@ -18,15 +19,33 @@
 
 #include "main.h"
 
-enum InputState input_state = COMMAND;
-
 fd_set select_inputs;
-int public_socket = -1;
+fd_set select_outputs;
+long long loop_wakeup_us;
 
+// The passive socket used for accepting incoming connections. Shared by the rings we are in.
+static int public_socket = -1;
 static bool should_exit = false;
 static char stdin_buffer[USER_COMMAND_BUF_SIZE];
 static int stdin_buffer_index;
 
+// The rings we are in or were in, each with its own context. Free slots are NULL.
+// The user commands apply to the current ring, which is chosen with the ring command.
+static NodeContext *rings[MAX_RINGS];
+static int current_ring;
+// The node server address, for the contexts of the rings joined later
+static char *ns_addr_str, *ns_port_str;
+
+// An accepted connection which didn't say yet which ring it's for. Only used while we are in
+// several rings. See route_arrival()
+typedef struct Arrival {
+	// `-1` if the slot is free
+	int socket;
+	char ip_addr[IPV4_ADDR_STR_SIZE];
+	long long deadline_ms;
+} Arrival;
+static Arrival arrivals[MAX_PENDING_CONNECTIONS];
+
 void copy_node(Node *dest, Node *src) {
 	dest->id = src->id;
 	strcpy(dest->ip_addr, src->ip_addr);
@@ -34,47 +53,140 @@ void copy_node(Node *dest, Node *src) {
 }
 
 
+// Rings
+
+static int count_rings(void) {
+	int count = 0;
+	for (int i = 0; i < MAX_RINGS; i++) {
+		if (rings[i] != NULL) count++;
+	}
+	return count;
+}
+
+// Returns the slot of the ring with the tag, or -1. The tag of the first ring is empty until it's
+// joined with the join or ring command.
+static int find_ring(const char *ring_tag) {
+	for (int i = 0; i < MAX_RINGS; i++) {
+		if (rings[i] != NULL && strcmp(rings[i]->ring_tag, ring_tag) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static bool is_leaving_any_ring(void) {
+	for (int i = 0; i < MAX_RINGS; i++) {
+		if (rings[i] != NULL && rings[i]->connection_state == LEAVING) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Makes `ring_tag` the ring which the user commands apply to. The current context is reused if we
+// aren't in a ring with it, and otherwise a new context is made. When all the slots are taken, the
+// context of a ring we've left is reused. Returns `false` if we're in MAX_RINGS rings.
+static bool use_ring(const char *ring_tag) {
+	int index = find_ring(ring_tag);
+	if (index == -1 && ctx->connection_state == DISCONNECTED) {
+		index = current_ring;
+	}
+	if (index == -1) {
+		for (index = 0; index < MAX_RINGS && rings[index] != NULL; index++);
+	}
+	if (index == MAX_RINGS) {
+		for (index = 0; index < MAX_RINGS && rings[index]->connection_state != DISCONNECTED; index++);
+		if (index == MAX_RINGS) {
+			return false;
+		}
+	} else if (rings[index] == NULL) {
+		Node self = ctx->self;
+		rings[index] = new_context();
+		ctx = rings[index];
+		copy_node(&ctx->self, &self);
+		init_heartbeat();
+		init_ns(ns_addr_str, ns_port_str);
+		FD_SET(ctx->ns_socket, &select_inputs);
+	}
+
+	if (index != current_ring) {
+		printf("Commands now apply to ring %s.\n", ring_tag[0] != '\0' ? ring_tag : "-");
+	}
+	current_ring = index;
+	ctx = rings[index];
+	strcpy(ctx->ring_tag, ring_tag);
+	return true;
+}
+
+static void print_rings(void) {
+	static const char *state_names[] = {
+		[DISCONNECTED] = "disconnected",
+		[AWAITING_NODE_LIST] = "joining",
+		[AWAITING_USER_SELECTION] = "joining",
+		[CONNECTING] = "joining",
+		[CONNECTED] = "connected",
+		[LEAVING] = "leaving",
+	};
+	printf("\
++------+----+--------------+-------------+\n\
+| Ring | ID | State        | Connections |\n\
++------+----+--------------+-------------+\n\
+");
+	for (int i = 0; i < MAX_RINGS; i++) {
+		NodeContext *ring = rings[i];
+		if (ring == NULL) continue;
+		int connection_count = 0;
+		for (int j = 0; j < MAX_CONNECTIONS; j++) {
+			if (ring->connections[j].socket != -1) connection_count++;
+		}
+		printf("| %-3s %c| "NODE_ID_OUT" | %-12s | %11d |\n", ring->ring_tag[0] != '\0' ? ring->ring_tag : "-", i == current_ring ? '*' : ' ',
+			ring->self.id, state_names[ring->connection_state], connection_count);
+	}
+	printf("+------+----+--------------+-------------+\n");
+	printf("Commands apply to the ring marked with *.\n");
+}
+
+
 // Handling user commands
 // sizeof(cmd_name) returns the size of the cmd_name string plus one (for the null character)
 #define COMPARE_COMMAND(cmd_name) (strncmp(input_lowercase, cmd_name, sizeof(cmd_name) - 1) == 0 && (input_lowercase[sizeof(cmd_name) - 1] == '\0' || isspace(input_lowercase[sizeof(cmd_name) - 1])))
 #define sscanf_alt(cmd_name, short_cmd_name, args, arg_count, ...) (sscanf(input, cmd_name " " args, __VA_ARGS__) == arg_count || sscanf(input, short_cmd_name " " args, __VA_ARGS__) == arg_count)
-static void handle_user_input(int fd, char *input) {
+bool handle_user_input(int fd, char *input) {
 	(void) fd; // Unused but part of the read_lines API
 
-	if (input_state == JOIN_NODE_SELECTION || input_state == CHORD_NODE_SELECTION) {
+	if (ctx->input_state == JOIN_NODE_SELECTION || ctx->input_state == CHORD_NODE_SELECTION) {
 		NodeID id = -1;
-		if (sscanf(input, NODE_ID_IN, &id) != 1 && input_state == JOIN_NODE_SELECTION) {
+		if (sscanf(input, NODE_ID_IN, &id) != 1 && ctx->input_state == JOIN_NODE_SELECTION) {
 			// Cancel the operation if the input is invalid
 			goto invalid_id;
 		}
 
-		if (input_state == CHORD_NODE_SELECTION && (self.id == id || find_connection_by_node_id(id) != NULL)) {
+		if (ctx->input_state == CHORD_NODE_SELECTION && (ctx->self.id == id || find_connection_by_node_id(id) != NULL)) {
 			goto invalid_id;
 		}
-		for (int i = 0; i < node_arr.length; i++) {
-			Node node = node_arr.nodes[i];
-			if (node.id == id) {
-				if (input_state == JOIN_NODE_SELECTION) {
-					copy_node(&succ, &node);
-					v_printf("Joining ring %s with my ID as "NODE_ID_OUT" using the successor with ID "NODE_ID_OUT" at %s:%s.\n", ring_id_str, self.id, succ.id, succ.ip_addr, succ.tcp_port);
-					join_ring();
-				} else if (input_state == CHORD_NODE_SELECTION) {
-					create_outbound_chord(&node);
-				}
-				input_state = COMMAND;
-				return;
+		const Node *selected = find_node(&ctx->node_arr, id);
+		if (selected != NULL) {
+			Node node = *selected;
+			if (ctx->input_state == JOIN_NODE_SELECTION) {
+				copy_node(&ctx->succ, &node);
+				v_printf("Joining ring %s with my ID as "NODE_ID_OUT" using the successor with ID "NODE_ID_OUT" at %s:%s.\n", ctx->ring_id_str, ctx->self.id, ctx->succ.id, ctx->succ.ip_addr, ctx->succ.tcp_port);
+				join_ring();
+			} else if (ctx->input_state == CHORD_NODE_SELECTION) {
+				create_outbound_chord(&node);
 			}
+			ctx->input_state = COMMAND;
+			return true;
 		}
-		// Execution exits the loop if the node ID wasn't in the table
+		// The node ID wasn't in the table
 
 		invalid_id:
 		printf("Invalid ID. Operation cancelled.\n");
-		if (input_state == JOIN_NODE_SELECTION) {
-			connection_state = DISCONNECTED;
+		if (ctx->input_state == JOIN_NODE_SELECTION) {
+			ctx->connection_state = DISCONNECTED;
 		}
 		fflush(stdout);
-		input_state = COMMAND;
-		return;
+		ctx->input_state = COMMAND;
+		return true;
 	}
 
 	char input_lowercase[USER_COMMAND_BUF_SIZE];
@@ -85,95 +197,173 @@ static void handle_user_input(int fd, char *input) {
 	}
 
 	if (COMPARE_COMMAND("join") || COMPARE_COMMAND("j")) {
-		if (sscanf(input, "%*s %3s " NODE_ID_IN, ring_id_str, &self.id) != 2) {
+		char ring_id_str[4];
+		NodeID id;
+		if (sscanf(input, "%*s %3s " NODE_ID_IN, ring_id_str, &id) != 2) {
 			printf("Missing parameters for join command.\n");
-			return;
+			return true;
 		}
 		if (strlen(ring_id_str) != 3) {
 			printf("Wrong length for ring ID.\n");
-			return;
+			return true;
+		}
+		// Joining another ring while in one uses a new context
+		if (strcmp(ring_id_str, ctx->ring_tag) != 0 && !use_ring(ring_id_str)) {
+			printf("We can't be in more than %d rings at once. Leave one of them first.\n", MAX_RINGS);
+			return true;
 		}
 
-		if (connection_state != DISCONNECTED) {
+		if (ctx->connection_state != DISCONNECTED) {
 			printf("We are already connected to a ring or connecting to one. Use the leave command first.\n");
 		} else {
-			connection_state = AWAITING_NODE_LIST;
-			node_list_action = JOIN_ACTION;
-			request_node_list(ring_id_str);
+			strcpy(ctx->ring_id_str, ring_id_str);
+			ctx->self.id = id;
+			ctx->connection_state = AWAITING_NODE_LIST;
+			request_node_list(JOIN_ACTION, ctx->ring_id_str);
+		}
+	} else if (COMPARE_COMMAND("ring") || COMPARE_COMMAND("r")) {
+		char ring_tag[4];
+		if (sscanf(input, "%*s %3s", ring_tag) != 1) {
+			print_rings();
+			return true;
 		}
+		if (strlen(ring_tag) != 3) {
+			printf("Wrong length for ring ID.\n");
+			return true;
+		}
+		if (!use_ring(ring_tag)) {
+			printf("We can't be in more than %d rings at once. Leave one of them first.\n", MAX_RINGS);
+		}
+
 	} else if (COMPARE_COMMAND("leave") || COMPARE_COMMAND("l")) {
-		if (connection_state == DISCONNECTED) {
+		if (ctx->connection_state == DISCONNECTED) {
 			printf("We are not connected to a ring.\n");
+		} else if (ctx->connection_state == LEAVING) {
+			printf("We are already leaving the ring.\n");
 		} else {
-			leave_ring();
-			printf("Left the ring.\n");
+			leave_ring_gracefully();
 		}
 
 	} else if (COMPARE_COMMAND("direct join") || COMPARE_COMMAND("dj")) {
-		if (sscanf(input, COMPARE_COMMAND("dj") ? "%*s "NODE_ID_IN" "NODE_ID_IN" %15s %5s" : "%*s %*s "NODE_ID_IN" "NODE_ID_IN" %15s %5s", &self.id, &succ.id, succ.ip_addr, succ.tcp_port) != 4) {
+		if (sscanf(input, COMPARE_COMMAND("dj") ? "%*s "NODE_ID_IN" "NODE_ID_IN" %15s %5s" : "%*s %*s "NODE_ID_IN" "NODE_ID_IN" %15s %5s", &ctx->self.id, &ctx->succ.id, ctx->succ.ip_addr, ctx->succ.tcp_port) != 4) {
 			printf("Missing parameters for direct join command.\n");
-			return;
+			return true;
 		}
 
-		if (succ.id == self.id) {
-			v_printf("Initializing an empty ring without registering with the node server. My ID is "NODE_ID_OUT".\n", self.id);
-			ring_id_str[0] = '\0';
-			copy_node(&succ, &self);
-			copy_node(&second_succ, &self);
-			connection_state = CONNECTED;
-			awaiting_pred = false;
-			awaiting_succ = false;
+		if (ctx->succ.id == ctx->self.id) {
+			v_printf("Initializing an empty ring without registering with the node server. My ID is "NODE_ID_OUT".\n", ctx->self.id);
+			ctx->ring_id_str[0] = '\0';
+			copy_node(&ctx->succ, &ctx->self);
+			copy_node(&ctx->second_succ, &ctx->self);
+			init_routing();
+			start_saving_routing_state();
+			ctx->connection_state = CONNECTED;
+			ctx->awaiting_pred = false;
+			ctx->awaiting_succ = false;
 		} else {
-			v_printf("Joining ring with my ID as "NODE_ID_OUT" the successor with ID "NODE_ID_OUT" at %s:%s without registering with the node server.\n", self.id, succ.id, succ.ip_addr, succ.tcp_port);
-			ring_id_str[0] = '\0';
+			v_printf("Joining ring with my ID as "NODE_ID_OUT" the successor with ID "NODE_ID_OUT" at %s:%s without registering with the node server.\n", ctx->self.id, ctx->succ.id, ctx->succ.ip_addr, ctx->succ.tcp_port);
+			ctx->ring_id_str[0] = '\0';
+			join_ring();
+		}
+
+	} else if (COMPARE_COMMAND("rejoin") || COMPARE_COMMAND("rj")) {
+		// Joins the rings saved in the state file at the same place, with the tables we had
+		int rejoined = 0;
+		for (int entry = 0; entry < MAX_RINGS; entry++) {
+			StoredTopology topology;
+			if (!get_stored_topology(entry, &topology)) continue;
+			const char *ring_name = topology.ring_tag[0] != '\0' ? topology.ring_tag : "-";
+			if (topology.succ.id == topology.self.id) {
+				printf("We were the only node in ring %s. Use the direct join command to start it again.\n", ring_name);
+				continue;
+			}
+			if ((strcmp(topology.ring_tag, ctx->ring_tag) != 0 || ctx->connection_state != DISCONNECTED) && !use_ring(topology.ring_tag)) {
+				printf("We can't be in more than %d rings at once. Leave one of them first.\n", MAX_RINGS);
+				break;
+			}
+			if (ctx->connection_state != DISCONNECTED) {
+				printf("We are already in ring %s. Skipping it.\n", ring_name);
+				continue;
+			}
+			strcpy(ctx->ring_id_str, topology.ring_id_str);
+			ctx->self.id = topology.self.id;
+			copy_node(&ctx->succ, &topology.succ);
+			printf("Rejoining ring %s with ID "NODE_ID_OUT" via the successor "NODE_ID_OUT" at %s:%s.\n", ring_name, ctx->self.id, ctx->succ.id, ctx->succ.ip_addr, ctx->succ.tcp_port);
 			join_ring();
+			rejoined++;
+		}
+		if (rejoined == 0) {
+			printf("There are no saved rings to rejoin.\n");
 		}
 
 	} else if (COMPARE_COMMAND("chord") || COMPARE_COMMAND("c")) {
-		if (connection_state != CONNECTED) {
+		if (ctx->connection_state != CONNECTED) {
 			printf("We are not connected to a ring.\n");
-		} else if (outbound_chord_conn != NULL) {
-			printf("There is already an outbound chord.\n");
 		} else {
-			node_list_action = CHORD_ACTION;
-			request_node_list(ring_id_str);
+			request_node_list(CHORD_ACTION, ctx->ring_id_str);
 		}
 
-	} else if (COMPARE_COMMAND("remove chord") || COMPARE_COMMAND("rc")) {
-		if (connection_state != CONNECTED) {
+	} else if (COMPARE_COMMAND("direct chord") || COMPARE_COMMAND("dc")) {
+		Node node;
+		if (sscanf(input, COMPARE_COMMAND("dc") ? "%*s "NODE_ID_IN" %15s %5s" : "%*s %*s "NODE_ID_IN" %15s %5s", &node.id, node.ip_addr, node.tcp_port) != 3) {
+			printf("Missing parameters for direct chord command.\n");
+			return true;
+		}
+		if (ctx->connection_state != CONNECTED) {
 			printf("We are not connected to a ring.\n");
-		} else if (outbound_chord_conn == NULL) {
-			printf("There is currently no outbound chord.\n");
 		} else {
-			NodeID id = outbound_chord_conn->node_id;
-			close_connection(outbound_chord_conn);
-			if (!find_connection_by_node_id(id)) {
-				remove_routing_neighbor(id);
+			create_outbound_chord(&node);
+		}
+
+	} else if (COMPARE_COMMAND("remove chord") || COMPARE_COMMAND("rc")) {
+		NodeID id = -1;
+		sscanf(input, COMPARE_COMMAND("rc") ? "%*s "NODE_ID_IN"" : "%*s %*s "NODE_ID_IN"", &id);
+
+		// Without an ID, the chord is only removed if there's just one
+		struct Connection *chord = NULL;
+		int chord_count = 0;
+		for (int i = 0; i < MAX_CONNECTIONS; i++) {
+			struct Connection *conn = &ctx->connections[i];
+			if (conn->socket != -1 && conn->outbound_chord == USER_CHORD && (id == -1 || conn->node_id == id)) {
+				chord = conn;
+				chord_count++;
 			}
-			printf("Outbound chord with node "NODE_ID_OUT" removed.\n", id);
+		}
+
+		if (ctx->connection_state != CONNECTED) {
+			printf("We are not connected to a ring.\n");
+		} else if (chord_count == 0) {
+			printf(id == -1 ? "There is currently no outbound chord.\n" : "There is no outbound chord with that node.\n");
+		} else if (chord_count > 1) {
+			printf("There are %d outbound chords. Use remove chord <id> to choose which one to remove.\n", chord_count);
+		} else {
+			remove_outbound_chord(chord);
 		}
 
 	} else if (COMPARE_COMMAND("exit") || COMPARE_COMMAND("x")) {
 		should_exit = true;
 
 	} else if (COMPARE_COMMAND("show topology") || COMPARE_COMMAND("st")) {
-		if (connection_state == CONNECTED) {
+		if (ctx->connection_state == CONNECTED) {
 			printf("\
 +----------------+----+-----------------+-------+\n\
 | Node           | ID | IP address      | Port  |\n\
 +----------------+----+-----------------+-------+\n\
 ");
-			if (pred_conn != NULL && pred_conn->node_id != -1)
-				printf("| Predecessor    | "NODE_ID_OUT" | %-15s |   -   |\n", pred_conn->node_id, pred_conn->ip_addr);
-			printf("| This node      | "NODE_ID_OUT" | %-15s | %-5s |\n", self.id, self.ip_addr, self.tcp_port);
-			printf("| Successor      | "NODE_ID_OUT" | %-15s | %-5s |\n", succ.id, succ.ip_addr, succ.tcp_port);
-			printf("| Second succ.   | "NODE_ID_OUT" | %-15s | %-5s |\n", second_succ.id, second_succ.ip_addr, second_succ.tcp_port);
-			if (outbound_chord_conn != NULL) {
-				printf("| Outbound chord | "NODE_ID_OUT" | %-15s | %-5s |\n", outbound_chord_conn->node_id, outbound_chord_conn->ip_addr, outbound_chord_conn->tcp_port);
+			if (ctx->pred_conn != NULL && ctx->pred_conn->node_id != -1)
+				printf("| Predecessor    | "NODE_ID_OUT" | %-15s |   -   |\n", ctx->pred_conn->node_id, ctx->pred_conn->ip_addr);
+			printf("| This node      | "NODE_ID_OUT" | %-15s | %-5s |\n", ctx->self.id, ctx->self.ip_addr, ctx->self.tcp_port);
+			printf("| Successor      | "NODE_ID_OUT" | %-15s | %-5s |\n", ctx->succ.id, ctx->succ.ip_addr, ctx->succ.tcp_port);
+			printf("| Second succ.   | "NODE_ID_OUT" | %-15s | %-5s |\n", ctx->second_succ.id, ctx->second_succ.ip_addr, ctx->second_succ.tcp_port);
+			if (ctx->standby_conn != NULL) {
+				printf("| Standby        | "NODE_ID_OUT" | %-15s | %-5s |\n", ctx->standby_conn->node_id, ctx->standby_conn->ip_addr, ctx->standby_conn->tcp_port);
 			}
 			for (int i = 0; i < MAX_CONNECTIONS; i++) {
-				struct Connection *conn = &connections[i];
-				if (conn->socket != -1 && is_inbound_chord(conn)) {
+				struct Connection *conn = &ctx->connections[i];
+				if (conn->socket != -1 && conn->outbound_chord != NO_OUTBOUND_CHORD) {
+					const char *label = conn->outbound_chord == FINGER_CHORD ? "Auto chord    " : conn->outbound_chord == TRAFFIC_CHORD ? "Traffic chord " : "Outbound chord";
+					printf("| %s | "NODE_ID_OUT" | %-15s | %-5s |\n", label, conn->node_id, conn->ip_addr, conn->tcp_port);
+				} else if (conn->socket != -1 && is_inbound_chord(conn)) {
 					printf("| Inbound chord  | "NODE_ID_OUT" | %-15s |   -   |\n", conn->node_id, conn->ip_addr);
 				}
 			}
@@ -186,27 +376,27 @@ static void handle_user_input(int fd, char *input) {
 		NodeID recipient_id;
 		if (sscanf(input, COMPARE_COMMAND("sr") ? "%*s "NODE_ID_IN"" : "%*s %*s "NODE_ID_IN"", &recipient_id) != 1) {
 			printf("Missing parameters for the show routing command.\n");
-			return;
+			return true;
 		}
 
-		if (recipient_id == self.id) {
+		if (recipient_id == ctx->self.id) {
 			printf("There's no need for routing when you're sending messages to yourself.\n");
-			return;
+			return true;
 		}
 
 		NodeIndex recipient = get_recipient_index(recipient_id, false);
 		if (recipient == -1) {
 			printf("There are no known valid paths to the node "NODE_ID_OUT". It might not be in the ring.\n", recipient_id);
-			return;
+			return true;
 		}
 
-		printf("Possible paths from the node "NODE_ID_OUT" to the node "NODE_ID_OUT":\n", self.id, recipient_id);
+		printf("Possible paths from the node "NODE_ID_OUT" to the node "NODE_ID_OUT":\n", ctx->self.id, recipient_id);
 
 		for (NodeIndex neighbor = 0; neighbor < MAX_NEIGHBORS; neighbor++) {
-			NodeID neighbor_id = neighbor_ids[neighbor];
+			NodeID neighbor_id = ctx->neighbor_ids[neighbor];
 			if (neighbor_id != -1) {
 				printf("    Via "NODE_ID_OUT": ", neighbor_id);
-				Path *path = &routing_table[recipient][neighbor];
+				Path *path = &ctx->routing_table[recipient][neighbor];
 				if (path->hop_count == INVALID_PATH) {
 					printf("(no valid path)\n");
 				} else {
@@ -221,21 +411,95 @@ static void handle_user_input(int fd, char *input) {
 		NodeID recipient_id;
 		if (sscanf(input, COMPARE_COMMAND("sp") ? "%*s "NODE_ID_IN"" : "%*s %*s "NODE_ID_IN"", &recipient_id) != 1) {
 			printf("Missing parameters for the show routing command.\n");
-			return;
+			return true;
 		}
 
 		NodeIndex recipient = get_recipient_index(recipient_id, false);
 		if (recipient == -1) {
 			printf("There are no known valid paths to the node "NODE_ID_OUT". It might not be in the ring.\n", recipient_id);
-			return;
+			return true;
 		}
 
-		NodeIndex neighbor = forwarding_table[recipient];
-		Path *path = &routing_table[recipient][neighbor];
+		NodeIndex neighbor = ctx->forwarding_table[recipient];
+		Path *path = &ctx->routing_table[recipient][neighbor];
 		char path_str[MAX_PATH_STR_SIZE];
 		path_to_string(path_str, recipient_id, path);
 		printf("Shortest path to "NODE_ID_OUT": %s\n", recipient_id, path_str);
 
+	} else if (COMPARE_COMMAND("rate limit") || COMPARE_COMMAND("rl")) {
+		double rate, burst;
+		NodeID neighbor_id = NO_NODE_ID;
+		int arg_count = sscanf(input, COMPARE_COMMAND("rl") ? "%*s %lf %lf "NODE_ID_IN"" : "%*s %*s %lf %lf "NODE_ID_IN"", &rate, &burst, &neighbor_id);
+		if (arg_count < 2) {
+			printf("Missing parameters for the rate limit command.\n");
+			return true;
+		}
+		if (rate < 0 || (arg_count == 3 && (neighbor_id < 0 || neighbor_id > MAX_NODE_ID))) {
+			printf("Invalid parameters for the rate limit command.\n");
+			return true;
+		}
+
+		set_rate_limit(neighbor_id, rate, burst);
+		if (neighbor_id == NO_NODE_ID) {
+			printf("Relayed messages to each neighbor are now limited to %.1f messages per second (burst of %.0f).\n", rate, burst);
+		} else {
+			printf("Relayed messages to the neighbor "NODE_ID_OUT" are now limited to %.1f messages per second (burst of %.0f).\n", neighbor_id, rate, burst);
+		}
+
+	} else if (COMPARE_COMMAND("heartbeat") || COMPARE_COMMAND("hb")) {
+		long int interval;
+		int threshold;
+		if (sscanf(input, "%*s %ld %d", &interval, &threshold) != 2) {
+			printf("Missing parameters for the heartbeat command.\n");
+			return true;
+		}
+		if (interval < 0 || threshold < 1) {
+			printf("Invalid parameters for the heartbeat command.\n");
+			return true;
+		}
+
+		set_heartbeat(interval, threshold);
+		if (interval == 0) {
+			printf("Heartbeats disabled.\n");
+		} else {
+			printf("Neighbors are now probed after %ld ms without messages and considered unreachable after %d unanswered probes.\n", interval, threshold);
+		}
+
+	} else if (COMPARE_COMMAND("standby") || COMPARE_COMMAND("sb")) {
+		char setting[4];
+		if (sscanf(input, "%*s %3s", setting) != 1 || (strcmp(setting, "on") != 0 && strcmp(setting, "off") != 0)) {
+			printf("Usage: standby <on|off>\n");
+			return true;
+		}
+		set_standby(strcmp(setting, "on") == 0);
+		printf("Standby connection to the second successor %s.\n", strcmp(setting, "on") == 0 ? "enabled" : "disabled");
+
+	} else if (COMPARE_COMMAND("auto chords") || COMPARE_COMMAND("ac")) {
+		char setting[4];
+		if (sscanf(input, COMPARE_COMMAND("ac") ? "%*s %3s" : "%*s %*s %3s", setting) != 1 || (strcmp(setting, "on") != 0 && strcmp(setting, "off") != 0)) {
+			printf("Usage: auto chords <on|off>\n");
+			return true;
+		}
+		set_auto_chords(strcmp(setting, "on") == 0);
+		printf("Automatic chords %s.\n", strcmp(setting, "on") == 0 ? "enabled" : "disabled");
+
+	} else if (COMPARE_COMMAND("traffic chords") || COMPARE_COMMAND("tc")) {
+		char setting[4];
+		if (sscanf(input, COMPARE_COMMAND("tc") ? "%*s %3s" : "%*s %*s %3s", setting) != 1 || (strcmp(setting, "on") != 0 && strcmp(setting, "off") != 0)) {
+			printf("Usage: traffic chords <on|off>\n");
+			return true;
+		}
+		set_traffic_chords(strcmp(setting, "on") == 0);
+		printf("Traffic chords %s.\n", strcmp(setting, "on") == 0 ? "enabled" : "disabled");
+
+	} else if (COMPARE_COMMAND("show stats") || COMPARE_COMMAND("ss")) {
+		printf("Relayed message counters per neighbor:\n");
+		print_rate_limit_stats();
+		printf("Sent and relayed messages per recipient:\n");
+		print_traffic_stats();
+		printf("Messages and bytes exchanged with other nodes:\n");
+		print_metrics();
+
 	} else if (COMPARE_COMMAND("message") ||  COMPARE_COMMAND("m")) {
 		NodeID recipient_id;
 		int chat_message_start = -1;
@@ -245,59 +509,291 @@ static void handle_user_input(int fd, char *input) {
 			input[chat_message_start] != ' '
 		) {
 			printf("Missing parameters for the message command.\n");
-			return;
+			return true;
 		}
 
 		// Make sure we get the entire message even if it starts with a whitespace character
 		char *chat_message = input + chat_message_start + 1;
 
-		if (recipient_id == self.id) {
-			printf("Node "NODE_ID_OUT" said: \"%s\"\n", self.id, chat_message);
-			return;
+		if (recipient_id == ctx->self.id) {
+			printf("Node "NODE_ID_OUT" said: \"%s\"\n", ctx->self.id, chat_message);
+			return true;
 		}
 
-		if (forward_message(self.id, recipient_id, chat_message)) {
+		if (forward_message(ctx->self.id, recipient_id, chat_message, NULL)) {
 			printf("Message sent.\n");
 		} else {
 			printf("Couldn't send a message to the node "NODE_ID_IN" because there are no known valid paths to that node. Check if you entered the correct ID.\n", recipient_id);
 		}
 
+	} else if (COMPARE_COMMAND("show loop") || COMPARE_COMMAND("sl")) {
+		print_loop_metrics();
+
+	} else if (COMPARE_COMMAND("slow handler") || COMPARE_COMMAND("sh")) {
+		long int ms;
+		if (sscanf(input, COMPARE_COMMAND("sh") ? "%*s %ld" : "%*s %*s %ld", &ms) != 1 || ms < 0) {
+			printf("Missing parameters for the slow handler command.\n");
+			return true;
+		}
+		set_slow_handler_threshold(ms);
+		if (ms > 0) {
+			printf("Handlers which take longer than %ld ms will be reported.\n", ms);
+		} else {
+			printf("Slow handlers will no longer be reported.\n");
+		}
+
+	} else if (COMPARE_COMMAND("dump log") || COMPARE_COMMAND("dl")) {
+		long count = -1;
+		sscanf(input, COMPARE_COMMAND("dl") ? "%*s %ld" : "%*s %*s %ld", &count);
+		dump_flight_recorder(stdout, count);
+
+	} else if (COMPARE_COMMAND("trace message") || COMPARE_COMMAND("tm")) {
+		NodeID recipient_id;
+		int chat_message_start = -1;
+		if (
+			sscanf(input, COMPARE_COMMAND("tm") ? "%*s "NODE_ID_IN"%n" : "%*s %*s "NODE_ID_IN"%n", &recipient_id, &chat_message_start) != 1 ||
+			chat_message_start == -1 ||
+			input[chat_message_start] != ' '
+		) {
+			printf("Missing parameters for the trace message command.\n");
+			return true;
+		}
+		char *chat_message = input + chat_message_start + 1;
+
+		if (recipient_id == ctx->self.id) {
+			printf("Node "NODE_ID_OUT" said: \"%s\"\n", ctx->self.id, chat_message);
+		} else if (strlen(chat_message) > TRACE_MAX_MESSAGE_LENGTH) {
+			printf("The message is too long to be traced. Traced messages have at most %d characters.\n", TRACE_MAX_MESSAGE_LENGTH);
+		} else if (!send_traced_message(recipient_id, chat_message)) {
+			printf("Couldn't send a message to the node "NODE_ID_IN" because there are no known valid paths to that node. Check if you entered the correct ID.\n", recipient_id);
+		}
+
 	} else {
 		printf("Unrecognized command: %s\n", input);
 	}
 	fflush(stdout);
+	return true;
 }
 
 
-static struct timespec timeout_instant;
-static void (*timeout_handler)(void) = NULL;
+void start_timer(Timer *timer, long int ms, void (*handler)(void)) {
+	long long now = monotonic_ms();
+	if (now < 0) {
+		warn("Couldn't get current time: %s", strerror(errno));
+		return;
+	}
+
+	if (!timer->active) {
+		timer->next = ctx->timers;
+		ctx->timers = timer;
+	}
+	timer->active = true;
+	timer->instant_ms = now + ms;
+	timer->handler = handler;
+}
+void stop_timer(Timer *timer) {
+	if (!timer->active) {
+		return;
+	}
+	for (Timer **t = &ctx->timers; *t != NULL; t = &(*t)->next) {
+		if (*t == timer) {
+			*t = timer->next;
+			break;
+		}
+	}
+	timer->active = false;
+}
+
+long long next_timer_instant(void) {
+	long long instant = -1;
+	for (Timer *t = ctx->timers; t != NULL; t = t->next) {
+		if (instant == -1 || t->instant_ms < instant) {
+			instant = t->instant_ms;
+		}
+	}
+	return instant;
+}
+
+int run_expired_timers(void) {
+	long long now = monotonic_ms();
+	if (now < 0) {
+		warn("Couldn't get current time: %s", strerror(errno));
+		return 0;
+	}
+
+	int count = 0;
+	bool found;
+	do {
+		found = false;
+		for (Timer *t = ctx->timers; t != NULL; t = t->next) {
+			if (t->instant_ms <= now) {
+				// Includes the time spent in the handlers called before this one
+				observe(&ctx->metrics.timer_lateness_us, monotonic_us() - t->instant_ms * 1000);
+				stop_timer(t);
+				t->handler();
+				count++;
+				found = true;
+				break;
+			}
+		}
+	} while (found);
+	return count;
+}
+
 
 void set_timeout(long int ms, void (*handler)(void)) {
-	if (timeout_handler != NULL) {
+	if (ctx->timeout_timer.active) {
 		dbg_warn("set_timeout(): There's already a timer running.");
 	}
+	start_timer(&ctx->timeout_timer, ms, handler);
+}
+void cancel_timeout(void) {
+	stop_timer(&ctx->timeout_timer);
+}
 
-	// Get the current time
-	if (clock_gettime(CLOCK_MONOTONIC, &timeout_instant) < 0) {
-		warn("Couldn't get current time: %s", strerror(errno));
-		return;
+
+bool accept_node_connection(int socket, const char *ip_addr) {
+	if (ctx->connection_state != CONNECTING && ctx->connection_state != CONNECTED) {
+		transport->close(socket);
+		warn("Unexpectedly received a TCP connection from %s.\n", ip_addr);
+		return false;
+	}
+
+	struct Connection *conn = NULL;
+	if (count_pending_connections() < MAX_PENDING_CONNECTIONS) {
+		conn = add_connection(socket);
+	}
+	if (conn == NULL) {
+		transport->close(socket);
+		warn("Couldn't accept a TCP connection from %s because we are handling too many node connections.\n", ip_addr);
+		return false;
 	}
 
-	// Add the timeout
-	timeout_instant.tv_sec += ms / (long int) 1e3;
-	timeout_instant.tv_nsec += ms * (long int) 1e6;
-	if (timeout_instant.tv_nsec > 1e9) {
-		timeout_instant.tv_sec++;
-		timeout_instant.tv_nsec -= 1e9;
+	strcpy(conn->ip_addr, ip_addr);
+	start_handshake(conn);
+	v_printf("Accepted TCP connection from %s.\n", ip_addr);
+	return true;
+}
+
+// While we are in several rings, an accepted connection waits here until the first line from the
+// node is in the socket buffer. Nodes in several rings send "RING <ring>" first, and the line is
+// consumed before the connection is handed to that ring. Other nodes go to the ring without a tag,
+// or to the first ring.
+static void add_arrival(int socket, const char *ip_addr) {
+	for (int i = 0; i < MAX_PENDING_CONNECTIONS; i++) {
+		Arrival *arrival = &arrivals[i];
+		if (arrival->socket == -1) {
+			arrival->socket = socket;
+			strcpy(arrival->ip_addr, ip_addr);
+			arrival->deadline_ms = monotonic_ms() + HANDSHAKE_TIMEOUT_MS;
+			FD_SET(socket, &select_inputs);
+			return;
+		}
 	}
+	transport->close(socket);
+	warn("Couldn't accept a TCP connection from %s because we are handling too many node connections.\n", ip_addr);
+}
 
-	timeout_handler = handler;
+static void drop_arrival(Arrival *arrival) {
+	FD_CLR(arrival->socket, &select_inputs);
+	transport->close(arrival->socket);
+	arrival->socket = -1;
 }
-void cancel_timeout(void) {
-	if (timeout_handler == NULL) {
+
+static void route_arrival(Arrival *arrival) {
+	char line[MAX_NODE_MESSAGE_SIZE];
+	ssize_t length = recv(arrival->socket, line, sizeof(line) - 1, MSG_PEEK);
+	if (length == -1 && errno == EINTR) {
+		return;
+	}
+	if (length <= 0) {
+		v_printf("The node at %s closed the connection before saying which ring it's for.\n", arrival->ip_addr);
+		drop_arrival(arrival);
+		return;
+	}
+	line[length] = '\0';
+	char *line_end = strchr(line, '\n');
+	if (line_end == NULL && length < (ssize_t) sizeof(line) - 1) {
+		// Wait for the rest of the line
 		return;
 	}
-	timeout_handler = NULL;
+
+	char ring_tag[4];
+	int index;
+	if (line_end != NULL && sscanf(line, "RING %3s", ring_tag) == 1) {
+		index = find_ring(ring_tag);
+		// The ring without a tag takes connections for rings we don't know by name
+		if (index == -1) index = find_ring("");
+		if (index == -1) {
+			warn("A node at %s connected to us for ring %s, which we aren't in. Closing the connection.\n", arrival->ip_addr, ring_tag);
+			drop_arrival(arrival);
+			return;
+		}
+		if (read(arrival->socket, line, line_end - line + 1) == -1) {
+			drop_arrival(arrival);
+			return;
+		}
+	} else {
+		index = find_ring("");
+		if (index == -1) index = 0;
+	}
+
+	// The ring's connection adds it back
+	int socket = arrival->socket;
+	FD_CLR(socket, &select_inputs);
+	arrival->socket = -1;
+	ctx = rings[index];
+	accept_node_connection(socket, arrival->ip_addr);
+}
+
+static void route_arrivals(fd_set *readable) {
+	long long now = monotonic_ms();
+	for (int i = 0; i < MAX_PENDING_CONNECTIONS; i++) {
+		Arrival *arrival = &arrivals[i];
+		if (arrival->socket == -1) continue;
+		if (FD_ISSET(arrival->socket, readable)) {
+			route_arrival(arrival);
+		} else if (arrival->deadline_ms <= now) {
+			v_printf("The node at %s didn't say which ring it's for in time. Closing the connection.\n", arrival->ip_addr);
+			drop_arrival(arrival);
+		}
+	}
+}
+
+// Returns the earliest deadline of the arrivals, or -1 if there are none
+static long long next_arrival_deadline(void) {
+	long long deadline = -1;
+	for (int i = 0; i < MAX_PENDING_CONNECTIONS; i++) {
+		if (arrivals[i].socket != -1 && (deadline == -1 || arrivals[i].deadline_ms < deadline)) {
+			deadline = arrivals[i].deadline_ms;
+		}
+	}
+	return deadline;
+}
+
+// Accepts every connection waiting in the listen backlog. The listening socket is nonblocking, so
+// this stops when the backlog is empty. Each connection stays pending until the node sends the
+// ENTRY, PRED or CHORD message, and several nodes can be in that handshake at once.
+static void accept_node_connections(void) {
+	while (true) {
+		struct sockaddr_in addr;
+		socklen_t addrlen = sizeof(addr);
+
+		int socket = accept(public_socket, (struct sockaddr *)&addr, &addrlen);
+		if (socket == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				warn("Couldn't accept a TCP connection: %s\n", strerror(errno));
+			}
+			return;
+		}
+		if (count_rings() == 1) {
+			ctx = rings[0];
+			accept_node_connection(socket, inet_ntoa(addr.sin_addr));
+		} else {
+			add_arrival(socket, inet_ntoa(addr.sin_addr));
+		}
+	}
 }
 
 
@@ -310,9 +806,12 @@ int main(int argc, char **argv) {
 	// Argument parsing
 
 	char *initial_command = NULL;
+	int listen_backlog = DEFAULT_LISTEN_BACKLOG;
+	char *metrics_port = NULL;
+	char *state_path = NULL;
 
 	while (true) {
-		int opt = getopt(argc, argv, "x:v:");
+		int opt = getopt(argc, argv, "x:v:l:b:m:s:");
 		if (opt == -1) break;
 		switch (opt) {
 			case 'x':
@@ -324,8 +823,25 @@ int main(int argc, char **argv) {
 				if (verbose_level < 0) verbose_level = 0;
 				break;
 
+			case 'l':
+				record_level = atoi(optarg);
+				break;
+
+			case 'b':
+				listen_backlog = atoi(optarg);
+				if (listen_backlog < 1) listen_backlog = 1;
+				break;
+
+			case 'm':
+				metrics_port = optarg;
+				break;
+
+			case 's':
+				state_path = optarg;
+				break;
+
 			default:
-				fprintf(stderr, "Usage: COR [-x <command>] [-v <verbosity level>] <own IP> <own TCP port> [<node server IP> <node server UDP port>]\n");
+				fprintf(stderr, "Usage: COR [-x <command>] [-v <verbosity level>] [-l <flight recorder level>] [-b <listen backlog>] [-m <metrics TCP port>] [-s <state file>] <own IP> <own TCP port> [<node server IP> <node server UDP port>]\n");
 				exit(1);
 				break;
 		}
@@ -333,20 +849,27 @@ int main(int argc, char **argv) {
 
 	// Verificar se o número de argumentos é válido
 	if (argc < optind+2) {
-		fprintf(stderr, "Usage: COR [-x <command>] [-v <verbosity level>] <own IP> <own TCP port> [<node server IP> <node server UDP port>]\n");
+		fprintf(stderr, "Usage: COR [-x <command>] [-v <verbosity level>] [-l <flight recorder level>] [-b <listen backlog>] [-m <metrics TCP port>] [-s <state file>] <own IP> <own TCP port> [<node server IP> <node server UDP port>]\n");
 		exit(1);
 	}
 
-	strcpy(self.ip_addr, argv[optind+0]);
-	strcpy(self.tcp_port, argv[optind+1]);
-	char *ns_addr_str = (argc >= optind+4) ? argv[optind+2] : "193.136.138.142";
-	char *ns_port_str = (argc >= optind+4) ? argv[optind+3] : "59000";
-
+	rings[0] = ctx = new_context();
+	strcpy(ctx->self.ip_addr, argv[optind+0]);
+	strcpy(ctx->self.tcp_port, argv[optind+1]);
+	ns_addr_str = (argc >= optind+4) ? argv[optind+2] : "193.136.138.142";
+	ns_port_str = (argc >= optind+4) ? argv[optind+3] : "59000";
+	for (int i = 0; i < MAX_PENDING_CONNECTIONS; i++) {
+		arrivals[i].socket = -1;
+	}
 
 	init_connections_array();
+	init_heartbeat();
+	if (state_path != NULL) {
+		open_routing_store(state_path);
+	}
 
 	// Connection to node server
-	int ns_socket = init_ns(ns_addr_str, ns_port_str);
+	init_ns(ns_addr_str, ns_port_str);
 
 	// TCP Server
 	{
@@ -365,58 +888,64 @@ int main(int argc, char **argv) {
 		hints.ai_flags = AI_PASSIVE;
 
 		struct addrinfo *ai;
-		int errcode = getaddrinfo(NULL, self.tcp_port, &hints, &ai);
+		int errcode = getaddrinfo(NULL, ctx->self.tcp_port, &hints, &ai);
 		if (errcode != 0)
 			error("Couldn't get the node server address: %s\n", gai_strerror(errcode));
 		ssize_t n = bind(public_socket, ai->ai_addr, ai->ai_addrlen);
 		freeaddrinfo(ai);
 		if (n == -1)
-			error("Couldn't bind TCP server to port %s: %s\n", self.tcp_port, strerror(errno));
-		if (listen(public_socket, 10) == -1)
+			error("Couldn't bind TCP server to port %s: %s\n", ctx->self.tcp_port, strerror(errno));
+		if (listen(public_socket, listen_backlog) == -1)
 			error("Couldn't listen for connections to the TCP server: %s\n", strerror(errno));
+		// Accepted sockets don't inherit this, so writes to the nodes are still blocking
+		if (fcntl(public_socket, F_SETFL, O_NONBLOCK) == -1)
+			error("Couldn't make the TCP server socket nonblocking: %s\n", strerror(errno));
 
-		printf("TCP server listening on port %s.\n", self.tcp_port);
+		printf("TCP server listening on port %s.\n", ctx->self.tcp_port);
 	}
 
 	int stdin_fd = fileno(stdin);
 
 	FD_ZERO(&select_inputs);
+	FD_ZERO(&select_outputs);
 	FD_SET(stdin_fd, &select_inputs);
-	FD_SET(ns_socket, &select_inputs);
+	FD_SET(ctx->ns_socket, &select_inputs);
 	FD_SET(public_socket, &select_inputs);
 	/*FD_SET(to_read_pipe, &select_inputs);*/
+	if (metrics_port != NULL) {
+		init_metrics_endpoint(metrics_port);
+	}
 
 	if (initial_command != NULL) {
 		printf("%s\n", initial_command);
 		handle_user_input(stdin_fd, initial_command);
 	}
 
-	// Main select loop
-	while (!should_exit) {
-		struct timespec now;
+	// Main select loop. A graceful leave is allowed to finish before exiting.
+	while (!should_exit || is_leaving_any_ring()) {
 		struct timeval select_timeout;
 		struct timeval *select_timeout_ptr;
 
-		// Calculate time until timeout
-		if (timeout_handler != NULL) {
-			// Get the current time
-			if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+		// Calculate time until the next timer of any ring expires
+		long long next_instant = next_arrival_deadline();
+		for (int r = 0; r < MAX_RINGS; r++) {
+			if (rings[r] == NULL) continue;
+			ctx = rings[r];
+			long long instant = next_timer_instant();
+			if (instant != -1 && (next_instant == -1 || instant < next_instant)) {
+				next_instant = instant;
+			}
+		}
+		if (next_instant != -1) {
+			long long now = monotonic_ms();
+			if (now < 0) {
 				warn("Couldn't get current time: %s", strerror(errno));
 				select_timeout_ptr = NULL;
 			} else {
-				if (now.tv_sec > timeout_instant.tv_sec || (now.tv_sec == timeout_instant.tv_sec && now.tv_nsec > timeout_instant.tv_nsec)) {
-					// If the timeout has passed, make select return immediately
-					select_timeout.tv_sec = 0;
-					select_timeout.tv_usec = 0;
-				} else {
-					// Calculate the time left
-					select_timeout.tv_sec = timeout_instant.tv_sec - now.tv_sec;
-					select_timeout.tv_usec = ((timeout_instant.tv_nsec - now.tv_nsec) / (long) 1e3) + 1;
-					if (select_timeout.tv_usec < 0) {
-						select_timeout.tv_sec--;
-						select_timeout.tv_usec += 1e6;
-					}
-				}
+				// If the timer has expired, make select return immediately
+				long long ms_left = next_instant > now ? next_instant - now : 0;
+				select_timeout.tv_sec = ms_left / 1000;
+				select_timeout.tv_usec = (ms_left % 1000) * 1000;
 				select_timeout_ptr = &select_timeout;
 			}
 		} else {
@@ -424,23 +953,30 @@ int main(int argc, char **argv) {
 		}
 
 		fd_set readable = select_inputs; // Reload mask
-		int readable_count = select(FD_SETSIZE, &readable, NULL, NULL, select_timeout_ptr);
-
-		if (timeout_handler != NULL) {
-			if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
-				warn("Couldn't get current time: %s", strerror(errno));
-			} else if (now.tv_sec > timeout_instant.tv_sec || (now.tv_sec == timeout_instant.tv_sec && now.tv_nsec > timeout_instant.tv_nsec)) {
-				// If the timeout has passed, invoke the handler and unset the timeout
-				timeout_handler();
-				timeout_handler = NULL;
+		fd_set writable = select_outputs;
+		long long select_start_us = monotonic_us();
+		int readable_count = select(FD_SETSIZE, &readable, &writable, NULL, select_timeout_ptr);
+		loop_wakeup_us = monotonic_us();
+		// The loop is counted in the metrics of the first ring, which the metrics endpoint serves
+		rings[0]->metrics.loop_wakeups++;
+		rings[0]->metrics.idle_us += loop_wakeup_us - select_start_us;
+
+		for (int r = 0; r < MAX_RINGS; r++) {
+			if (rings[r] == NULL) continue;
+			ctx = rings[r];
+			long long start_us = monotonic_us();
+			if (run_expired_timers() > 0) {
+				end_handler(TIMER_HANDLERS, start_us);
 			}
 		}
 
 		if (readable_count == -1) {
 			error("select() error: %s\n", strerror(errno));
 		} else {
+			ctx = rings[current_ring];
 			if (FD_ISSET(stdin_fd, &readable)) {
 				// Received data from stdin
+				long long start_us = monotonic_us();
 				enum RLResult result = read_lines(0, stdin_buffer, &stdin_buffer_index, USER_COMMAND_BUF_SIZE, handle_user_input);
 				if (result == RL_END) {
 					v_printf("Reached end of stdin. Exiting.\n");
@@ -450,74 +986,72 @@ int main(int argc, char **argv) {
 				} else if (result == RL_OVERFLOW) {
 					warn("User command too big.\n");
 				}
-			}
-			if (FD_ISSET(ns_socket, &readable)) {
-				// Received a message from the node server
-				char ns_response_buffer[MAX_UDP_SIZE];
-				ssize_t len = recvfrom(ns_socket, ns_response_buffer, MAX_UDP_SIZE, 0, NULL, 0);
-				if (len == -1)
-					error("Couldn't receive message from node server: %s\n", strerror(errno));
-
-				if (strncmp(ns_response_buffer, "OKREG", 5) == 0) {
-					if (connection_state != CONNECTED) {
-						warn("Got unexpected OKREG response. Ignoring.\n");
-					} else {
-						v_printf("Node server confirmed our registration.\n");
-					}
-				} else if (strncmp(ns_response_buffer, "OKUNREG", 7) == 0) {
-					if (connection_state != DISCONNECTED) {
-						warn("Got unexpected OKUNREG response. Ignoring.\n");
-					} else {
-						v_printf("Node server confirmed our unregistration.\n");
-					}
-				} else {
-					v_printf("Unrecognized node server message: %s\n", ns_response_buffer);
-				}
+				end_handler(USER_INPUT_HANDLER, start_us);
 			}
 			if (FD_ISSET(public_socket, &readable)) {
-				// Received a request for a TCP connection
-
-				struct sockaddr_in addr;
-				socklen_t addrlen = sizeof(addr);
-
-				int socket = accept(public_socket, (struct sockaddr *)&addr, &addrlen);
-				char *src_ip_addr = inet_ntoa(addr.sin_addr);
-				if (socket == -1) {
-					warn("Couldn't accept a TCP connection from %s: %s\n", src_ip_addr, strerror(errno));
-					continue;
-				}
-
-				if (connection_state != CONNECTING && connection_state != CONNECTED) {
-					close(socket);
-					warn("Unexpectedly received a TCP connection from %s.\n", src_ip_addr);
-					continue;
-				}
+				// Received requests for TCP connections
+				long long start_us = monotonic_us();
+				accept_node_connections();
+				end_handler(ACCEPT_HANDLER, start_us);
+			}
 
-				if (new_node_conn != NULL) {
-					close(socket);
-					warn("Couldn't accept a TCP connection from %s because we are already handling a node connection.\n", src_ip_addr);
-					continue;
+			for (int r = 0; r < MAX_RINGS; r++) {
+				if (rings[r] == NULL) continue;
+				ctx = rings[r];
+				if (FD_ISSET(ctx->ns_socket, &readable)) {
+					// Received a message from the node server
+					long long start_us = monotonic_us();
+					// Too big for the stack
+					static char ns_response_buffer[MAX_UDP_SIZE + 1];
+					ssize_t len = recvfrom(ctx->ns_socket, ns_response_buffer, MAX_UDP_SIZE, 0, NULL, 0);
+					if (len == -1)
+						error("Couldn't receive message from node server: %s\n", strerror(errno));
+					ns_response_buffer[len] = '\0';
+
+					if (strncmp(ns_response_buffer, "OKREG", 5) == 0) {
+						handle_registration_reply(REG_REQUEST);
+					} else if (strncmp(ns_response_buffer, "OKUNREG", 7) == 0) {
+						handle_registration_reply(UNREG_REQUEST);
+					} else if (strncmp(ns_response_buffer, "NODESLIST ", 10) == 0) {
+						handle_node_list_message(ns_response_buffer, len);
+					} else {
+						v_printf("Unrecognized node server message: %s\n", ns_response_buffer);
+					}
+					end_handler(NODE_SERVER_HANDLER, start_us);
 				}
-
-				struct Connection *conn = add_connection(socket);
-				strcpy(conn->ip_addr, src_ip_addr);
-				v_printf("Accepted TCP connection from %s.\n", src_ip_addr);
-				new_node_conn = conn;
-			}
-			for (int i = 0; i < MAX_CONNECTIONS; i++) {
-				int socket = connections[i].socket;
-				if (socket != -1 && FD_ISSET(socket, &readable)) {
-					enum RLResult result = read_lines(socket, connections[i].buffer, &connections[i].buffer_index, MAX_NODE_MESSAGE_SIZE, handle_message);
-					if (result == RL_END) {
-						handle_broken_socket(socket);
-					} else if (result == RL_ERROR) {
-						handle_broken_socket(socket);
-					} else if (result == RL_OVERFLOW) {
-						warn("A node is sending too big of a message. Discarding some bytes.\n");
+				for (int i = 0; i < MAX_CONNECTIONS; i++) {
+					int socket = ctx->connections[i].socket;
+					if (socket != -1 && ctx->connections[i].connecting) {
+						// A failed connect() also makes the socket readable, so it's only read once it's established
+						if (FD_ISSET(socket, &writable)) {
+							long long start_us = monotonic_us();
+							finish_connection(&ctx->connections[i]);
+							end_handler(CONNECTION_HANDLER, start_us);
+						}
+						continue;
+					}
+					if (socket != -1 && FD_ISSET(socket, &readable)) {
+						long long start_us = monotonic_us();
+						enum RLResult result = read_lines(socket, ctx->connections[i].buffer, &ctx->connections[i].buffer_index, MAX_NODE_MESSAGE_SIZE, handle_message);
+						if (result == RL_END) {
+							handle_broken_socket(socket);
+						} else if (result == RL_ERROR) {
+							handle_broken_socket(socket);
+						} else if (result == RL_OVERFLOW) {
+							warn("A node is sending too big of a message. Discarding some bytes.\n");
+						}
+						end_handler(CONNECTION_HANDLER, start_us);
 					}
 				}
+				handle_metrics_sockets(&readable);
 			}
+
+			// After the rings' connections, so that the sockets handed over aren't read before
+			// select() says they are readable again
+			route_arrivals(&readable);
 		}
+
+		observe(&rings[0]->metrics.handler_latency_us, monotonic_us() - loop_wakeup_us);
 	}
 
 	return 0;
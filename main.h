@@ -9,6 +9,10 @@
 #define TCP_PORT_STR_SIZE 6
 
 #define USER_COMMAND_BUF_SIZE 256
+// Default for the -b option
+#define DEFAULT_LISTEN_BACKLOG 10
+// Rings a process can be in at once. Each one has its own context (see context.h).
+#define MAX_RINGS 4
 
 #define MAX_NODE_MESSAGE_SIZE 256
 #define MAX_NODES 16
@@ -24,6 +28,8 @@ typedef signed char NodeID;
 #define NODE_ID_IN "%hhd"
 #define NODE_ID_OUT "%02hhd"
 
+#include <stdbool.h>
+
 
 typedef struct Node {
 	NodeID id;
@@ -31,34 +37,68 @@ typedef struct Node {
 	char tcp_port[TCP_PORT_STR_SIZE];
 } Node;
 
+// A timer which calls `handler` once after it expires. Timers are owned by the modules which use them.
+typedef struct Timer {
+	// The CLOCK_MONOTONIC instant at which the timer expires, in milliseconds
+	long long instant_ms;
+	void (*handler)(void);
+	bool active;
+	struct Timer *next;
+} Timer;
+
 
-#include <stdbool.h>
 #include <sys/select.h>
 
 #include "util.h"
 #include "connections.h"
+#include "transport.h"
 #include "routing.h"
+#include "routing-store.h"
 #include "ring.h"
+#include "rate-limit.h"
+#include "heartbeat.h"
 #include "node-server.h"
+#include "fingers.h"
+#include "traffic.h"
 #include "read-lines.h"
+#include "trace.h"
+#include "flight-recorder.h"
+#include "metrics.h"
 
 enum InputState {
 	COMMAND,
 	JOIN_NODE_SELECTION,
 	CHORD_NODE_SELECTION
 };
-extern enum InputState input_state;
 
-// The set of file descriptors for which select() should return when they have new data
-extern fd_set select_inputs;
+#include "context.h"
 
-// The passive socket used for accepting incoming connections
-extern int public_socket;
+// The set of file descriptors for which select() should return when they have new data.
+// Shared by the rings we are in.
+extern fd_set select_inputs;
+// The sockets whose connect() is in progress, for which select() returns once it finishes
+extern fd_set select_outputs;
+// The CLOCK_MONOTONIC instant at which select() last returned, in microseconds.
+// Messages are considered received at this instant.
+extern long long loop_wakeup_us;
 
 #include "connections.h"
 
+// Handles a line of user input. Always returns `true`, so that read_lines() keeps reading.
+bool handle_user_input(int fd, char *input);
+// Takes over a connection from another node, or closes it if we aren't in a ring or are handling
+// too many connections. Returns `false` if it was closed.
+bool accept_node_connection(int socket, const char *ip_addr);
+
 void copy_node(Node *dest, Node *src);
 void set_timeout(long int ms, void (*handler)(void));
 void cancel_timeout(void);
+void start_timer(Timer *timer, long int ms, void (*handler)(void));
+void stop_timer(Timer *timer);
+// Returns the instant at which the earliest timer expires, or -1 if there are no active timers
+long long next_timer_instant(void);
+// Invokes the handlers of every expired timer. Handlers may start or stop any timer, including their own.
+// Returns the number of handlers called.
+int run_expired_timers(void);
 
 #endif
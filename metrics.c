@@ -0,0 +1,343 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "main.h"
+
+// Counters and histograms about the messages, the routing and the event loop.
+//
+// They are shown by the show stats command and, if the -m option is given, served on 127.0.0.1 in
+// the Prometheus text format to any HTTP request.
+
+const char *const message_type_names[MESSAGE_TYPE_COUNT] = {
+	"ENTRY", "PRED", "SUCC", "CHORD", "ROUTE", "CHAT", "SYNC", "DELTA", "VERSION", "PING", "PONG", "LEAVE", "TRACE", "RING", "OTHER"
+};
+
+static const char *loop_handler_names[LOOP_HANDLER_COUNT] = {
+	"timers", "user input", "node server", "accept", "connection", "metrics"
+};
+
+void observe(Histogram *histogram, double value) {
+	int bucket = 0;
+	double bound = 1;
+	while (bucket < METRICS_BUCKETS && value > bound) {
+		bucket++;
+		bound *= 2;
+	}
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	histogram->sum += value;
+	if (value > histogram->max) {
+		histogram->max = value;
+	}
+}
+
+void end_handler(enum LoopHandler handler, long long start_us) {
+	long long elapsed_us = monotonic_us() - start_us;
+	observe(&ctx->metrics.loop_handler_us[handler], elapsed_us);
+	if (ctx->slow_handler_threshold_us > 0 && elapsed_us > ctx->slow_handler_threshold_us) {
+		ctx->metrics.slow_handlers[handler]++;
+		warn("Slow event loop handler: %s took %.1f ms.\n", loop_handler_names[handler], elapsed_us / 1000.0);
+	}
+}
+
+void set_slow_handler_threshold(long int ms) {
+	ctx->slow_handler_threshold_us = ms * 1000LL;
+}
+
+static enum MessageType get_message_type(const char *line) {
+	for (int type = 0; type < OTHER_MESSAGE; type++) {
+		size_t length = strlen(message_type_names[type]);
+		if (strncmp(line, message_type_names[type], length) == 0 && (line[length] == ' ' || line[length] == '\n' || line[length] == '\0')) {
+			return type;
+		}
+	}
+	return OTHER_MESSAGE;
+}
+
+static int get_node_slot(struct Connection *conn) {
+	return conn != NULL && conn->node_id >= 0 && conn->node_id <= MAX_NODE_ID ? conn->node_id : MAX_NODE_ID + 1;
+}
+
+void count_message_in(struct Connection *conn, const char *message) {
+	ctx->metrics.messages_in[get_message_type(message)]++;
+	// Plus the line feed
+	ctx->metrics.bytes_in[get_node_slot(conn)] += strlen(message) + 1;
+}
+
+void count_messages_out(struct Connection *conn, const char *data, int length) {
+	ctx->metrics.bytes_out[get_node_slot(conn)] += length;
+	for (int i = 0; i < length;) {
+		ctx->metrics.messages_out[get_message_type(data + i)]++;
+		const char *end = memchr(data + i, '\n', length - i);
+		if (end == NULL) break;
+		i = end - data + 1;
+	}
+}
+
+// Returns the upper bound of the bucket which contains the given fraction of the values
+static double histogram_quantile(const Histogram *histogram, double fraction) {
+	unsigned long target = (unsigned long) (histogram->count * fraction);
+	unsigned long seen = 0;
+	double bound = 1;
+	for (int bucket = 0; bucket < METRICS_BUCKETS; bucket++) {
+		seen += histogram->buckets[bucket];
+		if (seen > target) {
+			return bound;
+		}
+		bound *= 2;
+	}
+	return bound;
+}
+
+static void print_histogram(const char *name, const Histogram *histogram, const char *unit) {
+	if (histogram->count == 0) {
+		printf("%s: none\n", name);
+		return;
+	}
+	printf("%s: %lu, average %.1f %s, p50 <= %.0f %s, p99 <= %.0f %s\n", name, histogram->count, histogram->sum / histogram->count, unit, histogram_quantile(histogram, 0.5), unit, histogram_quantile(histogram, 0.99), unit);
+}
+
+void print_metrics(void) {
+	printf("\
++---------+-----------+-----------+\n\
+| Type    | Received  | Sent      |\n\
++---------+-----------+-----------+\n\
+");
+	for (int type = 0; type < MESSAGE_TYPE_COUNT; type++) {
+		if (ctx->metrics.messages_in[type] == 0 && ctx->metrics.messages_out[type] == 0) continue;
+		printf("| %-7s | %9lu | %9lu |\n", message_type_names[type], ctx->metrics.messages_in[type], ctx->metrics.messages_out[type]);
+	}
+	printf("+---------+-----------+-----------+\n");
+
+	printf("\
++------+------------+------------+\n\
+| Node | Bytes in   | Bytes out  |\n\
++------+------------+------------+\n\
+");
+	for (int slot = 0; slot <= MAX_NODE_ID + 1; slot++) {
+		if (ctx->metrics.bytes_in[slot] == 0 && ctx->metrics.bytes_out[slot] == 0) continue;
+		if (slot <= MAX_NODE_ID) {
+			printf("| %02d   | %10lu | %10lu |\n", slot, ctx->metrics.bytes_in[slot], ctx->metrics.bytes_out[slot]);
+		} else {
+			printf("| new  | %10lu | %10lu |\n", ctx->metrics.bytes_in[slot], ctx->metrics.bytes_out[slot]);
+		}
+	}
+	printf("+------+------------+------------+\n");
+
+	printf("Forward drops: %lu\n", ctx->metrics.forward_drops);
+	printf("Route changes: %lu\n", ctx->metrics.route_changes);
+	print_histogram("Route announcements", &ctx->metrics.announce_fanout, "neighbors");
+	print_loop_metrics();
+}
+
+void print_loop_metrics(void) {
+	double busy_us = ctx->metrics.handler_latency_us.sum;
+	double total_us = busy_us + ctx->metrics.idle_us;
+	printf("Event loop wakeups: %lu, busy %.2f%% of the time\n", ctx->metrics.loop_wakeups, total_us > 0 ? 100 * busy_us / total_us : 0.0);
+	print_histogram("Handler latency samples", &ctx->metrics.handler_latency_us, "us");
+	printf("\
++-------------+-----------+-----------+-----------+-----------+-------+\n\
+| Handler     | Calls     | Avg (us)  | p99 (us)  | Max (us)  | Slow  |\n\
++-------------+-----------+-----------+-----------+-----------+-------+\n\
+");
+	for (int handler = 0; handler < LOOP_HANDLER_COUNT; handler++) {
+		const Histogram *histogram = &ctx->metrics.loop_handler_us[handler];
+		if (histogram->count == 0) continue;
+		printf("| %-11s | %9lu | %9.1f | %9.0f | %9.0f | %5lu |\n", loop_handler_names[handler], histogram->count,
+			histogram->sum / histogram->count, histogram_quantile(histogram, 0.99), histogram->max, ctx->metrics.slow_handlers[handler]);
+	}
+	printf("+-------------+-----------+-----------+-----------+-----------+-------+\n");
+	const Histogram *lateness = &ctx->metrics.timer_lateness_us;
+	if (lateness->count > 0) {
+		printf("Timer lateness: %lu timers, average %.1f us, p99 <= %.0f us, max %.0f us\n", lateness->count, lateness->sum / lateness->count, histogram_quantile(lateness, 0.99), lateness->max);
+	}
+	if (ctx->slow_handler_threshold_us > 0) {
+		printf("Slow handler threshold: %lld ms\n", ctx->slow_handler_threshold_us / 1000);
+	} else {
+		printf("Slow handler warning disabled\n");
+	}
+}
+
+// `labels` is empty or a list of labels, e.g. `handler="accept"`
+static void write_prometheus_histogram_series(FILE *file, const char *name, const char *labels, const Histogram *histogram, double scale) {
+	const char *separator = labels[0] != '\0' ? "," : "";
+	unsigned long cumulative = 0;
+	double bound = 1;
+	for (int bucket = 0; bucket < METRICS_BUCKETS; bucket++) {
+		cumulative += histogram->buckets[bucket];
+		fprintf(file, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels, separator, bound * scale, cumulative);
+		bound *= 2;
+	}
+	fprintf(file, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, separator, histogram->count);
+	if (labels[0] != '\0') {
+		fprintf(file, "%s_sum{%s} %g\n%s_count{%s} %lu\n", name, labels, histogram->sum * scale, name, labels, histogram->count);
+	} else {
+		fprintf(file, "%s_sum %g\n%s_count %lu\n", name, histogram->sum * scale, name, histogram->count);
+	}
+}
+
+static void write_prometheus_histogram(FILE *file, const char *name, const char *help, const Histogram *histogram, double scale) {
+	fprintf(file, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	write_prometheus_histogram_series(file, name, "", histogram, scale);
+}
+
+static void write_prometheus_bytes(FILE *file, const char *name, const char *help, const unsigned long *bytes) {
+	fprintf(file, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+	for (int slot = 0; slot <= MAX_NODE_ID + 1; slot++) {
+		if (bytes[slot] == 0) continue;
+		if (slot <= MAX_NODE_ID) {
+			fprintf(file, "%s{node=\"%02d\"} %lu\n", name, slot, bytes[slot]);
+		} else {
+			fprintf(file, "%s{node=\"none\"} %lu\n", name, bytes[slot]);
+		}
+	}
+}
+
+void write_prometheus_metrics(FILE *file) {
+	fprintf(file, "# HELP cor_messages_received_total Messages received from other nodes.\n# TYPE cor_messages_received_total counter\n");
+	for (int type = 0; type < MESSAGE_TYPE_COUNT; type++) {
+		fprintf(file, "cor_messages_received_total{type=\"%s\"} %lu\n", message_type_names[type], ctx->metrics.messages_in[type]);
+	}
+	fprintf(file, "# HELP cor_messages_sent_total Messages sent to other nodes.\n# TYPE cor_messages_sent_total counter\n");
+	for (int type = 0; type < MESSAGE_TYPE_COUNT; type++) {
+		fprintf(file, "cor_messages_sent_total{type=\"%s\"} %lu\n", message_type_names[type], ctx->metrics.messages_out[type]);
+	}
+	write_prometheus_bytes(file, "cor_bytes_received_total", "Bytes received per neighbor.", ctx->metrics.bytes_in);
+	write_prometheus_bytes(file, "cor_bytes_sent_total", "Bytes sent per neighbor.", ctx->metrics.bytes_out);
+
+	fprintf(file, "# HELP cor_forward_drops_total CHAT messages which couldn't be forwarded.\n# TYPE cor_forward_drops_total counter\ncor_forward_drops_total %lu\n", ctx->metrics.forward_drops);
+	fprintf(file, "# HELP cor_route_changes_total Shortest path changes announced to the neighbors.\n# TYPE cor_route_changes_total counter\ncor_route_changes_total %lu\n", ctx->metrics.route_changes);
+	write_prometheus_histogram(file, "cor_route_announce_fanout", "Neighbors each route announcement was sent to.", &ctx->metrics.announce_fanout, 1);
+	fprintf(file, "# HELP cor_event_loop_wakeups_total Returns from select().\n# TYPE cor_event_loop_wakeups_total counter\ncor_event_loop_wakeups_total %lu\n", ctx->metrics.loop_wakeups);
+	write_prometheus_histogram(file, "cor_event_loop_handler_seconds", "Time spent handling the events of a wakeup.", &ctx->metrics.handler_latency_us, 1e-6);
+	fprintf(file, "# HELP cor_event_loop_idle_seconds_total Time spent waiting in select().\n# TYPE cor_event_loop_idle_seconds_total counter\ncor_event_loop_idle_seconds_total %g\n", ctx->metrics.idle_us * 1e-6);
+	fprintf(file, "# HELP cor_event_loop_busy_seconds_total Time spent handling events.\n# TYPE cor_event_loop_busy_seconds_total counter\ncor_event_loop_busy_seconds_total %g\n", ctx->metrics.handler_latency_us.sum * 1e-6);
+
+	fprintf(file, "# HELP cor_loop_handler_seconds Time spent in each call of a kind of event loop handler.\n# TYPE cor_loop_handler_seconds histogram\n");
+	for (int handler = 0; handler < LOOP_HANDLER_COUNT; handler++) {
+		char labels[64];
+		snprintf(labels, sizeof(labels), "handler=\"%s\"", loop_handler_names[handler]);
+		write_prometheus_histogram_series(file, "cor_loop_handler_seconds", labels, &ctx->metrics.loop_handler_us[handler], 1e-6);
+	}
+	fprintf(file, "# HELP cor_slow_handlers_total Handler calls which took longer than the slow handler threshold.\n# TYPE cor_slow_handlers_total counter\n");
+	for (int handler = 0; handler < LOOP_HANDLER_COUNT; handler++) {
+		fprintf(file, "cor_slow_handlers_total{handler=\"%s\"} %lu\n", loop_handler_names[handler], ctx->metrics.slow_handlers[handler]);
+	}
+	write_prometheus_histogram(file, "cor_timer_lateness_seconds", "Time between the expiry of a timer and the call of its handler.", &ctx->metrics.timer_lateness_us, 1e-6);
+}
+
+void init_metrics_endpoint(const char *port) {
+	ctx->metrics_socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (ctx->metrics_socket == -1)
+		error("Couldn't create the metrics socket: %s\n", strerror(errno));
+
+	int val = 1;
+	setsockopt(ctx->metrics_socket, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(int));
+
+	struct addrinfo hints = {0};
+	hints.ai_family = AF_INET;       // IPv4
+	hints.ai_socktype = SOCK_STREAM; // TCP socket
+
+	struct addrinfo *ai;
+	int errcode = getaddrinfo("127.0.0.1", port, &hints, &ai);
+	if (errcode != 0)
+		error("Couldn't get the metrics address: %s\n", gai_strerror(errcode));
+
+	if (bind(ctx->metrics_socket, ai->ai_addr, ai->ai_addrlen) == -1)
+		error("Couldn't bind the metrics socket: %s\n", strerror(errno));
+	freeaddrinfo(ai);
+
+	if (listen(ctx->metrics_socket, MAX_METRICS_CLIENTS) == -1)
+		error("Couldn't listen on the metrics socket: %s\n", strerror(errno));
+	fcntl(ctx->metrics_socket, F_SETFL, fcntl(ctx->metrics_socket, F_GETFL) | O_NONBLOCK);
+
+	for (int i = 0; i < MAX_METRICS_CLIENTS; i++) {
+		ctx->metrics_clients[i] = -1;
+	}
+	FD_SET(ctx->metrics_socket, &select_inputs);
+	v_printf("Serving metrics on http://127.0.0.1:%s/metrics.\n", port);
+}
+
+static void close_metrics_client(int i) {
+	FD_CLR(ctx->metrics_clients[i], &select_inputs);
+	close(ctx->metrics_clients[i]);
+	ctx->metrics_clients[i] = -1;
+}
+
+// Any request gets the metrics, so the request itself is read and ignored
+static void answer_metrics_client(int i) {
+	char request[1024];
+	ssize_t n = read(ctx->metrics_clients[i], request, sizeof(request));
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if (n <= 0) {
+		close_metrics_client(i);
+		return;
+	}
+
+	char *body;
+	size_t body_length;
+	FILE *file = open_memstream(&body, &body_length);
+	if (file == NULL) {
+		close_metrics_client(i);
+		return;
+	}
+	write_prometheus_metrics(file);
+	fclose(file);
+
+	char header[128];
+	int header_length = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", body_length);
+	if (write(ctx->metrics_clients[i], header, header_length) == header_length) {
+		size_t written = 0;
+		while (written < body_length) {
+			ssize_t w = write(ctx->metrics_clients[i], body + written, body_length - written);
+			if (w <= 0) break;
+			written += w;
+		}
+	}
+	free(body);
+	close_metrics_client(i);
+}
+
+void handle_metrics_sockets(fd_set *readable) {
+	if (ctx->metrics_socket == -1) {
+		return;
+	}
+
+	bool handled = false;
+	long long start_us = monotonic_us();
+	if (FD_ISSET(ctx->metrics_socket, readable)) {
+		handled = true;
+		int client;
+		while ((client = accept(ctx->metrics_socket, NULL, NULL)) != -1) {
+			int i = 0;
+			while (i < MAX_METRICS_CLIENTS && ctx->metrics_clients[i] != -1) i++;
+			if (i == MAX_METRICS_CLIENTS) {
+				close(client);
+				continue;
+			}
+			fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+			ctx->metrics_clients[i] = client;
+			FD_SET(client, &select_inputs);
+		}
+	}
+
+	for (int i = 0; i < MAX_METRICS_CLIENTS; i++) {
+		if (ctx->metrics_clients[i] != -1 && FD_ISSET(ctx->metrics_clients[i], readable)) {
+			handled = true;
+			answer_metrics_client(i);
+		}
+	}
+	if (handled) {
+		end_handler(METRICS_HANDLER, start_us);
+	}
+}
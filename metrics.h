@@ -0,0 +1,105 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+#include "main.h"
+
+// Histogram buckets have the upper bounds 1, 2, 4, ..., 2^(METRICS_BUCKETS - 1), plus one for bigger values
+#define METRICS_BUCKETS 20
+// Maximum number of simultaneous connections to the metrics endpoint
+#define MAX_METRICS_CLIENTS 4
+
+enum MessageType {
+	ENTRY_MESSAGE,
+	PRED_MESSAGE,
+	SUCC_MESSAGE,
+	CHORD_MESSAGE,
+	ROUTE_MESSAGE,
+	CHAT_MESSAGE,
+	SYNC_MESSAGE,
+	DELTA_MESSAGE,
+	VERSION_MESSAGE,
+	PING_MESSAGE,
+	PONG_MESSAGE,
+	LEAVE_MESSAGE,
+	TRACE_MESSAGE,
+	RING_MESSAGE,
+	OTHER_MESSAGE,
+	MESSAGE_TYPE_COUNT
+};
+
+// The parts of an event loop iteration which are timed separately
+enum LoopHandler {
+	TIMER_HANDLERS,
+	USER_INPUT_HANDLER,
+	NODE_SERVER_HANDLER,
+	ACCEPT_HANDLER,
+	CONNECTION_HANDLER,
+	METRICS_HANDLER,
+	LOOP_HANDLER_COUNT
+};
+
+// Default for the slow handler warning. Handlers which take longer are reported.
+#define DEFAULT_SLOW_HANDLER_MS 50
+
+typedef struct Histogram {
+	// Not cumulative. The last bucket is for values bigger than every bound.
+	unsigned long buckets[METRICS_BUCKETS + 1];
+	unsigned long count;
+	double sum;
+	double max;
+} Histogram;
+
+// The program is single-threaded, so the metrics are plain variables which are updated in place,
+// without locks or atomic operations.
+typedef struct Metrics {
+	unsigned long messages_in[MESSAGE_TYPE_COUNT];
+	unsigned long messages_out[MESSAGE_TYPE_COUNT];
+	// Per neighbor ID. The last entry is for connections which haven't identified themselves.
+	unsigned long bytes_in[MAX_NODE_ID + 2];
+	unsigned long bytes_out[MAX_NODE_ID + 2];
+	// CHAT messages which couldn't be forwarded or were dropped by the rate limit
+	unsigned long forward_drops;
+	// Changes to our shortest paths which were announced to the neighbors
+	unsigned long route_changes;
+	// Neighbors each ROUTE announcement was sent to
+	Histogram announce_fanout;
+	// Returns from select()
+	unsigned long loop_wakeups;
+	// Time spent handling the events of a wakeup, in microseconds
+	Histogram handler_latency_us;
+	// Time spent waiting in select(), in microseconds
+	double idle_us;
+	// Time spent in each call of each kind of handler, in microseconds
+	Histogram loop_handler_us[LOOP_HANDLER_COUNT];
+	// Calls which took longer than the slow handler threshold
+	unsigned long slow_handlers[LOOP_HANDLER_COUNT];
+	// Time between the expiry of a timer and the call of its handler, in microseconds
+	Histogram timer_lateness_us;
+} Metrics;
+
+extern const char *const message_type_names[MESSAGE_TYPE_COUNT];
+
+struct Connection;
+
+void observe(Histogram *histogram, double value);
+void count_message_in(struct Connection *conn, const char *message);
+// Counts every line in `data`, which is written to a connection
+void count_messages_out(struct Connection *conn, const char *data, int length);
+
+// Records the time spent in a handler since `start_us`, and warns if it's over the threshold
+void end_handler(enum LoopHandler handler, long long start_us);
+// A threshold of 0 disables the warning
+void set_slow_handler_threshold(long int ms);
+
+void print_metrics(void);
+void print_loop_metrics(void);
+// Writes the metrics in the Prometheus text format
+void write_prometheus_metrics(FILE *file);
+
+// Serves the metrics over HTTP on 127.0.0.1 at the given port
+void init_metrics_endpoint(const char *port);
+void handle_metrics_sockets(fd_set *readable);
+
+#endif
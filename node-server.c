@@ -1,7 +1,9 @@
 #define _POSIX_C_SOURCE 200809L
+#include <ctype.h>
 #include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -9,67 +11,340 @@
 
 #include "main.h"
 
-// Node server socket
-int ns_socket;
+void clear_node_array(NodeArray *arr) {
+	arr->length = 0;
+	for (int i = 0; i <= MAX_NODE_ID; i++) {
+		arr->index[i] = -1;
+	}
+}
 
-// Node server address
-static struct addrinfo *ns_addrinfo;
+const Node *find_node(const NodeArray *arr, NodeID id) {
+	if (id < 0 || id > MAX_NODE_ID || arr->index[id] == -1) {
+		return NULL;
+	}
+	return &arr->nodes[arr->index[id]];
+}
 
-// The node list returned by the node server
-NodeArray node_arr;
+// Adds a node, or replaces the address of the node with the same ID
+static void add_node(NodeArray *arr, const Node *node) {
+	int i = arr->index[node->id];
+	if (i == -1) {
+		i = arr->length++;
+		arr->index[node->id] = i;
+	}
+	arr->nodes[i] = *node;
+}
 
-enum NodeListAction node_list_action;
+static void remove_node(NodeArray *arr, NodeID id) {
+	int i = arr->index[id];
+	if (i == -1) {
+		return;
+	}
+	arr->index[id] = -1;
+	arr->length--;
+	if (i != arr->length) {
+		arr->nodes[i] = arr->nodes[arr->length];
+		arr->index[arr->nodes[i].id] = i;
+	}
+}
+
+// Node lists are cached per ring ID, so that commands and the automatic chords don't need a round
+// trip to the node server. The list of the ring we are in is requested again in the background when
+// it expires, or when we notice a node joining or leaving. Our own REG and UNREG messages are
+// applied to the cached list right away.
+
+static void refresh_node_list(void);
 
 int init_ns(char *ns_addr_str, char *ns_port_str) {
-	ns_socket = socket(AF_INET, SOCK_DGRAM, 0); // UDP over IPv4
-	if (ns_socket == -1)
+	ctx->ns_socket = socket(AF_INET, SOCK_DGRAM, 0); // UDP over IPv4
+	if (ctx->ns_socket == -1)
 		error("Couldn't create UDP socket: %s\n", strerror(errno));
 
 	struct addrinfo hints = {0};
 	hints.ai_family = AF_INET;      // IPv4
 	hints.ai_socktype = SOCK_DGRAM; // UDP socket
 
-	int errcode = getaddrinfo(ns_addr_str, ns_port_str, &hints, &ns_addrinfo);
+	int errcode = getaddrinfo(ns_addr_str, ns_port_str, &hints, &ctx->ns_addrinfo);
 	if (errcode != 0)
 		error("Couldn't get the node server address: %s\n", gai_strerror(errcode));
 
-	return ns_socket;
+	clear_node_array(&ctx->node_arr);
+	start_timer(&ctx->refresh_timer, NODE_LIST_REFRESH_INTERVAL_MS, refresh_node_list);
+	return ctx->ns_socket;
 }
 
 
 void send_ns_message(const char *message, int length) {
 	vv_printf("Sending message to node server: %s\n", message);
-	ssize_t n = sendto(ns_socket, message, length, 0, ns_addrinfo->ai_addr, ns_addrinfo->ai_addrlen);
+	ssize_t n = sendto(ctx->ns_socket, message, length, 0, ctx->ns_addrinfo->ai_addr, ctx->ns_addrinfo->ai_addrlen);
 	if (n == -1) {
 		error("Couldn't send message to node server: %s\n", strerror(errno));
 	}
 }
 
-static void parse_node_list(char *message, ssize_t length, bool chord_mode) {
-	// Check for a newline after "NODESLIST <ring id>".
-	// This doesn't guarantee the header is right but it will only happen if it's malformed or missing.
-	if (message[13] != '\n')
-		error("Malformed node list header.\n");
+// Returns the cache entry of a ring. If there's none and `create` is set, the entry with the oldest list is reused.
+static NodeListCacheEntry *find_cache_entry(const char *ring_id_str, bool create) {
+	if (ring_id_str[0] == '\0') {
+		return NULL;
+	}
 
-	if (message[length - 1] != '\n')
-		error("Node list doesn't end with a line feed character.\n");
+	NodeListCacheEntry *oldest = NULL;
+	for (int i = 0; i < NODE_LIST_CACHE_SIZE; i++) {
+		NodeListCacheEntry *entry = &ctx->node_list_cache[i];
+		if (strcmp(entry->ring_id_str, ring_id_str) == 0) {
+			return entry;
+		}
+		if (oldest == NULL || entry->ring_id_str[0] == '\0' || (oldest->ring_id_str[0] != '\0' && entry->fetched_ms < oldest->fetched_ms)) {
+			oldest = entry;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
 
-	int n = 0;
-	for (int i = 14; i < length;) {
-		int successful_assignments = sscanf(message + i, ""NODE_ID_IN" %15s %5s\n", &node_arr.nodes[n].id, node_arr.nodes[n].ip_addr, node_arr.nodes[n].tcp_port);
-		if (successful_assignments != 3) {
-			error("Failed to parse node list.\n");
+	strcpy(oldest->ring_id_str, ring_id_str);
+	clear_node_array(&oldest->list);
+	oldest->fetched_ms = -1;
+	oldest->requested_ms = -1;
+	oldest->invalidated = false;
+	return oldest;
+}
+
+static bool is_fresh(NodeListCacheEntry *entry, long long now) {
+	return entry->fetched_ms != -1 && !entry->invalidated && now - entry->fetched_ms < NODE_LIST_TTL_MS;
+}
+
+// Sends NODES unless a request for the same ring is already in flight
+static void send_nodes_request(NodeListCacheEntry *entry, long long now) {
+	if (entry->requested_ms != -1 && now - entry->requested_ms < NODE_LIST_TIMEOUT_MS) {
+		return;
+	}
+	entry->requested_ms = now;
+
+	char nodes_msg[10];
+	sprintf(nodes_msg, "NODES %s", entry->ring_id_str);
+	send_ns_message(nodes_msg, 10);
+}
+
+static void refresh_node_list(void) {
+	start_timer(&ctx->refresh_timer, NODE_LIST_REFRESH_INTERVAL_MS, refresh_node_list);
+	if (ctx->connection_state != CONNECTED) {
+		return;
+	}
+
+	long long now = monotonic_ms();
+	NodeListCacheEntry *entry = find_cache_entry(ctx->ring_id_str, true);
+	if (entry != NULL && !is_fresh(entry, now)) {
+		send_nodes_request(entry, now);
+	}
+}
+
+const NodeArray *get_node_list(const char *ring_id_str, unsigned long *version) {
+	long long now = monotonic_ms();
+	NodeListCacheEntry *entry = find_cache_entry(ring_id_str, true);
+	if (entry == NULL) {
+		return NULL;
+	}
+	if (!is_fresh(entry, now)) {
+		send_nodes_request(entry, now);
+	}
+	if (version != NULL) {
+		*version = entry->version;
+	}
+	return entry->fetched_ms != -1 ? &entry->list : NULL;
+}
+
+void invalidate_node_list(const char *ring_id_str) {
+	NodeListCacheEntry *entry = find_cache_entry(ring_id_str, false);
+	if (entry != NULL) {
+		entry->invalidated = true;
+	}
+}
+
+// REG and UNREG are sent over UDP, so they are sent again with exponential backoff until the node
+// server confirms them. The replies don't say which ring or node they are about, so each reply
+// confirms the oldest pending request of its type. A new request for the same ring and node
+// replaces the pending one, e.g. UNREG replaces a REG which wasn't confirmed yet.
+
+static void retransmit_registrations(void);
+
+static void schedule_registrations(void) {
+	long long next_ms = -1;
+	for (int i = 0; i < MAX_PENDING_REGISTRATIONS; i++) {
+		if (ctx->registrations[i].pending && (next_ms == -1 || ctx->registrations[i].next_attempt_ms < next_ms)) {
+			next_ms = ctx->registrations[i].next_attempt_ms;
+		}
+	}
+
+	if (next_ms == -1) {
+		stop_timer(&ctx->registration_timer);
+	} else {
+		long long now = monotonic_ms();
+		start_timer(&ctx->registration_timer, next_ms > now ? next_ms - now : 0, retransmit_registrations);
+	}
+}
+
+static void retransmit_registrations(void) {
+	long long now = monotonic_ms();
+	for (int i = 0; i < MAX_PENDING_REGISTRATIONS; i++) {
+		Registration *reg = &ctx->registrations[i];
+		if (!reg->pending || reg->next_attempt_ms > now) continue;
+
+		if (reg->attempts >= REGISTRATION_MAX_ATTEMPTS) {
+			warn("The node server didn't confirm our %s for ring %s. Giving up.\n", reg->type == REG_REQUEST ? "registration" : "unregistration", reg->ring_id_str);
+			reg->pending = false;
+			continue;
+		}
+
+		v_printf("The node server didn't confirm our %s yet. Sending %s again.\n", reg->type == REG_REQUEST ? "registration" : "unregistration", reg->type == REG_REQUEST ? "REG" : "UNREG");
+		send_ns_message(reg->message, reg->length);
+		reg->attempts++;
+		reg->delay_ms = reg->delay_ms * 2 < REGISTRATION_RETRY_MAX_MS ? reg->delay_ms * 2 : REGISTRATION_RETRY_MAX_MS;
+		reg->next_attempt_ms = now + reg->delay_ms;
+	}
+	schedule_registrations();
+}
+
+static void send_registration(enum RegistrationType type, const char *message, int length) {
+	// Replace the pending request for the same node, or else the oldest one
+	Registration *reg = NULL;
+	for (int i = 0; i < MAX_PENDING_REGISTRATIONS; i++) {
+		Registration *other = &ctx->registrations[i];
+		if (other->pending && other->node_id == ctx->self.id && strcmp(other->ring_id_str, ctx->ring_id_str) == 0) {
+			reg = other;
+			break;
+		}
+		if (reg == NULL || (reg->pending && (!other->pending || other->sequence < reg->sequence))) {
+			reg = other;
 		}
-		if (!chord_mode || (self.id != node_arr.nodes[n].id && find_connection_by_node_id(node_arr.nodes[n].id) == NULL)) {
-			n++;
+	}
+
+	reg->pending = true;
+	reg->type = type;
+	strcpy(reg->ring_id_str, ctx->ring_id_str);
+	reg->node_id = ctx->self.id;
+	memcpy(reg->message, message, length);
+	reg->length = length;
+	reg->attempts = 1;
+	reg->delay_ms = REGISTRATION_RETRY_INITIAL_MS;
+	reg->next_attempt_ms = monotonic_ms() + reg->delay_ms;
+	reg->sequence = ctx->next_registration_sequence++;
+
+	send_ns_message(message, length);
+	schedule_registrations();
+}
+
+void handle_registration_reply(enum RegistrationType type) {
+	Registration *oldest = NULL;
+	for (int i = 0; i < MAX_PENDING_REGISTRATIONS; i++) {
+		Registration *reg = &ctx->registrations[i];
+		if (reg->pending && reg->type == type && (oldest == NULL || reg->sequence < oldest->sequence)) {
+			oldest = reg;
 		}
+	}
 
-		// Find the next line
-		while (message[i] != '\n')
-			i++;
+	if (oldest == NULL) {
+		// A duplicate reply to a request which was sent again
+		vv_printf("Got an unexpected %s response. Ignoring.\n", type == REG_REQUEST ? "OKREG" : "OKUNREG");
+		return;
+	}
+	oldest->pending = false;
+	schedule_registrations();
+	v_printf("Node server confirmed our %s.\n", type == REG_REQUEST ? "registration" : "unregistration");
+}
+
+void register_with_ns(void) {
+	char reg_msg[33];
+	int length = sprintf(reg_msg, "REG %s "NODE_ID_OUT" %s %s", ctx->ring_id_str, ctx->self.id, ctx->self.ip_addr, ctx->self.tcp_port);
+	send_registration(REG_REQUEST, reg_msg, length);
+
+	NodeListCacheEntry *entry = find_cache_entry(ctx->ring_id_str, false);
+	if (entry != NULL && entry->fetched_ms != -1) {
+		add_node(&entry->list, &ctx->self);
+		entry->version++;
+	}
+}
+
+void unregister_from_ns(void) {
+	char unreg_msg[13];
+	sprintf(unreg_msg, "UNREG %s "NODE_ID_OUT"", ctx->ring_id_str, ctx->self.id);
+	send_registration(UNREG_REQUEST, unreg_msg, 12);
+
+	NodeListCacheEntry *entry = find_cache_entry(ctx->ring_id_str, false);
+	if (entry != NULL && find_node(&entry->list, ctx->self.id) != NULL) {
+		remove_node(&entry->list, ctx->self.id);
+		entry->version++;
+	}
+}
+
+// Copies the next space-separated field of a line to `dest`. Returns false if it's missing or too long.
+static bool parse_field(const char *line, size_t length, size_t *i, char *dest, size_t size) {
+	size_t start = *i;
+	while (*i < length && line[*i] == ' ') (*i)++;
+	if (*i == start) {
+		return false;
+	}
+
+	size_t n = 0;
+	while (*i < length && line[*i] != ' ' && line[*i] != '\r' && line[*i] != '\0') {
+		if (n + 1 >= size) {
+			return false;
+		}
+		dest[n++] = line[(*i)++];
+	}
+	dest[n] = '\0';
+	return n > 0;
+}
+
+// Parses "<id> <ip> <port>", without the line feed
+static bool parse_node_line(const char *line, size_t length, Node *node) {
+	size_t i = 0;
+	int id = 0;
+	while (i < length && i < 3 && isdigit((unsigned char) line[i])) {
+		id = id * 10 + (line[i] - '0');
 		i++;
 	}
-	node_arr.length = n;
+	if (i == 0 || id > MAX_NODE_ID) {
+		return false;
+	}
+	node->id = id;
+
+	if (!parse_field(line, length, &i, node->ip_addr, IPV4_ADDR_STR_SIZE) || !parse_field(line, length, &i, node->tcp_port, TCP_PORT_STR_SIZE)) {
+		return false;
+	}
+
+	while (i < length && (line[i] == ' ' || line[i] == '\r' || line[i] == '\0')) i++;
+	return i == length;
+}
+
+// Parses a NODESLIST message into `arr`, one line at a time and without reading past `length`.
+// Malformed lines are skipped, and a node which is listed more than once keeps its last address.
+// Returns false if the header is malformed.
+static bool parse_node_list(NodeArray *arr, const char *message, size_t length) {
+	if (length < 14 || memcmp(message, "NODESLIST ", 10) != 0 || message[13] != '\n') {
+		return false;
+	}
+
+	clear_node_array(arr);
+	int skipped = 0;
+	for (size_t i = 14; i < length;) {
+		const char *line = message + i;
+		const char *end = memchr(line, '\n', length - i);
+		size_t line_length = end != NULL ? (size_t) (end - line) : length - i;
+
+		Node node;
+		if (parse_node_line(line, line_length, &node)) {
+			add_node(arr, &node);
+		} else if (line_length > 0 && line[0] != '\0') {
+			skipped++;
+		}
+		i += line_length + 1;
+	}
+
+	if (skipped > 0) {
+		warn("Skipped %d malformed lines in the node list.\n", skipped);
+	}
+	return true;
 }
 
 static void print_node_table(void) {
@@ -79,87 +354,137 @@ static void print_node_table(void) {
 | ID | IP address      | Port  |\n\
 +------------------------------+\n\
 ");
-	for (int i = 0; i < node_arr.length; i++) {
-		Node *node = &node_arr.nodes[i];
+	for (int i = 0; i < ctx->node_arr.length; i++) {
+		Node *node = &ctx->node_arr.nodes[i];
 		printf("| "NODE_ID_OUT" | %-15s | %-5s |\n", node->id, node->ip_addr, node->tcp_port);
 	}
 	printf("+------------------------------+\n");
 }
 
-void request_node_list(char *ring_id_str) {
-	char nodes_msg[10];
-	sprintf(nodes_msg, "NODES %s", ring_id_str);
-	send_ns_message(nodes_msg, 10);
+// Continues the join or chord command with the node list of the ring
+static void show_node_list(enum NodeListAction action, const char *ring_id_str, const NodeArray *list) {
+	if (action == JOIN_ACTION) {
+		ctx->node_arr = *list;
+		if (ctx->node_arr.length == 0) {
+			printf("There are no nodes in node list for the ring %s. We are the only node in the ring.\n", ring_id_str);
+			copy_node(&ctx->succ, &ctx->self);
+			copy_node(&ctx->second_succ, &ctx->self);
+			init_routing();
+			start_saving_routing_state();
+			on_join_end();
+			return;
+		}
 
-	fd_set set;
-	FD_ZERO(&set);
-	FD_SET(ns_socket, &set);
-	int ret = select(FD_SETSIZE, &set, NULL, NULL, &(struct timeval) { .tv_sec = 1 });
-	if (ret == -1) {
-		error("select() error: %s\n", strerror(errno));
+		printf("Nodes currently in the ring:\n");
+		print_node_table();
+
+		// Check whether the given ID is already in use and change it if needed
+		if (find_node(&ctx->node_arr, ctx->self.id) != NULL) {
+			NodeID new_id = 0;
+			while (new_id <= MAX_NODE_ID && find_node(&ctx->node_arr, new_id) != NULL) {
+				new_id++;
+			}
+			if (new_id > MAX_NODE_ID) {
+				printf("No available node IDs left in the ring. Joining procedure aborted.\n");
+				ctx->connection_state = DISCONNECTED;
+				return;
+			}
+			warn("The node ID "NODE_ID_OUT" is already in use, so "NODE_ID_OUT" will be used instead.\n", ctx->self.id, new_id);
+			ctx->self.id = new_id;
+		}
+		ctx->connection_state = AWAITING_USER_SELECTION;
+		ctx->input_state = JOIN_NODE_SELECTION;
+
+	} else if (action == CHORD_ACTION) {
+		// Leave out ourselves and the nodes we are already connected to
+		bool connected[MAX_NODE_ID + 1];
+		get_connected_node_ids(connected);
+		connected[ctx->self.id] = true;
+
+		clear_node_array(&ctx->node_arr);
+		for (int i = 0; i < list->length; i++) {
+			if (!connected[list->nodes[i].id]) {
+				add_node(&ctx->node_arr, &list->nodes[i]);
+			}
+		}
+		if (ctx->node_arr.length == 0) {
+			printf("There are no nodes to which we can create a chord.\n");
+			return;
+		}
+		printf("Nodes you can create a chord to:\n");
+		print_node_table();
+		ctx->input_state = CHORD_NODE_SELECTION;
 	}
-	if (ret == 0) {
+
+	printf("Please select a node ID to use as the %s: ", action == JOIN_ACTION ? "successor" : "chord neighbor");
+	fflush(stdout);
+}
+
+static void node_list_timeout(void) {
+	enum NodeListAction action = ctx->node_list_action;
+	ctx->node_list_action = UNEXPECTED_NODE_LIST;
+
+	if (action == JOIN_ACTION && ctx->connection_state == AWAITING_NODE_LIST) {
 		printf("Timeout while waiting for the node list response from the node server. Connection aborted.\n");
 		leave_ring();
+	} else if (action == CHORD_ACTION) {
+		printf("Timeout while waiting for the node list response from the node server.\n");
+	}
+	fflush(stdout);
+}
+
+void request_node_list(enum NodeListAction action, char *ring_id_str) {
+	long long now = monotonic_ms();
+	NodeListCacheEntry *entry = find_cache_entry(ring_id_str, true);
+	if (entry == NULL) {
+		printf("We didn't join the ring through the node server, so there's no node list. Use the direct chord command instead.\n");
+		return;
+	}
+	if (is_fresh(entry, now)) {
+		vv_printf("Using the cached node list of ring %s.\n", ring_id_str);
+		show_node_list(action, ring_id_str, &entry->list);
 		return;
 	}
 
-	char ns_response_buffer[MAX_UDP_SIZE];
-	ssize_t len = recvfrom(ns_socket, ns_response_buffer, MAX_UDP_SIZE, 0, NULL, 0);
-	if (strncmp(ns_response_buffer, "NODESLIST ", 10) == 0) {
-		parse_node_list(ns_response_buffer, len, node_list_action == CHORD_ACTION);
+	ctx->node_list_action = action;
+	strcpy(ctx->requested_ring_id_str, ring_id_str);
+	send_nodes_request(entry, now);
+	start_timer(&ctx->request_timer, NODE_LIST_TIMEOUT_MS, node_list_timeout);
+}
 
-		if (node_list_action == JOIN_ACTION) {
-			if (node_arr.length == 0) {
-				printf("There are no nodes in node list for the ring %s. We are the only node in the ring.\n", ring_id_str);
-				copy_node(&succ, &self);
-				copy_node(&second_succ, &self);
-				init_routing();
-				on_join_end();
-				return;
-			}
+void handle_node_list_message(const char *message, size_t length) {
+	static NodeArray list;
+	if (!parse_node_list(&list, message, length)) {
+		warn("Malformed node list header.\n");
+		return;
+	}
+	char list_ring_id_str[4];
+	memcpy(list_ring_id_str, message + 10, 3);
+	list_ring_id_str[3] = '\0';
 
-			printf("Nodes currently in the ring:\n");
-			print_node_table();
-
-			// Check whether the given ID is already in use and change it if needed
-			for (int i = 0; i < node_arr.length; i++) {
-				if (node_arr.nodes[i].id == self.id) {
-					NodeID new_id;
-					for (new_id = 0; new_id < 100; new_id++) {
-						for (int j = 0; j < node_arr.length; j++) {
-							if (node_arr.nodes[j].id == new_id) {
-								goto try_next_id;
-							}
-						}
-						// `new_id` now contains an unused node ID
-						break;
-
-						try_next_id:;
-					}
-					if (new_id >= 100) {
-						printf("No available node IDs left in the ring. Joining procedure aborted.\n");
-						connection_state = DISCONNECTED;
-					}
-					warn("The node ID "NODE_ID_OUT" is already in use, so "NODE_ID_OUT" will be used instead.\n", self.id, new_id);
-					self.id = new_id;
-					break;
-				}
-			}
-			connection_state = AWAITING_USER_SELECTION;
-			input_state = JOIN_NODE_SELECTION;
+	// Lists we didn't ask for, e.g. late replies, don't take the entry of a ring we use
+	bool requested = ctx->node_list_action != UNEXPECTED_NODE_LIST && strcmp(list_ring_id_str, ctx->requested_ring_id_str) == 0;
+	NodeListCacheEntry *entry = find_cache_entry(list_ring_id_str, requested);
+	if (entry == NULL) {
+		vv_printf("Ignoring the node list of ring %s, which we didn't request.\n", list_ring_id_str);
+		return;
+	}
+	entry->list = list;
+	entry->fetched_ms = monotonic_ms();
+	entry->requested_ms = -1;
+	entry->invalidated = false;
+	entry->version++;
+	vv_printf("Cached the node list of ring %s with %d nodes.\n", list_ring_id_str, entry->list.length);
 
-		} else if (node_list_action == CHORD_ACTION) {
-			if (node_arr.length == 0) {
-				printf("There are no nodes to which we can create a chord.\n");
-				return;
-			}
-			printf("Nodes you can create a chord to:\n");
-			print_node_table();
-			input_state = CHORD_NODE_SELECTION;
-		}
+	if (!requested) {
+		return;
+	}
+	enum NodeListAction action = ctx->node_list_action;
+	ctx->node_list_action = UNEXPECTED_NODE_LIST;
+	stop_timer(&ctx->request_timer);
 
-		printf("Please select a node ID to use as the %s: ", node_list_action == JOIN_ACTION ? "successor" : "chord neighbor");
-		fflush(stdout);
+	// The user may have left or joined another ring in the meantime
+	if ((action == JOIN_ACTION && ctx->connection_state == AWAITING_NODE_LIST) || (action == CHORD_ACTION && ctx->connection_state == CONNECTED)) {
+		show_node_list(action, list_ring_id_str, &entry->list);
 	}
 }
@@ -1,26 +1,95 @@
 #ifndef NODE_SERVER_H
 #define NODE_SERVER_H
 
-extern int ns_socket;
+#include <stddef.h>
+
+// A node list is used for this long after it arrived before it's requested again
+#define NODE_LIST_TTL_MS 15000
+// How often the node list of our ring is checked for expiry
+#define NODE_LIST_REFRESH_INTERVAL_MS 1000
+// How long we wait for the node server to answer a NODES request
+#define NODE_LIST_TIMEOUT_MS 1000
+// Number of rings whose node lists are cached
+#define NODE_LIST_CACHE_SIZE 4
+
+// REG and UNREG are sent again after this long without a reply, doubling every time up to the maximum
+#define REGISTRATION_RETRY_INITIAL_MS 250
+#define REGISTRATION_RETRY_MAX_MS 4000
+// How many times REG or UNREG is sent before giving up
+#define REGISTRATION_MAX_ATTEMPTS 8
+#define MAX_PENDING_REGISTRATIONS 4
+
+// A node list holds at most one node per ID, so the ID space bounds its length
+#define MAX_NODE_LIST_LENGTH (MAX_NODE_ID + 1)
 
 typedef struct NodeArray {
 	int length;
-	Node nodes[MAX_NODES];
+	Node nodes[MAX_NODE_LIST_LENGTH];
+	// The position of each node ID in `nodes`, or -1
+	int index[MAX_NODE_ID + 1];
 } NodeArray;
 
-// The node list returned by the node server
-extern NodeArray node_arr;
-
 // Determines what to do when we receive a node list
 enum NodeListAction {
 	UNEXPECTED_NODE_LIST,
 	JOIN_ACTION,
 	CHORD_ACTION
 };
-extern enum NodeListAction node_list_action;
+
+void clear_node_array(NodeArray *arr);
+// Returns the node with the given ID, or NULL if it isn't in the array
+const Node *find_node(const NodeArray *arr, NodeID id);
+
+enum RegistrationType {
+	REG_REQUEST,
+	UNREG_REQUEST
+};
+
+// A cached node list. See node-server.c
+typedef struct NodeListCacheEntry {
+	// Empty if the entry is unused
+	char ring_id_str[4];
+	NodeArray list;
+	// When the list arrived, or -1 if it hasn't arrived yet
+	long long fetched_ms;
+	// When the list was last requested, or -1 if there's no request in flight
+	long long requested_ms;
+	bool invalidated;
+	unsigned long version;
+} NodeListCacheEntry;
+
+// A REG or UNREG message which the node server hasn't confirmed yet. See node-server.c
+typedef struct Registration {
+	bool pending;
+	enum RegistrationType type;
+	char ring_id_str[4];
+	NodeID node_id;
+	char message[33];
+	int length;
+	int attempts;
+	long long delay_ms;
+	long long next_attempt_ms;
+	// Orders the requests, so that the oldest one is confirmed first
+	unsigned long sequence;
+} Registration;
 
 int init_ns(char *ns_addr_str, char *ns_port_str);
 void send_ns_message(const char *message, int length);
-void request_node_list(char *ring_id_str);
+// Sends REG or UNREG for ourselves in the current ring until the node server confirms it, and
+// updates the cached node list of the ring
+void register_with_ns(void);
+void unregister_from_ns(void);
+// Handles OKREG or OKUNREG
+void handle_registration_reply(enum RegistrationType type);
+// Shows the nodes of a ring to the user for the join or chord command. The cached node list is used
+// if it's fresh, otherwise it's requested and the action continues when the list arrives.
+void request_node_list(enum NodeListAction action, char *ring_id_str);
+// Returns the cached node list of a ring, or NULL if there's none yet, without waiting for the node server.
+// If the list is expired or invalidated, it's returned anyway and a new one is requested.
+// `version`, if not NULL, is set to a number which changes every time the list is updated.
+const NodeArray *get_node_list(const char *ring_id_str, unsigned long *version);
+// Marks the node list of a ring as outdated, e.g. because a node joined or left
+void invalidate_node_list(const char *ring_id_str);
+void handle_node_list_message(const char *message, size_t length);
 
 #endif
@@ -0,0 +1,299 @@
+// recvmmsg() and sendmmsg() are Linux extensions
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "main.h"
+
+// Node server: keeps the members of each ring and answers REG, UNREG and NODES over UDP, so that
+// rings can be run and load-tested without the public node server.
+//
+// Rings are kept in an open addressing hash table keyed by ring ID. Inside a ring, the members are
+// indexed directly by node ID, since there are only MAX_NODE_ID + 1 of them. The NODESLIST message
+// of each ring is kept until a member registers or unregisters, so a burst of NODES requests
+// doesn't rebuild it. Datagrams are received and answered in batches with recvmmsg() and
+// sendmmsg(), so a single system call handles up to NS_BATCH_SIZE requests.
+
+#define NS_DEFAULT_PORT "59000"
+#define NS_BATCH_SIZE 64
+// Requests are short. Longer datagrams are ignored.
+#define NS_REQUEST_SIZE 128
+#define NS_INITIAL_CAPACITY 64
+// Bigger than the default, so that bursts from many nodes aren't dropped
+#define NS_SOCKET_BUFFER_SIZE (4 * 1024 * 1024)
+
+#define RING_ID_SIZE 4
+// "NODESLIST xxx\n" and one "<id> <ip> <port>\n" line per node
+#define NODESLIST_MAX_SIZE (14 + (MAX_NODE_ID + 1) * (3 + IPV4_ADDR_STR_SIZE + TCP_PORT_STR_SIZE))
+
+typedef struct Ring {
+	// Empty if the slot is unused
+	char id[RING_ID_SIZE];
+	bool registered[MAX_NODE_ID + 1];
+	Node members[MAX_NODE_ID + 1];
+
+	// The reply to NODES, rebuilt when it's requested after a change
+	char list[NODESLIST_MAX_SIZE];
+	int list_length;
+	bool list_valid;
+} Ring;
+
+static Ring *rings;
+static size_t ring_capacity;
+static size_t ring_count;
+
+static int server_socket;
+
+static size_t hash_ring_id(const char *id) {
+	// FNV-1a
+	size_t hash = 2166136261u;
+	for (int i = 0; id[i] != '\0'; i++) {
+		hash = (hash ^ (unsigned char) id[i]) * 16777619u;
+	}
+	return hash;
+}
+
+// Returns the slot of a ring, or the empty slot where it would be inserted.
+// `ring_capacity` is a power of two, so the hash is reduced with a mask.
+static Ring *find_slot(Ring *table, size_t capacity, const char *id) {
+	size_t i = hash_ring_id(id) & (capacity - 1);
+	while (table[i].id[0] != '\0' && strcmp(table[i].id, id) != 0) {
+		i = (i + 1) & (capacity - 1);
+	}
+	return &table[i];
+}
+
+static void grow_rings(void) {
+	size_t new_capacity = ring_capacity * 2;
+	Ring *new_rings = calloc(new_capacity, sizeof(Ring));
+	if (new_rings == NULL) {
+		error("Allocation failed.\n");
+	}
+	for (size_t i = 0; i < ring_capacity; i++) {
+		if (rings[i].id[0] != '\0') {
+			*find_slot(new_rings, new_capacity, rings[i].id) = rings[i];
+		}
+	}
+	free(rings);
+	rings = new_rings;
+	ring_capacity = new_capacity;
+}
+
+// Returns the ring with the given ID, or NULL if it doesn't exist and `create` isn't set.
+// Rings are never removed, since a ring which became empty is usually joined again.
+static Ring *find_ring(const char *id, bool create) {
+	Ring *ring = find_slot(rings, ring_capacity, id);
+	if (ring->id[0] != '\0' || !create) {
+		return ring->id[0] != '\0' ? ring : NULL;
+	}
+
+	// Keep the load factor under 1/2 so that probe sequences stay short
+	if ((ring_count + 1) * 2 > ring_capacity) {
+		grow_rings();
+		ring = find_slot(rings, ring_capacity, id);
+	}
+	strcpy(ring->id, id);
+	ring_count++;
+	return ring;
+}
+
+static void build_node_list(Ring *ring) {
+	int length = sprintf(ring->list, "NODESLIST %s\n", ring->id);
+	for (NodeID id = 0; id <= MAX_NODE_ID; id++) {
+		if (!ring->registered[id]) continue;
+		Node *node = &ring->members[id];
+		length += sprintf(ring->list + length, NODE_ID_OUT" %s %s\n", node->id, node->ip_addr, node->tcp_port);
+	}
+	ring->list_length = length;
+	ring->list_valid = true;
+}
+
+void copy_node(Node *dest, Node *src) {
+	dest->id = src->id;
+	strcpy(dest->ip_addr, src->ip_addr);
+	strcpy(dest->tcp_port, src->tcp_port);
+}
+
+static bool is_valid_ring_id(const char *id) {
+	return strlen(id) == RING_ID_SIZE - 1;
+}
+
+// Handles one request and writes the reply to `reply`. Returns the length of the reply, or 0 if there's none.
+static int handle_request(char *request, char *reply) {
+	char ring_id[RING_ID_SIZE];
+	NodeID id;
+	Node node;
+
+	if (sscanf(request, "REG %3s "NODE_ID_IN" %15s %5s", ring_id, &node.id, node.ip_addr, node.tcp_port) == 4) {
+		if (!is_valid_ring_id(ring_id) || node.id < 0 || node.id > MAX_NODE_ID) goto invalid;
+
+		Ring *ring = find_ring(ring_id, true);
+		ring->registered[node.id] = true;
+		copy_node(&ring->members[node.id], &node);
+		ring->list_valid = false;
+		vv_printf("Node "NODE_ID_OUT" at %s:%s registered in ring %s.\n", node.id, node.ip_addr, node.tcp_port, ring_id);
+		strcpy(reply, "OKREG");
+		return 5;
+
+	} else if (sscanf(request, "UNREG %3s "NODE_ID_IN"", ring_id, &id) == 2) {
+		if (!is_valid_ring_id(ring_id) || id < 0 || id > MAX_NODE_ID) goto invalid;
+
+		Ring *ring = find_ring(ring_id, false);
+		if (ring != NULL && ring->registered[id]) {
+			ring->registered[id] = false;
+			ring->list_valid = false;
+			vv_printf("Node "NODE_ID_OUT" unregistered from ring %s.\n", id, ring_id);
+		}
+		strcpy(reply, "OKUNREG");
+		return 7;
+
+	} else if (sscanf(request, "NODES %3s", ring_id) == 1) {
+		if (!is_valid_ring_id(ring_id)) goto invalid;
+
+		Ring *ring = find_ring(ring_id, false);
+		if (ring == NULL) {
+			return sprintf(reply, "NODESLIST %s\n", ring_id);
+		}
+		if (!ring->list_valid) {
+			build_node_list(ring);
+		}
+		memcpy(reply, ring->list, ring->list_length);
+		return ring->list_length;
+	}
+
+	invalid:
+	v_printf("Ignoring invalid request: %s\n", request);
+	return 0;
+}
+
+static void send_replies(struct mmsghdr *replies, int count) {
+	int sent = 0;
+	while (sent < count) {
+		int n = sendmmsg(server_socket, replies + sent, count - sent, 0);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			// Only the first message failed, e.g. because the address is unreachable. Skip it.
+			v_printf("Couldn't send a reply: %s\n", strerror(errno));
+			sent++;
+			continue;
+		}
+		sent += n;
+	}
+}
+
+static void serve(void) {
+	static char requests[NS_BATCH_SIZE][NS_REQUEST_SIZE + 1];
+	static char reply_buffers[NS_BATCH_SIZE][NODESLIST_MAX_SIZE];
+	static struct sockaddr_storage addrs[NS_BATCH_SIZE];
+	static struct iovec request_iovs[NS_BATCH_SIZE];
+	static struct iovec reply_iovs[NS_BATCH_SIZE];
+	static struct mmsghdr msgs[NS_BATCH_SIZE];
+	static struct mmsghdr replies[NS_BATCH_SIZE];
+
+	for (int i = 0; i < NS_BATCH_SIZE; i++) {
+		request_iovs[i].iov_base = requests[i];
+		request_iovs[i].iov_len = NS_REQUEST_SIZE;
+		msgs[i].msg_hdr.msg_iov = &request_iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+	}
+
+	while (true) {
+		for (int i = 0; i < NS_BATCH_SIZE; i++) {
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+		}
+
+		// Blocks until there's one datagram, then takes the ones already waiting
+		int n = recvmmsg(server_socket, msgs, NS_BATCH_SIZE, MSG_WAITFORONE, NULL);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			error("Couldn't receive requests: %s\n", strerror(errno));
+		}
+
+		int reply_count = 0;
+		for (int i = 0; i < n; i++) {
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				v_printf("Ignoring a request which is too big.\n");
+				continue;
+			}
+			// Some nodes include the null character in the message, others don't
+			requests[i][msgs[i].msg_len] = '\0';
+
+			int length = handle_request(requests[i], reply_buffers[reply_count]);
+			if (length == 0) continue;
+
+			reply_iovs[reply_count].iov_base = reply_buffers[reply_count];
+			reply_iovs[reply_count].iov_len = length;
+			replies[reply_count].msg_hdr = (struct msghdr) {
+				.msg_name = &addrs[i],
+				.msg_namelen = msgs[i].msg_hdr.msg_namelen,
+				.msg_iov = &reply_iovs[reply_count],
+				.msg_iovlen = 1,
+			};
+			reply_count++;
+		}
+
+		send_replies(replies, reply_count);
+	}
+}
+
+int main(int argc, char **argv) {
+	while (true) {
+		int opt = getopt(argc, argv, "v:");
+		if (opt == -1) break;
+		switch (opt) {
+			case 'v':
+				verbose_level = atoi(optarg);
+				if (verbose_level < 0) verbose_level = 0;
+				break;
+
+			default:
+				fprintf(stderr, "Usage: NS [-v <verbosity level>] [<IP> [<UDP port>]]\n");
+				exit(1);
+				break;
+		}
+	}
+
+	char *addr_str = argc > optind ? argv[optind] : NULL;
+	char *port_str = argc > optind + 1 ? argv[optind + 1] : NS_DEFAULT_PORT;
+
+	server_socket = socket(AF_INET, SOCK_DGRAM, 0); // UDP over IPv4
+	if (server_socket == -1)
+		error("Couldn't create UDP socket: %s\n", strerror(errno));
+
+	int buffer_size = NS_SOCKET_BUFFER_SIZE;
+	setsockopt(server_socket, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+	setsockopt(server_socket, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+	struct addrinfo hints = {0};
+	hints.ai_family = AF_INET;      // IPv4
+	hints.ai_socktype = SOCK_DGRAM; // UDP socket
+	hints.ai_flags = AI_PASSIVE;
+
+	struct addrinfo *ai;
+	int errcode = getaddrinfo(addr_str, port_str, &hints, &ai);
+	if (errcode != 0)
+		error("Couldn't get the address to listen on: %s\n", gai_strerror(errcode));
+
+	if (bind(server_socket, ai->ai_addr, ai->ai_addrlen) == -1)
+		error("Couldn't bind the UDP socket: %s\n", strerror(errno));
+	freeaddrinfo(ai);
+
+	ring_capacity = NS_INITIAL_CAPACITY;
+	rings = calloc(ring_capacity, sizeof(Ring));
+	if (rings == NULL) {
+		error("Allocation failed.\n");
+	}
+
+	printf("Node server listening on UDP port %s.\n", port_str);
+	fflush(stdout);
+	serve();
+	return 0;
+}
@@ -0,0 +1,240 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "main.h"
+
+// Token bucket rate limiting and per-source fair queueing for relayed CHAT messages.
+//
+// Every outbound neighbor has a token bucket which is refilled at `rate` tokens per second and
+// holds at most `burst` tokens. Each relayed message costs one token. When the bucket is empty,
+// messages wait in the connection's queue, which is split per source node and served in
+// round-robin order, so that a single chatty sender only delays its own messages.
+// Messages sent by this node itself are never limited.
+
+static RateLimitConfig *get_limit(NodeID neighbor_id) {
+	if (neighbor_id >= 0 && ctx->neighbor_rate_limits[neighbor_id].set) {
+		return &ctx->neighbor_rate_limits[neighbor_id];
+	}
+	return &ctx->default_rate_limit;
+}
+
+void rate_limit_init(RateLimiter *limiter) {
+	limiter->tokens = -1; // Filled on the first refill
+	limiter->last_refill_ms = 0;
+	for (QueueIndex i = 0; i < RATE_LIMIT_QUEUE_SIZE; i++) {
+		limiter->slots[i].next = i + 1 < RATE_LIMIT_QUEUE_SIZE ? i + 1 : NO_QUEUE_INDEX;
+	}
+	limiter->free_slots = 0;
+	for (int i = 0; i <= MAX_NODE_ID; i++) {
+		limiter->heads[i] = NO_QUEUE_INDEX;
+		limiter->tails[i] = NO_QUEUE_INDEX;
+		limiter->source_lengths[i] = 0;
+	}
+	limiter->next_source = 0;
+	limiter->length = 0;
+}
+
+// Drops every queued message. Called when the connection is closed.
+void rate_limit_discard(struct Connection *conn) {
+	if (conn->limiter.length > 0 && conn->node_id != -1) {
+		ctx->rate_limit_stats[conn->node_id].dropped += conn->limiter.length;
+	}
+	rate_limit_init(&conn->limiter);
+}
+
+static void refill(RateLimiter *limiter, const RateLimitConfig *limit, long long now) {
+	if (limiter->tokens < 0) {
+		limiter->tokens = limit->burst;
+	} else {
+		limiter->tokens += (now - limiter->last_refill_ms) * limit->rate / 1000;
+		if (limiter->tokens > limit->burst) {
+			limiter->tokens = limit->burst;
+		}
+	}
+	limiter->last_refill_ms = now;
+}
+
+static bool enqueue(RateLimiter *limiter, NodeID source_id, const char *line) {
+	if (source_id < 0 || source_id > MAX_NODE_ID) {
+		return false;
+	}
+	if (limiter->free_slots == NO_QUEUE_INDEX || limiter->source_lengths[source_id] >= RATE_LIMIT_MAX_PER_SOURCE) {
+		return false;
+	}
+
+	QueueIndex slot = limiter->free_slots;
+	limiter->free_slots = limiter->slots[slot].next;
+
+	strncpy(limiter->slots[slot].line, line, MAX_NODE_MESSAGE_SIZE - 1);
+	limiter->slots[slot].line[MAX_NODE_MESSAGE_SIZE - 1] = '\0';
+	limiter->slots[slot].next = NO_QUEUE_INDEX;
+
+	if (limiter->tails[source_id] == NO_QUEUE_INDEX) {
+		limiter->heads[source_id] = slot;
+	} else {
+		limiter->slots[limiter->tails[source_id]].next = slot;
+	}
+	limiter->tails[source_id] = slot;
+	limiter->source_lengths[source_id]++;
+	limiter->length++;
+	return true;
+}
+
+// Removes the next message in round-robin order from the queue and returns its slot index.
+// The slot must be released with `release_slot()` after the message is used.
+static QueueIndex dequeue(RateLimiter *limiter) {
+	if (limiter->length == 0) {
+		return NO_QUEUE_INDEX;
+	}
+
+	NodeID source_id = limiter->next_source;
+	while (limiter->heads[source_id] == NO_QUEUE_INDEX) {
+		source_id = (source_id + 1) % (MAX_NODE_ID + 1);
+	}
+
+	QueueIndex slot = limiter->heads[source_id];
+	limiter->heads[source_id] = limiter->slots[slot].next;
+	if (limiter->heads[source_id] == NO_QUEUE_INDEX) {
+		limiter->tails[source_id] = NO_QUEUE_INDEX;
+	}
+	limiter->source_lengths[source_id]--;
+	limiter->length--;
+	limiter->next_source = (source_id + 1) % (MAX_NODE_ID + 1);
+	return slot;
+}
+
+static void release_slot(RateLimiter *limiter, QueueIndex slot) {
+	limiter->slots[slot].next = limiter->free_slots;
+	limiter->free_slots = slot;
+}
+
+static void drain_queues(void);
+
+// Schedules the drain timer for when the first queued message can be sent
+static void schedule_drain(void) {
+	long long delay = -1;
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		struct Connection *conn = &ctx->connections[i];
+		if (conn->socket == -1 || conn->limiter.length == 0) continue;
+
+		RateLimitConfig *limit = get_limit(conn->node_id);
+		long long conn_delay = 0;
+		if (limit->rate > 0 && conn->limiter.tokens < 1) {
+			conn_delay = (long long) ((1 - conn->limiter.tokens) * 1000 / limit->rate) + 1;
+		}
+		if (delay == -1 || conn_delay < delay) {
+			delay = conn_delay;
+		}
+	}
+
+	if (delay == -1) {
+		stop_timer(&ctx->drain_timer);
+	} else {
+		start_timer(&ctx->drain_timer, delay, drain_queues);
+	}
+}
+
+static void drain_queues(void) {
+	long long now = monotonic_ms();
+	if (now < 0) {
+		warn("Couldn't get current time: %s", strerror(errno));
+		return;
+	}
+
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		struct Connection *conn = &ctx->connections[i];
+		if (conn->socket == -1 || conn->limiter.length == 0) continue;
+
+		RateLimitConfig *limit = get_limit(conn->node_id);
+		refill(&conn->limiter, limit, now);
+		// The limit may have been disabled while messages were queued
+		while (conn->limiter.length > 0 && (limit->rate <= 0 || conn->limiter.tokens >= 1)) {
+			QueueIndex slot = dequeue(&conn->limiter);
+			conn->limiter.tokens--;
+
+			char line[MAX_NODE_MESSAGE_SIZE];
+			strcpy(line, conn->limiter.slots[slot].line);
+			release_slot(&conn->limiter, slot);
+
+			NodeID neighbor_id = conn->node_id;
+			stamp_trace_line(line);
+			if (conn_printf(conn->socket, "%s", line) < 0) {
+				// The connection was closed and its queue discarded
+				ctx->rate_limit_stats[neighbor_id].dropped++;
+				break;
+			}
+			ctx->rate_limit_stats[neighbor_id].forwarded++;
+		}
+	}
+
+	schedule_drain();
+}
+
+void set_rate_limit(NodeID neighbor_id, double rate, double burst) {
+	RateLimitConfig *limit = neighbor_id == NO_NODE_ID ? &ctx->default_rate_limit : &ctx->neighbor_rate_limits[neighbor_id];
+	limit->rate = rate;
+	limit->burst = burst < 1 ? 1 : burst;
+	limit->set = true;
+
+	// Queued messages may now be sent sooner
+	schedule_drain();
+}
+
+int rate_limited_send(struct Connection *conn, NodeID source_id, const char *line) {
+	NodeID neighbor_id = conn->node_id;
+	RateLimitConfig *limit = get_limit(neighbor_id);
+	RateLimiter *limiter = &conn->limiter;
+
+	if (limit->rate > 0) {
+		long long now = monotonic_ms();
+		if (now < 0) {
+			warn("Couldn't get current time: %s", strerror(errno));
+		} else {
+			refill(limiter, limit, now);
+		}
+
+		if (limiter->length > 0 || limiter->tokens < 1) {
+			if (!enqueue(limiter, source_id, line)) {
+				vv_printf("The queue for neighbor "NODE_ID_OUT" is full. Dropping a message from node "NODE_ID_OUT".\n", neighbor_id, source_id);
+				ctx->rate_limit_stats[neighbor_id].dropped++;
+				return -1;
+			}
+			ctx->rate_limit_stats[neighbor_id].delayed++;
+			schedule_drain();
+			return 0;
+		}
+		limiter->tokens--;
+	}
+
+	if (conn_printf(conn->socket, "%s", line) < 0) {
+		ctx->rate_limit_stats[neighbor_id].dropped++;
+		return -1;
+	}
+	ctx->rate_limit_stats[neighbor_id].forwarded++;
+	return 0;
+}
+
+void print_rate_limit_stats(void) {
+	printf("\
++----+-----------+-----------+-----------+--------+------------------+\n\
+| ID | Forwarded | Delayed   | Dropped   | Queued | Limit (msg/s)    |\n\
++----+-----------+-----------+-----------+--------+------------------+\n\
+");
+	for (NodeID id = 0; id <= MAX_NODE_ID; id++) {
+		RateLimitStats *stats = &ctx->rate_limit_stats[id];
+		struct Connection *conn = find_connection_by_node_id(id);
+		if (conn == NULL && stats->forwarded == 0 && stats->delayed == 0 && stats->dropped == 0) continue;
+
+		RateLimitConfig *limit = get_limit(id);
+		char limit_str[32];
+		if (limit->rate > 0) {
+			snprintf(limit_str, sizeof(limit_str), "%.1f (burst %.0f)", limit->rate, limit->burst);
+		} else {
+			strcpy(limit_str, "none");
+		}
+		printf("| "NODE_ID_OUT" | %9lu | %9lu | %9lu | %6d | %-16s |\n", id, stats->forwarded, stats->delayed, stats->dropped, conn != NULL ? conn->limiter.length : 0, limit_str);
+	}
+	printf("+----+-----------+-----------+-----------+--------+------------------+\n");
+}
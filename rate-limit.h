@@ -0,0 +1,68 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include "main.h"
+
+// Maximum number of relayed messages waiting to be sent to a single neighbor
+#define RATE_LIMIT_QUEUE_SIZE 32
+// Maximum number of queued messages from a single source, so that one sender can't fill the queue
+#define RATE_LIMIT_MAX_PER_SOURCE 8
+
+typedef signed char QueueIndex;
+#define NO_QUEUE_INDEX ((QueueIndex) -1)
+
+typedef struct QueuedMessage {
+	// The full CHAT line, including the line feed
+	char line[MAX_NODE_MESSAGE_SIZE];
+	// The next message from the same source. Also used to link the free slots.
+	QueueIndex next;
+} QueuedMessage;
+
+// Per-connection token bucket and fair queue for relayed CHAT messages.
+// Messages are queued per source node and dequeued in round-robin order between sources.
+typedef struct RateLimiter {
+	double tokens;
+	long long last_refill_ms;
+
+	QueuedMessage slots[RATE_LIMIT_QUEUE_SIZE];
+	QueueIndex free_slots;
+	// Per-source FIFO queues, indexed by node ID
+	QueueIndex heads[MAX_NODE_ID + 1];
+	QueueIndex tails[MAX_NODE_ID + 1];
+	unsigned char source_lengths[MAX_NODE_ID + 1];
+	// The source which will be served next
+	NodeID next_source;
+	int length;
+} RateLimiter;
+
+// Per-neighbor counters. They are kept by node ID so that they survive reconnections.
+typedef struct RateLimitStats {
+	// Relayed messages written to the socket
+	unsigned long forwarded;
+	// Relayed messages which had to wait in the queue
+	unsigned long delayed;
+	// Relayed messages discarded because the queue was full or the connection was closed
+	unsigned long dropped;
+} RateLimitStats;
+
+typedef struct RateLimitConfig {
+	// Tokens per second. 0 means the limit is disabled.
+	double rate;
+	double burst;
+	// Whether this entry overrides the default limit
+	bool set;
+} RateLimitConfig;
+
+struct Connection;
+
+void rate_limit_init(RateLimiter *limiter);
+void rate_limit_discard(struct Connection *conn);
+// Sets the limit for one neighbor, or for every neighbor without its own limit if `neighbor_id == NO_NODE_ID`.
+// A rate of 0 disables the limit.
+void set_rate_limit(NodeID neighbor_id, double rate, double burst);
+// Sends a relayed CHAT line to a neighbor, queueing or dropping it if the neighbor's rate limit was reached.
+// Returns -1 if the message was dropped or couldn't be written.
+int rate_limited_send(struct Connection *conn, NodeID source_id, const char *line);
+void print_rate_limit_stats(void);
+
+#endif
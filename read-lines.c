@@ -3,7 +3,7 @@
 
 #include "read-lines.h"
 
-enum RLResult read_lines(int fd, char *buffer, int *buffer_index, int buffer_size, void (*handler)(int fd, char *line)) {
+enum RLResult read_lines(int fd, char *buffer, int *buffer_index, int buffer_size, bool (*handler)(int fd, char *line)) {
 	int len = read(fd, buffer + *buffer_index, buffer_size - *buffer_index);
 	if (len == -1) {
 		return RL_ERROR;
@@ -13,12 +13,17 @@ enum RLResult read_lines(int fd, char *buffer, int *buffer_index, int buffer_siz
 	}
 
 	// The recieved bytes may contain several messages
+	// Bytes before `*buffer_index` were already checked for line feeds in previous calls
 	int message_start_index = 0;
-	for (int i = 0; i < len; i++) {
+	for (int i = *buffer_index; i < *buffer_index + len; i++) {
 		if (buffer[i] == '\n') {
 			buffer[i] = '\0';
-			handler(fd, buffer + message_start_index);
+			char *line = buffer + message_start_index;
 			message_start_index = i + 1;
+			if (!handler(fd, line)) {
+				// The buffer may no longer belong to this file descriptor
+				return RL_OK;
+			}
 		}
 	}
 
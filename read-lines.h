@@ -1,6 +1,8 @@
 #ifndef READ_LINES_H
 #define READ_LINES_H
 
+#include <stdbool.h>
+
 enum RLResult {
 	// All good
 	RL_OK,
@@ -18,6 +20,7 @@ enum RLResult {
 // buffer_index: pointer to opaque index
 // buffer_size: size of buffer
 // handler: function called for every line received. The line string will be null-terminated.
-enum RLResult read_lines(int fd, char *buffer, int *buffer_index, int buffer_size, void (*handler)(int fd, char *line));
+//          It returns `false` if the remaining lines must be discarded (e.g. because it closed the file descriptor).
+enum RLResult read_lines(int fd, char *buffer, int *buffer_index, int buffer_size, bool (*handler)(int fd, char *line));
 
 #endif
@@ -20,55 +20,143 @@
 #include "util.h"
 #include "routing.h"
 
-enum ConnectionState connection_state = DISCONNECTED;
-
-// The successor's ID is also stored in `succ.id`
-Node self, succ, second_succ;
-
-// CONNECTING only
-// Whether we are waiting for the successor to tell us who our second successor is via a SUCC message
-bool awaiting_succ;
-// Whether we are waiting for the predecessor to tell us what its ID is via a PRED message
-bool awaiting_pred;
+// Our connection to a node couldn't be established. Nothing was received on it, so there are no
+// routes via it to remove.
+static void handle_failed_connect(struct Connection *conn) {
+	printf("Couldn't connect to the node (%s:%s) via TCP: %s\n", conn->ip_addr, conn->tcp_port, strerror(errno));
+	// The node list which offered the node may be outdated
+	invalidate_node_list(ctx->ring_id_str);
+
+	if (conn == ctx->succ_conn && ctx->connection_state == CONNECTING) {
+		printf("Join procedure aborted.\n");
+		leave_ring();
+	} else if (conn == ctx->succ_conn && ctx->connection_state == CONNECTED) {
+		printf("Couldn't connect to the new successor. Left the ring.\n");
+		leave_ring();
+	} else if (conn == ctx->standby_conn) {
+		printf("Couldn't connect to the second successor. Continuing without a standby connection.\n");
+		close_connection(conn);
+	} else {
+		if (conn->outbound_chord == USER_CHORD) {
+			printf("Chord connection procedure aborted.\n");
+		}
+		close_connection(conn);
+	}
+}
 
-// This is an empty string if we connected to another node or another node connected to us using the direct join command.
-char ring_id_str[4];
+static void expire_connects(void) {
+	long long now = monotonic_ms();
+	long long next_deadline = -1;
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		struct Connection *conn = &ctx->connections[i];
+		if (conn->socket == -1 || !conn->connecting) continue;
+
+		if (conn->connect_deadline_ms <= now) {
+			errno = ETIMEDOUT;
+			handle_failed_connect(conn);
+		} else if (next_deadline == -1 || conn->connect_deadline_ms < next_deadline) {
+			next_deadline = conn->connect_deadline_ms;
+		}
+	}
 
+	if (next_deadline != -1) {
+		start_timer(&ctx->connect_timer, next_deadline - now, expire_connects);
+	}
+}
 
+// The connection may still be in progress when this returns. Messages can be written to it right
+// away: they are sent once it's established (see `finish_connection()`). If it fails, it's handled
+// like a connect() which failed at once, e.g. we leave the ring if it was to the successor.
 struct Connection *connect_to_node(struct Node *node) {
-	int s = socket(AF_INET, SOCK_STREAM, 0); // TCP over IPv4
+	int s = transport->connect(node);
 	if (s == -1) {
-		printf("Connection error: Couldn't create TCP socket to connect to node: %s\n", strerror(errno));
 		return NULL;
 	}
 
 	struct Connection *conn = add_connection(s);
+	if (conn == NULL) {
+		printf("Connection error: Too many connections.\n");
+		transport->close(s);
+		return NULL;
+	}
 	conn->node_id = node->id;
 	strcpy(conn->ip_addr, node->ip_addr);
 	strcpy(conn->tcp_port, node->tcp_port);
+	if (transport->finish_connect != NULL) {
+		conn->connecting = true;
+		conn->connect_deadline_ms = monotonic_ms() + CONNECT_TIMEOUT_MS;
+		FD_SET(s, &select_outputs);
+		// Later deadlines are found when the timer expires
+		if (!ctx->connect_timer.active) {
+			start_timer(&ctx->connect_timer, CONNECT_TIMEOUT_MS, expire_connects);
+		}
+	}
+
+	// Tells a node in several rings which one the connection is for. Other nodes ignore it.
+	if (ctx->ring_tag[0] != '\0' && conn_printf(s, "RING %s\n", ctx->ring_tag) < 0) {
+		return NULL;
+	}
+	return conn;
+}
 
-	struct addrinfo hints = {
-		.ai_family = AF_INET,      // IPv4
-		.ai_socktype = SOCK_STREAM // TCP
-	};
+static void expire_handshakes(void) {
+	long long now = monotonic_ms();
+	long long next_deadline = -1;
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		struct Connection *conn = &ctx->connections[i];
+		if (conn->socket == -1 || !conn->pending) continue;
 
-	struct addrinfo *ai;
+		if (conn->handshake_deadline_ms <= now) {
+			v_printf("The node at %s didn't say what its connection is for in time. Closing the connection.\n", conn->ip_addr);
+			close_connection(conn);
+		} else if (next_deadline == -1 || conn->handshake_deadline_ms < next_deadline) {
+			next_deadline = conn->handshake_deadline_ms;
+		}
+	}
 
-	int ret;
-	ret = getaddrinfo(node->ip_addr, node->tcp_port, &hints, &ai);
-	if (ret != 0) {
-		printf("Connection error: Invalid node IP address: %s\n", gai_strerror(ret));
-		return NULL;
+	if (next_deadline != -1) {
+		start_timer(&ctx->handshake_timer, next_deadline - now, expire_handshakes);
 	}
+}
 
-	ret = connect(conn->socket, ai->ai_addr, ai->ai_addrlen);
-	freeaddrinfo(ai);
-	if (ret != 0) {
-		printf("Couldn't connect to the node (%s:%s) via TCP: %s\n", node->ip_addr, node->tcp_port, strerror(errno));
-		return NULL;
+void start_handshake(struct Connection *conn) {
+	conn->pending = true;
+	conn->handshake_deadline_ms = monotonic_ms() + HANDSHAKE_TIMEOUT_MS;
+	// Later deadlines are found when the timer expires
+	if (!ctx->handshake_timer.active) {
+		start_timer(&ctx->handshake_timer, HANDSHAKE_TIMEOUT_MS, expire_handshakes);
 	}
+}
 
-	return conn;
+static void expire_leaving_connections(void) {
+	long long now = monotonic_ms();
+	long long next_deadline = -1;
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		struct Connection *conn = &ctx->connections[i];
+		if (conn->socket == -1 || !conn->leaving) continue;
+
+		if (conn->leaving_deadline_ms <= now) {
+			v_printf("Node "NODE_ID_OUT" didn't close the connection it no longer uses in time. Closing it.\n", conn->node_id);
+			close_connection(conn);
+		} else if (next_deadline == -1 || conn->leaving_deadline_ms < next_deadline) {
+			next_deadline = conn->leaving_deadline_ms;
+		}
+	}
+
+	if (next_deadline != -1) {
+		start_timer(&ctx->leaving_timer, next_deadline - now, expire_leaving_connections);
+	}
+}
+
+// Takes the role of a connection away. It's kept open until the node closes it, or until the deadline
+// passes, so that it doesn't hold a connection slot forever.
+static void set_leaving(struct Connection *conn) {
+	conn->leaving = true;
+	conn->leaving_deadline_ms = monotonic_ms() + LEAVING_CONNECTION_TIMEOUT_MS;
+	// Later deadlines are found when the timer expires
+	if (!ctx->leaving_timer.active) {
+		start_timer(&ctx->leaving_timer, LEAVING_CONNECTION_TIMEOUT_MS, expire_leaving_connections);
+	}
 }
 
 static void pred_timeout(void) {
@@ -76,94 +164,229 @@ static void pred_timeout(void) {
 	leave_ring();
 }
 
+void finish_connection(struct Connection *conn) {
+	if (transport->finish_connect(conn->socket) < 0) {
+		handle_failed_connect(conn);
+		return;
+	}
+	conn->connecting = false;
+	FD_CLR(conn->socket, &select_outputs);
+	conn->last_received_ms = monotonic_ms();
+	vv_printf("The connection to node "NODE_ID_OUT" is established.\n", conn->node_id);
+	flush_connect_queue(conn);
+
+	// When joining, the predecessor can only connect once the successor reads our ENTRY message
+	if (conn == ctx->succ_conn && ctx->connection_state == CONNECTING && ctx->awaiting_pred) {
+		set_timeout(1000, pred_timeout);
+	}
+}
+
 // Leaves the ring or aborts the joining procedure
 void leave_ring(void) {
-	if (connection_state == CONNECTED && ring_id_str[0] != '\0') {
-		char unreg_msg[13];
-		sprintf(unreg_msg, "UNREG %s "NODE_ID_OUT"", ring_id_str, self.id);
-		send_ns_message(unreg_msg, 12);
+	if (ctx->connection_state == CONNECTED && ctx->ring_id_str[0] != '\0') {
+		unregister_from_ns();
 	}
 
 	for (int i = 0; i < MAX_CONNECTIONS; i++) {
-		close_connection(&connections[i]);
+		close_connection(&ctx->connections[i]);
 	}
 
-	connection_state = DISCONNECTED;
+	stop_timer(&ctx->leave_timer);
+	ctx->connection_state = DISCONNECTED;
+}
+
+static void finish_leave(void) {
+	leave_ring();
+	printf("Left the ring.\n");
+	fflush(stdout);
+}
+
+// The LEAVE message tells the predecessor to connect to our successor right away instead of waiting
+// for our connection to break, and tells every neighbor to drop the routes through us all at once.
+// The neighbors keep the connections open and stop sending to us, and we keep relaying the
+// messages which were already on their way until the grace period is over.
+// Neighbors which don't support LEAVE find out when the connections are closed, as usual.
+void leave_ring_gracefully(void) {
+	forget_routing_state();
+	if (ctx->connection_state != CONNECTED || ctx->succ.id == ctx->self.id) {
+		leave_ring();
+		printf("Left the ring.\n");
+		return;
+	}
+
+	if (ctx->ring_id_str[0] != '\0') {
+		unregister_from_ns();
+	}
+	ctx->connection_state = LEAVING;
+	cancel_timeout();
+
+	int notified = 0;
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		struct Connection *conn = &ctx->connections[i];
+		if (conn->socket == -1 || conn->node_id == -1 || conn->pending || !supports_extensions(conn)) continue;
+		if (conn_printf(conn->socket, "LEAVE "NODE_ID_OUT" %s %s\n", ctx->succ.id, ctx->succ.ip_addr, ctx->succ.tcp_port) >= 0) {
+			notified++;
+		}
+	}
+
+	if (notified == 0) {
+		finish_leave();
+		return;
+	}
+	v_printf("Announced that we are leaving to %d neighbors. Relaying messages for %d ms before closing the connections.\n", notified, LEAVE_GRACE_MS);
+	start_timer(&ctx->leave_timer, LEAVE_GRACE_MS, finish_leave);
 }
 
 void join_ring(void) {
 	init_routing();
+	if (restore_routing_state()) {
+		// The successor answers the ENTRY message with its whole table
+		drop_restored_paths(ctx->succ.id);
+	}
 
-	connection_state = CONNECTING;
-	awaiting_succ = true;
-	awaiting_pred = true;
+	ctx->connection_state = CONNECTING;
+	ctx->awaiting_succ = true;
+	ctx->awaiting_pred = true;
 
-	pred_conn = NULL;
-	outbound_chord_conn = NULL;
-	new_node_conn = NULL;
-	succ_conn = connect_to_node(&succ);
-	if (succ_conn == NULL) {
+	ctx->pred_conn = NULL;
+	ctx->standby_conn = NULL;
+	ctx->succ_conn = connect_to_node(&ctx->succ);
+	if (ctx->succ_conn == NULL) {
 		printf("Join procedure aborted.\n");
+		// The node list offered a node which is gone, so don't offer it again
+		invalidate_node_list(ctx->ring_id_str);
 		leave_ring();
 		return;
 	}
 
 	if (
-		conn_printf(succ_conn->socket, "ENTRY "NODE_ID_OUT" %s %s\n", self.id, self.ip_addr, self.tcp_port) < 0 ||
-		send_shortest_paths(succ_conn) < 0
+		conn_printf(ctx->succ_conn->socket, "ENTRY "NODE_ID_OUT" %s %s\n", ctx->self.id, ctx->self.ip_addr, ctx->self.tcp_port) < 0 ||
+		send_shortest_paths(ctx->succ_conn) < 0
 	) {
 		return;
 	}
 
-	set_timeout(1000, pred_timeout);
+	// Otherwise it's started once the connection is established
+	if (!ctx->succ_conn->connecting) {
+		set_timeout(1000, pred_timeout);
+	}
 
 	v_printf("Connected to the successor and sent the ENTRY message.\n");
 }
 
+static void remove_neighbor_connection(NodeID node_id) {
+	// Update the routing table if there are no longer any direct connections to a node.
+	if (node_id != -1 && find_connection_by_node_id(node_id) == NULL) {
+		remove_routing_neighbor(node_id);
+	}
+}
+
+static bool is_chord(struct Connection *conn) {
+	return conn->outbound_chord != NO_OUTBOUND_CHORD || conn == ctx->standby_conn || is_inbound_chord(conn);
+}
+
+// Opens, replaces or closes the standby connection so that it goes to the current second successor
+static void update_standby(void) {
+	bool needed = (
+		ctx->standby_enabled &&
+		ctx->connection_state == CONNECTED &&
+		!ctx->awaiting_succ &&
+		ctx->second_succ.id != ctx->self.id &&
+		ctx->second_succ.id != ctx->succ.id
+	);
+
+	if (ctx->standby_conn != NULL && (!needed || ctx->standby_conn->node_id != ctx->second_succ.id)) {
+		NodeID id = ctx->standby_conn->node_id;
+		v_printf("Closing the standby connection to node "NODE_ID_OUT".\n", id);
+		close_connection(ctx->standby_conn);
+		remove_neighbor_connection(id);
+	}
+	if (!needed || ctx->standby_conn != NULL) {
+		return;
+	}
+	if (find_connection_by_node_id(ctx->second_succ.id) != NULL) {
+		// We already have a connection to it (e.g. it's our predecessor)
+		return;
+	}
+
+	v_printf("Opening a standby connection to the second successor "NODE_ID_OUT".\n", ctx->second_succ.id);
+	ctx->standby_conn = connect_to_node(&ctx->second_succ);
+	if (ctx->standby_conn == NULL) {
+		printf("Couldn't connect to the second successor. Continuing without a standby connection.\n");
+		return;
+	}
+	if (
+		begin_table_sync(ctx->standby_conn) < 0 ||
+		conn_printf(ctx->standby_conn->socket, "CHORD "NODE_ID_OUT"\n", ctx->self.id) < 0
+	) {
+		return;
+	}
+}
+
+void set_standby(bool enabled) {
+	ctx->standby_enabled = enabled;
+	update_standby();
+}
+
 // Executed when we recieve both the PRED and SUCC messages
 void on_join_end(void) {
 	printf("Join successeful. We are now in a ring.\n");
-	connection_state = CONNECTED;
+	ctx->connection_state = CONNECTED;
+	update_standby();
+	restore_chords();
 
 	// Register to the node server unless direct join was used
-	if (ring_id_str[0] != '\0') {
-		char reg_msg[33];
-		int length = sprintf(reg_msg, "REG %s "NODE_ID_OUT" %s %s", ring_id_str, self.id, self.ip_addr, self.tcp_port);
-		send_ns_message(reg_msg, length);
+	if (ctx->ring_id_str[0] != '\0') {
+		register_with_ns();
 	}
 }
 
+// Connects to a node and sends the CHORD message. Returns NULL if it failed.
+struct Connection *open_chord(struct Node *node) {
+	v_printf("Establishing a chord with the node with ID "NODE_ID_OUT" at %s:%s.\n", node->id, node->ip_addr, node->tcp_port);
+	struct Connection *conn = connect_to_node(node);
+	if (conn == NULL) {
+		return NULL;
+	}
+
+	unsigned long generation = conn->generation;
+	if (
+		begin_table_sync(conn) < 0 ||
+		conn_printf(conn->socket, "CHORD "NODE_ID_OUT"\n", ctx->self.id) < 0
+	) {
+		printf("Couldn't write to the outbound chord socket.\n");
+		return NULL;
+	}
+	return conn->generation == generation ? conn : NULL;
+}
+
 void create_outbound_chord(struct Node *node) {
+	if (node->id == ctx->self.id) {
+		printf("We can't create a chord to ourselves.\n");
+		return;
+	}
 	if (find_connection_by_node_id(node->id) != NULL) {
 		printf("We are already connected to node "NODE_ID_OUT". No chord was created.\n", node->id);
-		// return;
-	}
-
-	v_printf("Establishing a chord with the node with ID "NODE_ID_OUT" at %s:%s.\n", node->id, node->ip_addr, node->tcp_port);
-	outbound_chord_conn = connect_to_node(node);
-	if (outbound_chord_conn == NULL) {
-		printf("Chord connection procedure aborted.\n");
 		return;
 	}
 
-	if (
-		conn_printf(outbound_chord_conn->socket, "CHORD "NODE_ID_OUT"\n", self.id) < 0 ||
-		send_shortest_paths(outbound_chord_conn) < 0
-	) {
-		printf("Couldn't write to the outbound chord socket. Chord connection procedure aborted.\n");
+	struct Connection *conn = open_chord(node);
+	if (conn == NULL) {
+		printf("Chord connection procedure aborted.\n");
 		fflush(stdout);
 		return;
 	}
+	conn->outbound_chord = USER_CHORD;
 
 	printf("Successfully established the chord with the node with ID "NODE_ID_OUT".\n", node->id);
 	fflush(stdout);
 }
 
-static void remove_neighbor_connection(NodeID node_id) {
-	// Update the routing table if there are no longer any direct connections to a node.
-	if (node_id != -1 && find_connection_by_node_id(node_id) == NULL) {
-		remove_routing_neighbor(node_id);
-	}
+void remove_outbound_chord(struct Connection *conn) {
+	NodeID id = conn->node_id;
+	close_connection(conn);
+	remove_neighbor_connection(id);
+	printf("Outbound chord with node "NODE_ID_OUT" removed.\n", id);
 }
 
 
@@ -184,8 +407,8 @@ static bool handle_message_from_any_node(char *message, struct Connection *conn)
 				warn("Received ROUTE message from node "NODE_ID_OUT" with wrong neighbor ID. Ignoring.\n", conn->node_id);
 				return true;
 			}
-			if (neighbor_id == self.id) {
-				warn("Received ROUTE message from a neighbor which identified itself with our ID ("NODE_ID_OUT"). Ignoring.\n", self.id);
+			if (neighbor_id == ctx->self.id) {
+				warn("Received ROUTE message from a neighbor which identified itself with our ID ("NODE_ID_OUT"). Ignoring.\n", ctx->self.id);
 				return true;
 			}
 
@@ -227,6 +450,7 @@ static bool handle_message_from_any_node(char *message, struct Connection *conn)
 				return true;
 			}
 
+			remember_advertised_path(neighbor_id, recipient_id, &path);
 			update_routing_and_announce_given_new_path(neighbor_id, recipient_id, &path);
 			return true;
 		}
@@ -237,24 +461,46 @@ static bool handle_message_from_any_node(char *message, struct Connection *conn)
 		NodeID neighbor_id;
 		NodeID recipient_id;
 		if (sscanf(message, "ROUTE "NODE_ID_IN" "NODE_ID_IN"", &neighbor_id, &recipient_id) == 2) {
-			if (neighbor_id == self.id) {
-				warn("Received ROUTE message from a neighbor which identified itself with our ID ("NODE_ID_OUT"). Ignoring.\n", self.id);
+			if (neighbor_id == ctx->self.id) {
+				warn("Received ROUTE message from a neighbor which identified itself with our ID ("NODE_ID_OUT"). Ignoring.\n", ctx->self.id);
 				return true;
 			}
 			if (neighbor_id != conn->node_id) {
 				warn("Received ROUTE message from neigbor "NODE_ID_OUT" with wrong neighbor ID. Ignoring.\n", conn->node_id);
 				return true;
 			}
-			if (recipient_id == self.id) {
+			if (recipient_id == ctx->self.id) {
 				warn("Our neighbor "NODE_ID_OUT" said it has no valid path to us. This is impossible. Ignoring.\n", conn->node_id);
 				return true;
 			}
 
+			remember_advertised_path(neighbor_id, recipient_id, NULL);
 			update_routing_and_announce_given_new_path(neighbor_id, recipient_id, NULL);
 			return true;
 		}
 	}
 
+	if (handle_heartbeat_message(conn, message)) return true;
+	if (handle_trace_message(conn, message)) return true;
+
+	// Versioned synchronization messages (see routing.c)
+	{
+		unsigned int epoch;
+		unsigned long version;
+		if (sscanf(message, "SYNC %u %lu", &epoch, &version) == 2) {
+			handle_sync_message(conn, epoch, version);
+			return true;
+		}
+		if (sscanf(message, "DELTA %u %lu", &epoch, &version) == 2) {
+			handle_delta_message(conn, epoch, version);
+			return true;
+		}
+		if (sscanf(message, "VERSION %u %lu", &epoch, &version) == 2) {
+			handle_version_message(conn, epoch, version);
+			return true;
+		}
+	}
+
 	// CHAT message
 	{
 		NodeID sender_id;
@@ -267,10 +513,12 @@ static bool handle_message_from_any_node(char *message, struct Connection *conn)
 		) {
 			// Make sure we get the entire message even if it starts with a whitespace character
 			char *chat_message = message + chat_message_start + 1;
-			if (recipient_id == self.id) {
+			if (recipient_id == ctx->self.id) {
 				printf("Node "NODE_ID_OUT" said: \"%s\"\n", sender_id, chat_message);
+				// Flushed right away, so that programs reading our output through a pipe see it
+				fflush(stdout);
 			} else {
-				forward_message(sender_id, recipient_id, chat_message);
+				forward_message(sender_id, recipient_id, chat_message, NULL);
 			}
 
 			return true;
@@ -290,68 +538,73 @@ static void handle_message_from_succ(char *message) {
 	char tcp_port[6];
 
 	if (sscanf(message, "SUCC "NODE_ID_IN" %15s %5s", &id, ip_addr, tcp_port) == 3) {
-		if (id == succ.id) {
+		if (id == ctx->succ.id) {
 			warn("Successor said it is its own successor. Ignoring.");
 			return;
 		}
 
 		// Armazenar as informações do segundo sucessor
-		second_succ.id = id;
-		strcpy(second_succ.ip_addr, ip_addr);
-		strcpy(second_succ.tcp_port, tcp_port);
+		ctx->second_succ.id = id;
+		strcpy(ctx->second_succ.ip_addr, ip_addr);
+		strcpy(ctx->second_succ.tcp_port, tcp_port);
 
 		// Testar os dados do segundo sucessor
 		v_printf("Received second successor info.\n");
 
-		awaiting_succ = false;
-		if (connection_state == CONNECTING) {
-			if (!awaiting_pred) {
+		ctx->awaiting_succ = false;
+		if (ctx->connection_state == CONNECTING) {
+			if (!ctx->awaiting_pred) {
 				on_join_end();
 			}
-		} else if (connection_state != CONNECTED) {
+		} else if (ctx->connection_state != CONNECTED) {
 			warn("Received unexpected SUCC message from the successor node.\n");
+		} else {
+			update_standby();
 		}
 		return;
 	}
 	if (sscanf(message, "ENTRY "NODE_ID_IN" %15s %5s", &id, ip_addr, tcp_port) == 3) {
-		if (id == self.id || find_connection_by_node_id(id) != NULL || id == second_succ.id) {
+		if (id == ctx->self.id || find_connection_by_node_id(id) != NULL || id == ctx->second_succ.id) {
 			warn("Currently used node ID in ENTRY message from successor. Leaving the ring.\n");
 			leave_ring();
 			return;
 		}
 
 		v_printf("A new node is joining the ring between me and my successor. Connecting to the new node as my successor.\n");
+		invalidate_node_list(ctx->ring_id_str);
 
-		if (conn_printf(pred_conn->socket, "SUCC %2d %s %s\n", id, ip_addr, tcp_port) < 0) {
+		// If we are still joining and our predecessor hasn't connected, it learns about the new
+		// node from the SUCC message we send when it does
+		if (ctx->pred_conn != NULL && conn_printf(ctx->pred_conn->socket, "SUCC %2d %s %s\n", id, ip_addr, tcp_port) < 0) {
 			return;
 		}
 
-		close_connection(succ_conn);
-		remove_neighbor_connection(succ.id);
+		close_connection(ctx->succ_conn);
+		remove_neighbor_connection(ctx->succ.id);
 
-		copy_node(&second_succ, &succ);
+		copy_node(&ctx->second_succ, &ctx->succ);
 
-		succ.id = id;
-		strcpy(succ.ip_addr, ip_addr);
-		strcpy(succ.tcp_port, tcp_port);
+		ctx->succ.id = id;
+		strcpy(ctx->succ.ip_addr, ip_addr);
+		strcpy(ctx->succ.tcp_port, tcp_port);
 
-		succ_conn = connect_to_node(&succ);
-		if (succ_conn == NULL) {
+		ctx->succ_conn = connect_to_node(&ctx->succ);
+		if (ctx->succ_conn == NULL) {
 			printf("Couldn't connect to the node joining the ring. Left the ring.\n");
 			leave_ring();
 			return;
 		}
 
 		if (
-			conn_printf(succ_conn->socket, "PRED "NODE_ID_OUT"\n", self.id) < 0 ||
-			send_shortest_paths(succ_conn) < 0
+			begin_table_sync(ctx->succ_conn) < 0 ||
+			conn_printf(ctx->succ_conn->socket, "PRED "NODE_ID_OUT"\n", ctx->self.id) < 0
 		) {
 			return;
 		}
 		return;
 	}
 
-	if (handle_message_from_any_node(message, succ_conn)) return;
+	if (handle_message_from_any_node(message, ctx->succ_conn)) return;
 
 	warn("Received malformed message from the successor: \"%s\"\n", message);
 }
@@ -360,174 +613,250 @@ static void handle_message_from_succ(char *message) {
 static void handle_message_from_pred(char *message) {
 	vv_printf("Received message from predecessor: %s\n", message);
 
-	if (strncmp(message, "ENTRY ", 6) == 0 && connection_state == CONNECTING) {
+	if (strncmp(message, "ENTRY ", 6) == 0 && ctx->connection_state == CONNECTING) {
 		warn("Received ENTRY message from the predecessor. This is most likely a connection to self. Aborting the connection.\n");
 		leave_ring();
 		return;
 	}
 
-	if (handle_message_from_any_node(message, pred_conn)) return;
+	if (handle_message_from_any_node(message, ctx->pred_conn)) return;
 
 	warn("Received malformed message from the predecessor node: \"%s\"\n", message);
 }
 
 // Handles messages from a node trying to join the network
-static void handle_message_from_new_node(char *message) {
+static void handle_message_from_new_node(char *message, struct Connection *conn) {
 	vv_printf("Received message from new client node: %s\n", message);
 
 	NodeID id;
 	char ip_addr[16];
 	char tcp_port[6];
-
-	if (sscanf(message, "ENTRY "NODE_ID_IN" %15s %5s", &id, ip_addr, tcp_port) == 3) {
-		if (connection_state == DISCONNECTED || (connection_state == CONNECTED && succ.id == self.id)) {
+	unsigned int epoch;
+	unsigned long version;
+	char ring_tag[4];
+
+	if (sscanf(message, "RING %3s", ring_tag) == 1) {
+		// A process in several rings reads this message before handing the connection to the
+		// ring it names (see main.c), so it can only name another ring if we are in one ring
+		if (ctx->ring_tag[0] != '\0' && strcmp(ring_tag, ctx->ring_tag) != 0) {
+			warn("A node at %s connected to us for ring %s, but we are in ring %s. Closing the connection.\n", conn->ip_addr, ring_tag, ctx->ring_tag);
+			close_connection(conn);
+		}
+	} else if (sscanf(message, "ENTRY "NODE_ID_IN" %15s %5s", &id, ip_addr, tcp_port) == 3) {
+		// A node is joining, so the node list we have is outdated
+		invalidate_node_list(ctx->ring_id_str);
+		if (ctx->connection_state == DISCONNECTED || (ctx->connection_state == CONNECTED && ctx->succ.id == ctx->self.id)) {
 			v_printf("Received an entry request from a node. We and the other node will be the only nodes in the ring.\n");
 
-			new_node_conn->node_id = id;
+			conn->node_id = id;
 
-			if (connection_state == DISCONNECTED) {
+			if (ctx->connection_state == DISCONNECTED) {
 				printf("Another node tried to join a ring using this node as its successor but we're not in a ring.\n");
-				close_connection(new_node_conn);
+				close_connection(conn);
 				return;
 			}
-			if (id == self.id) {
+			if (id == ctx->self.id) {
 				printf("Another node tried to join with the same ID as this onde.\n");
-				close_connection(new_node_conn);
+				close_connection(conn);
 				return;
 			}
 
-			succ.id = id;
-			strcpy(succ.ip_addr, ip_addr);
-			strcpy(succ.tcp_port, tcp_port);
-			copy_node(&second_succ, &self);
+			ctx->succ.id = id;
+			strcpy(ctx->succ.ip_addr, ip_addr);
+			strcpy(ctx->succ.tcp_port, tcp_port);
+			copy_node(&ctx->second_succ, &ctx->self);
 
-			if (conn_printf(new_node_conn->socket, "SUCC "NODE_ID_OUT" %s %s\n", succ.id, succ.ip_addr, succ.tcp_port) < 0) {
+			if (conn_printf(conn->socket, "SUCC "NODE_ID_OUT" %s %s\n", ctx->succ.id, ctx->succ.ip_addr, ctx->succ.tcp_port) < 0) {
 				return;
 			}
 
-			v_printf("Connecting to the other node with ID "NODE_ID_OUT" at %s:%s.\n", succ.id, succ.ip_addr, succ.tcp_port);
-			succ_conn = connect_to_node(&succ);
-			if (succ_conn == NULL) {
+			v_printf("Connecting to the other node with ID "NODE_ID_OUT" at %s:%s.\n", ctx->succ.id, ctx->succ.ip_addr, ctx->succ.tcp_port);
+			ctx->succ_conn = connect_to_node(&ctx->succ);
+			if (ctx->succ_conn == NULL) {
 				printf("Couldn't connect to the other node. Left the ring.\n");
 				leave_ring();
 				return;
 			}
 			if (
-				conn_printf(succ_conn->socket, "PRED "NODE_ID_OUT"\n", self.id) < 0 ||
-				send_shortest_paths(succ_conn) < 0
+				begin_table_sync(ctx->succ_conn) < 0 ||
+				conn_printf(ctx->succ_conn->socket, "PRED "NODE_ID_OUT"\n", ctx->self.id) < 0
 			) {
 				return;
 			}
 			v_printf("Connected to the other node as our successor and sent the PRED message.\n");
 
-			if (pred_conn != NULL) {
+			if (ctx->pred_conn != NULL) {
 				error("Assertion failed: (pred_conn == NULL) when alone and accepting an entry request.\n");
 			}
-			pred_conn = new_node_conn;
-			new_node_conn = NULL;
-		} else if (connection_state == CONNECTED) {
+			ctx->pred_conn = conn;
+			conn->pending = false;
+		} else if (ctx->connection_state == CONNECTED) {
 			// This is the case where we aren't alone in the ring
 			v_printf("Received an entry request from node "NODE_ID_OUT".\n", id);
-			new_node_conn->node_id = id;
+			conn->node_id = id;
 
 			if (
-				conn_printf(new_node_conn->socket, "SUCC "NODE_ID_OUT" %s %s\n", succ.id, succ.ip_addr, succ.tcp_port) < 0 ||
-				conn_printf(pred_conn->socket, "ENTRY "NODE_ID_OUT" %s %s\n", id, ip_addr, tcp_port) < 0 ||
-				send_shortest_paths(new_node_conn) < 0
+				conn_printf(conn->socket, "SUCC "NODE_ID_OUT" %s %s\n", ctx->succ.id, ctx->succ.ip_addr, ctx->succ.tcp_port) < 0 ||
+				conn_printf(ctx->pred_conn->socket, "ENTRY "NODE_ID_OUT" %s %s\n", id, ip_addr, tcp_port) < 0 ||
+				send_shortest_paths(conn) < 0
 			) {
 				return;
 			}
 
-			NodeID pred_id = pred_conn->node_id;
-			close_connection(pred_conn);
+			// The old predecessor closes the connection once it reads the ENTRY message. Closing it
+			// ourselves while there's unread data would reset it, and the message might be lost.
+			NodeID pred_id = ctx->pred_conn->node_id;
+			set_leaving(ctx->pred_conn);
 			remove_neighbor_connection(pred_id);
-			pred_conn = new_node_conn;
-			new_node_conn = NULL;
+			ctx->pred_conn = conn;
+			conn->pending = false;
 		} else {
 			v_printf("Received an entry request while connecting to the ring. Closing the connection.\n");
-			close_connection(new_node_conn);
+			close_connection(conn);
 		}
 	} else if (sscanf(message, "PRED "NODE_ID_IN"", &id) == 1) {
-		if (connection_state == DISCONNECTED) {
+		if (ctx->connection_state == DISCONNECTED) {
 			warn("Received predecessor connection while disconnected. Maybe the predecessor connected after the timeout. Closed the connection.\n");
-			close_connection(new_node_conn);
+			close_connection(conn);
 			return;
 		}
-		if (pred_conn != NULL) {
+		if (ctx->pred_conn != NULL) {
 			v_printf("Received predecessor connection while we already are connected to a predecessor. Closed the old predecessor connection.\n");
-			close_connection(pred_conn);
+			close_connection(ctx->pred_conn);
 		}
 
 		v_printf("Our predecessor said its ID is "NODE_ID_OUT" (PRED message). We are now successfully connected.\n", id);
 
-		struct Connection *conn = find_connection_by_node_id(id);
-		if (conn != NULL && (conn == outbound_chord_conn || is_inbound_chord(conn))) {
+		// Nodes which support it send the PRED message through the chord instead (see promote_chord_to_pred())
+		struct Connection *chord = find_connection_by_node_id(id);
+		if (chord != NULL && is_chord(chord)) {
 			v_printf("Closing degenerate chord with our new predecessor.\n");
-			close_connection(conn);
+			close_connection(chord);
 			remove_neighbor_connection(id);
 		}
 
-		new_node_conn->node_id = id;
-		pred_conn = new_node_conn;
-		new_node_conn = NULL;
+		conn->node_id = id;
+		ctx->pred_conn = conn;
+		conn->pending = false;
 
 		cancel_timeout();
 
 		if (
-			conn_printf(pred_conn->socket, "SUCC "NODE_ID_OUT" %s %s\n", succ.id, succ.ip_addr, succ.tcp_port) < 0 ||
-			send_shortest_paths(pred_conn) < 0
+			reply_table_sync(ctx->pred_conn) < 0 ||
+			conn_printf(ctx->pred_conn->socket, "SUCC "NODE_ID_OUT" %s %s\n", ctx->succ.id, ctx->succ.ip_addr, ctx->succ.tcp_port) < 0 ||
+			send_routing_table(ctx->pred_conn) < 0
 		) {
 			return;
 		}
 
-		awaiting_pred = false;
-		if (connection_state == CONNECTING && !awaiting_succ) {
+		ctx->awaiting_pred = false;
+		if (ctx->connection_state == CONNECTING && !ctx->awaiting_succ) {
 			on_join_end();
 		}
+	} else if (sscanf(message, "SYNC %u %lu", &epoch, &version) == 2) {
+		// Sent by nodes which support versioned synchronization before the PRED or CHORD message
+		handle_sync_message(conn, epoch, version);
 	} else if (sscanf(message, "CHORD "NODE_ID_IN"", &id) == 1) {
+		struct Connection *existing = find_connection_by_node_id(id);
+		bool automatic = existing != NULL && (existing->outbound_chord == FINGER_CHORD || existing->outbound_chord == TRAFFIC_CHORD);
+		if (automatic && ctx->self.id > id) {
+			// Both nodes opened an automatic chord to each other at the same time. The other node
+			// rejects ours, so the one from the node with the lowest ID is kept.
+			v_printf("Node "NODE_ID_OUT" opened a chord to us while we opened one to it. Closing ours.\n", id);
+			close_connection(existing);
+			remove_neighbor_connection(id);
+		}
 		if (find_connection_by_node_id(id) != NULL) {
 			warn("Rejected an inbound chord connection request from node "NODE_ID_OUT" because we are already connected.\n", id);
+			close_connection(conn);
 			return;
 		} else {
 			v_printf("Received an inbound chord connection from the node with ID "NODE_ID_OUT". We are now successfully connected.\n", id);
-			new_node_conn->node_id = id;
+			conn->node_id = id;
 		}
 
-		if (send_shortest_paths(new_node_conn) < 0) {
+		if (
+			reply_table_sync(conn) < 0 ||
+			send_routing_table(conn) < 0
+		) {
 			return;
 		}
 
-		new_node_conn = NULL;
+		conn->pending = false;
 	} else {
 		warn("Received malformed message from the client node: \"%s\"\n", message);
 	}
 }
 
+// Makes a chord connection with our new successor the successor connection by sending the PRED
+// message through it. The routing information was already exchanged through it, so the routes via
+// that node are kept and the tables aren't sent again.
+static void promote_chord_to_succ(struct Connection *conn) {
+	v_printf("Using the chord connection with node "NODE_ID_OUT" as the connection to our new successor.\n", conn->node_id);
+	if (ctx->standby_conn == conn) ctx->standby_conn = NULL;
+	conn->outbound_chord = NO_OUTBOUND_CHORD;
+	ctx->succ_conn = conn;
+	if (conn_printf(ctx->succ_conn->socket, "PRED "NODE_ID_OUT"\n", ctx->self.id) < 0) {
+		return;
+	}
+	v_printf("Successfully switched to the new successor.\n");
+}
+
+// Makes a chord connection with our new predecessor the predecessor connection.
+// The routing information was already exchanged through it.
+static void promote_chord_to_pred(struct Connection *conn) {
+	if (ctx->connection_state != CONNECTED) {
+		warn("Received PRED message through a chord while not in a ring. Ignoring.\n");
+		return;
+	}
+	v_printf("Node "NODE_ID_OUT" is now our predecessor and is using its chord connection.\n", conn->node_id);
+
+	if (ctx->pred_conn != NULL) {
+		NodeID pred_id = ctx->pred_conn->node_id;
+		close_connection(ctx->pred_conn);
+		remove_neighbor_connection(pred_id);
+	}
+	if (ctx->standby_conn == conn) ctx->standby_conn = NULL;
+	conn->outbound_chord = NO_OUTBOUND_CHORD;
+	ctx->pred_conn = conn;
+	ctx->awaiting_pred = false;
+	cancel_timeout();
+
+	conn_printf(ctx->pred_conn->socket, "SUCC "NODE_ID_OUT" %s %s\n", ctx->succ.id, ctx->succ.ip_addr, ctx->succ.tcp_port);
+}
+
 static void handle_message_from_chord(char *message, struct Connection *conn) {
 	vv_printf("Received message from chord with node "NODE_ID_OUT": %s\n", conn->node_id, message);
 
+	NodeID id;
+	if (sscanf(message, "PRED "NODE_ID_IN"", &id) == 1 && id == conn->node_id) {
+		promote_chord_to_pred(conn);
+		return;
+	}
+
 	if (handle_message_from_any_node(message, conn)) return;
 
 	warn("Received malformed message from the chord neighbor "NODE_ID_OUT": \"%s\"\n", conn->node_id, message);
 }
 
 static void handle_broken_succ_socket(void) {
-	if (connection_state != CONNECTED) {
+	if (ctx->connection_state != CONNECTED) {
 		printf("The successor closed the connection before we finished joining the ring. Aborting the join procedure.\n");
 		leave_ring();
 		return;
 	}
 
-	awaiting_succ = true;
+	ctx->awaiting_succ = true;
+	invalidate_node_list(ctx->ring_id_str);
 
-	copy_node(&succ, &second_succ);
+	copy_node(&ctx->succ, &ctx->second_succ);
 
-	if (succ.id == self.id) {
+	if (ctx->succ.id == ctx->self.id) {
 		v_printf("The other node left. We are now alone in the ring.\n");
 		return;
 	}
 
-	if (pred_conn == NULL || pred_conn->node_id == -1) {
+	if (ctx->pred_conn == NULL || ctx->pred_conn->node_id == -1) {
 		warn("Our successor left while we were waiting for the new predecessor to connect. Left the ring.\n");
 		leave_ring();
 		return;
@@ -535,27 +864,31 @@ static void handle_broken_succ_socket(void) {
 
 	v_printf("Our successor left. Connecting to the second successor.\n");
 
-	if (conn_printf(pred_conn->socket, "SUCC "NODE_ID_OUT" %s %s\n", succ.id, succ.ip_addr, succ.tcp_port) < 0) {
+	if (conn_printf(ctx->pred_conn->socket, "SUCC "NODE_ID_OUT" %s %s\n", ctx->succ.id, ctx->succ.ip_addr, ctx->succ.tcp_port) < 0) {
 		return;
 	}
 
-	struct Connection *conn = find_connection_by_node_id(succ.id);
-	if (conn != NULL && (conn == outbound_chord_conn || is_inbound_chord(conn))) {
+	struct Connection *conn = find_connection_by_node_id(ctx->succ.id);
+	if (conn != NULL && is_chord(conn) && supports_extensions(conn)) {
+		promote_chord_to_succ(conn);
+		return;
+	}
+	if (conn != NULL && is_chord(conn)) {
 		v_printf("Closing degenerate chord with our new successor.\n");
 		close_connection(conn);
-		remove_neighbor_connection(succ.id);
+		remove_neighbor_connection(ctx->succ.id);
 	}
 
-	succ_conn = connect_to_node(&succ);
-	if (succ_conn == NULL) {
+	ctx->succ_conn = connect_to_node(&ctx->succ);
+	if (ctx->succ_conn == NULL) {
 		printf("Couldn't connect to the new successor. Left the ring.\n");
 		leave_ring();
 		return;
 	}
 
 	if (
-		conn_printf(succ_conn->socket, "PRED "NODE_ID_OUT"\n", self.id) < 0 ||
-		send_shortest_paths(succ_conn) < 0
+		begin_table_sync(ctx->succ_conn) < 0 ||
+		conn_printf(ctx->succ_conn->socket, "PRED "NODE_ID_OUT"\n", ctx->self.id) < 0
 	) {
 		return;
 	}
@@ -564,16 +897,17 @@ static void handle_broken_succ_socket(void) {
 }
 
 static void handle_broken_pred_socket(void) {
-	if (connection_state != CONNECTED) {
+	if (ctx->connection_state != CONNECTED) {
 		printf("The predecessor closed the connection before we finished joining the ring. Aborting the join procedure.\n");
 		leave_ring();
 		return;
 	}
 
-	remove_neighbor_connection(pred_conn->node_id);
-	pred_conn = NULL;
+	remove_neighbor_connection(ctx->pred_conn->node_id);
+	ctx->pred_conn = NULL;
+	invalidate_node_list(ctx->ring_id_str);
 
-	if (self.id == second_succ.id) {
+	if (ctx->self.id == ctx->second_succ.id) {
 		v_printf("The predecessor closed the connection. We are now alone in the ring.\n");
 	} else {
 		v_printf("The predecessor closed the connection. Awaiting the new predecessor's connection.\n");
@@ -583,21 +917,73 @@ static void handle_broken_pred_socket(void) {
 
 static void handle_broken_new_node_socket(void) {
 	v_printf("The new client node closed the connection.\n");
-	new_node_conn = NULL;
 }
 
 static void handle_broken_chord_socket(struct Connection *conn) {
 	v_printf("The node with ID "NODE_ID_OUT" closed the chord connection.\n", conn->node_id);
 }
 
-// Called when a line is read from a TCP socket
-void handle_message(int socket, char *message) {
+// Our neighbor is leaving the ring. The connection loses its role, so that it is no longer used
+// to send messages, but it's kept open for a while (see set_leaving()), because it may still relay messages to us.
+static void handle_leave_message(struct Connection *conn, Node *leaving_succ) {
+	NodeID id = conn->node_id;
+	v_printf("Node "NODE_ID_OUT" is leaving the ring.\n", id);
+	set_leaving(conn);
+	remove_routing_neighbor(id);
+	invalidate_node_list(ctx->ring_id_str);
+
+	if (conn == ctx->succ_conn) {
+		// Its successor is our second successor, so this is the same as our successor's connection breaking
+		ctx->succ_conn = NULL;
+		copy_node(&ctx->second_succ, leaving_succ);
+		handle_broken_succ_socket();
+	} else if (conn == ctx->pred_conn) {
+		ctx->pred_conn = NULL;
+		if (ctx->self.id != ctx->second_succ.id) {
+			v_printf("Awaiting the connection from our new predecessor.\n");
+			set_timeout(1000, pred_timeout);
+		}
+	} else {
+		if (ctx->standby_conn == conn) ctx->standby_conn = NULL;
+		conn->outbound_chord = NO_OUTBOUND_CHORD;
+	}
+}
+
+static void handle_message_from_leaving_node(char *message, struct Connection *conn) {
+	vv_printf("Received message from leaving node "NODE_ID_OUT": %s\n", conn->node_id, message);
+
+	// Only the messages it is still relaying and its probes matter.
+	// Routing information from it would add it back as a neighbor.
+	if (strncmp(message, "CHAT ", 5) == 0) {
+		handle_message_from_any_node(message, conn);
+	} else {
+		handle_heartbeat_message(conn, message);
+	}
+}
+
+// Called when a line is read from a TCP socket. Returns `false` if the connection was closed.
+bool handle_message(int socket, char *message) {
 	struct Connection *conn = find_connection_by_socket(socket);
-	if (conn == new_node_conn) {
-		handle_message_from_new_node(message);
-	} else if (conn == pred_conn) {
+	unsigned long generation = conn->generation;
+	count_message_in(conn, message);
+	heartbeat_on_receive(conn);
+	if (detect_legacy_peer(conn, message) < 0 || conn->generation != generation) {
+		return false;
+	}
+
+	Node leaving_succ;
+	if (conn->leaving) {
+		handle_message_from_leaving_node(message, conn);
+	} else if (conn->pending) {
+		handle_message_from_new_node(message, conn);
+	} else if (
+		ctx->connection_state == CONNECTED &&
+		sscanf(message, "LEAVE "NODE_ID_IN" %15s %5s", &leaving_succ.id, leaving_succ.ip_addr, leaving_succ.tcp_port) == 3
+	) {
+		handle_leave_message(conn, &leaving_succ);
+	} else if (conn == ctx->pred_conn) {
 		handle_message_from_pred(message);
-	} else if (conn == succ_conn) {
+	} else if (conn == ctx->succ_conn) {
 		handle_message_from_succ(message);
 	} else {
 		if (conn->node_id == -1) {
@@ -605,16 +991,30 @@ void handle_message(int socket, char *message) {
 		}
 		handle_message_from_chord(message, conn);
 	}
+	return conn->generation == generation;
 }
 
 // Called when another node closes a TCP socket, but not when this program closes a socket.
 void handle_broken_socket(int socket) {
 	struct Connection *conn = find_connection_by_socket(socket);
-	if (conn == new_node_conn) {
+	if (conn->leaving) {
+		v_printf("Node "NODE_ID_OUT" closed the connection it no longer used.\n", conn->node_id);
+		close_connection(conn);
+		return;
+	}
+	if (ctx->connection_state == LEAVING) {
+		// We are leaving anyway, so there's nothing to repair
+		NodeID node_id = conn->node_id;
+		close_connection(conn);
+		remove_neighbor_connection(node_id);
+		return;
+	}
+
+	if (conn->pending) {
 		handle_broken_new_node_socket();
-	} else if (conn == pred_conn) {
+	} else if (conn == ctx->pred_conn) {
 		handle_broken_pred_socket();
-	} else if (conn == succ_conn) {
+	} else if (conn == ctx->succ_conn) {
 		handle_broken_succ_socket();
 	} else {
 		if (conn->node_id == -1) {
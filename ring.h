@@ -3,6 +3,16 @@
 
 #include "connections.h"
 
+// How long a node which connected to us has to send the ENTRY, PRED or CHORD message
+#define HANDSHAKE_TIMEOUT_MS 2000
+// How long we wait for a TCP connection to a node to be established
+#define CONNECT_TIMEOUT_MS 2000
+// How long a leaving node keeps relaying messages after announcing that it is leaving
+#define LEAVE_GRACE_MS 500
+// How long a connection which lost its role is kept open for the node to close it, e.g. our old
+// predecessor, which closes it once it reads the ENTRY message
+#define LEAVING_CONNECTION_TIMEOUT_MS (2 * LEAVE_GRACE_MS)
+
 enum ConnectionState {
 	// Not in a ring and not trying to connect
 	DISCONNECTED,
@@ -13,30 +23,27 @@ enum ConnectionState {
 	// Tried connecting to the successor node via TCP, awaiting SUCC message from the successor and the connection from the predecessor
 	CONNECTING,
 	// In a ring
-	CONNECTED
+	CONNECTED,
+	// Sent LEAVE messages to the neighbors and still relaying messages until the connections are closed
+	LEAVING
 };
-extern enum ConnectionState connection_state;
-
-
-// The successor's ID is also stored in `succ.id`
-extern Node self, succ, second_succ;
-
-// CONNECTING only
-// Whether we are waiting for the successor to tell us who our second successor is via a SUCC message
-extern bool awaiting_succ;
-// Whether we are waiting for the predecessor to tell us what its ID is via a PRED message
-extern bool awaiting_pred;
-
-// This is an empty string if we connected to another node or another node connected to us using the direct join command.
-extern char ring_id_str[4];
 
 
 struct Connection *connect_to_node(struct Node *node);
+// Called once select() says that the connect() of a connection we opened finished
+void finish_connection(struct Connection *conn);
+// Marks an accepted connection as pending until the node says what it is for
+void start_handshake(struct Connection *conn);
 void leave_ring(void);
+// Hands our position over to the neighbors before leaving. Prints a message once we left.
+void leave_ring_gracefully(void);
 void join_ring(void);
+struct Connection *open_chord(struct Node *node);
 void create_outbound_chord(struct Node *node);
-void handle_message(int socket, char *message);
+void remove_outbound_chord(struct Connection *conn);
+bool handle_message(int socket, char *message);
 void handle_broken_socket(int socket);
 void on_join_end(void);
+void set_standby(bool enabled);
 
 #endif
\ No newline at end of file
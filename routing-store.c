@@ -0,0 +1,306 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "main.h"
+
+// Warm restart. The routing state of the rings we are in is kept in a memory-mapped file, so that
+// after a crash or a restart we can route right away instead of waiting for the table of every
+// neighbor.
+//
+// The file has a header with the layout version and an entry for each ring. An entry holds two
+// copies of the state, which are written alternately: the older copy is overwritten and then gets
+// the next sequence number and a checksum. A copy which was being written when the process died
+// fails the checksum, and the other one is used. Changes are saved every STORE_FLUSH_INTERVAL_MS
+// at most, so the last changes before a crash may be missing.
+//
+// The tables are restored when we join a ring with the same ring and node ID as an entry, e.g.
+// with the rejoin command, which joins the saved rings at the same place. Our own table gets a new
+// epoch, so the neighbors receive all of it. The tables the neighbors advertised keep their
+// versions, so a neighbor which reconnects only sends the changes since then (see routing.c), and
+// that confirms the restored routes via it. The restored routes via a neighbor which sends its full
+// table instead are dropped before the table is applied, and so are the ones via neighbors which
+// don't reconnect within REVALIDATION_TIMEOUT_MS.
+
+#define STORE_MAGIC "CORSTATE"
+// Incremented whenever the layout of the file changes. Files with another layout are reset.
+#define STORE_LAYOUT_VERSION 2
+
+typedef struct StoredRouting {
+	// `0` if the copy is empty. The valid copy with the highest sequence number is the latest one.
+	unsigned long long sequence;
+	// Of the sequence number and everything after this field
+	unsigned long long checksum;
+	StoredTopology topology;
+	NodeID recipient_ids[MAX_RECIPIENTS];
+	NodeIndex neighbor_ids[MAX_NEIGHBORS];
+	RoutingTable routing_table;
+	ForwardingTable forwarding_table;
+	PeerTable peer_tables[MAX_NODE_ID + 1];
+} StoredRouting;
+
+typedef struct StoreFile {
+	char magic[8];
+	unsigned int layout_version;
+	// Also depends on the limits in main.h
+	unsigned int entry_size;
+	StoredRouting entries[MAX_RINGS][2];
+} StoreFile;
+
+static StoreFile *store;
+// The latest valid copy of each entry, or NULL
+static StoredRouting *latest[MAX_RINGS];
+// Whether a ring we are in uses the entry
+static bool claimed[MAX_RINGS];
+
+static unsigned long long get_checksum(const StoredRouting *copy) {
+	// FNV-1a over 8-byte words
+	const unsigned char *data = (const unsigned char *) &copy->topology;
+	size_t length = sizeof(StoredRouting) - offsetof(StoredRouting, topology);
+	unsigned long long hash = 14695981039346656037ULL ^ copy->sequence;
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		unsigned long long word;
+		memcpy(&word, data + i, 8);
+		hash = (hash ^ word) * 1099511628211ULL;
+	}
+	for (; i < length; i++) {
+		hash = (hash ^ data[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+static bool is_valid(const StoredRouting *copy) {
+	return copy->sequence != 0 && copy->checksum == get_checksum(copy);
+}
+
+void open_routing_store(const char *path) {
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd == -1)
+		error("Couldn't open the state file %s: %s\n", path, strerror(errno));
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) == -1)
+		error("Couldn't get the size of the state file %s: %s\n", path, strerror(errno));
+
+	bool reset = file_stat.st_size != sizeof(StoreFile);
+	if (reset && ftruncate(fd, sizeof(StoreFile)) == -1)
+		error("Couldn't resize the state file %s: %s\n", path, strerror(errno));
+	store = mmap(NULL, sizeof(StoreFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (store == MAP_FAILED)
+		error("Couldn't map the state file %s: %s\n", path, strerror(errno));
+
+	if (!reset && (memcmp(store->magic, STORE_MAGIC, 8) != 0 || store->layout_version != STORE_LAYOUT_VERSION || store->entry_size != sizeof(StoredRouting))) {
+		reset = true;
+	}
+	if (reset) {
+		if (file_stat.st_size != 0) {
+			warn("The state file %s has another layout. Starting without saved state.\n", path);
+		}
+		memset(store, 0, sizeof(StoreFile));
+		memcpy(store->magic, STORE_MAGIC, 8);
+		store->layout_version = STORE_LAYOUT_VERSION;
+		store->entry_size = sizeof(StoredRouting);
+	}
+
+	int count = 0;
+	for (int entry = 0; entry < MAX_RINGS; entry++) {
+		for (int i = 0; i < 2; i++) {
+			StoredRouting *copy = &store->entries[entry][i];
+			if (is_valid(copy) && (latest[entry] == NULL || copy->sequence > latest[entry]->sequence)) {
+				latest[entry] = copy;
+			}
+		}
+		if (latest[entry] != NULL) count++;
+	}
+	v_printf("Opened the state file %s. It has the state of %d rings.\n", path, count);
+}
+
+static bool is_saved_ring(int entry) {
+	return (
+		latest[entry] != NULL &&
+		latest[entry]->topology.self.id == ctx->self.id &&
+		strcmp(latest[entry]->topology.ring_tag, ctx->ring_tag) == 0
+	);
+}
+
+static void release_entry(void) {
+	if (ctx->store_entry != -1) {
+		claimed[ctx->store_entry] = false;
+		ctx->store_entry = -1;
+	}
+}
+
+// Chooses the entry of the ring and node ID in `ctx`, or else an empty entry, or else any entry
+// which no other ring uses
+static void claim_entry(void) {
+	int chosen = -1;
+	for (int entry = 0; entry < MAX_RINGS && chosen == -1; entry++) {
+		if (!claimed[entry] && is_saved_ring(entry)) chosen = entry;
+	}
+	for (int entry = 0; entry < MAX_RINGS && chosen == -1; entry++) {
+		if (!claimed[entry] && latest[entry] == NULL) chosen = entry;
+	}
+	for (int entry = 0; entry < MAX_RINGS && chosen == -1; entry++) {
+		if (!claimed[entry]) chosen = entry;
+	}
+	claimed[chosen] = true;
+	ctx->store_entry = chosen;
+}
+
+static void get_topology(StoredTopology *topology) {
+	// Cleared so that the padding compares equal
+	memset(topology, 0, sizeof(StoredTopology));
+	strcpy(topology->ring_id_str, ctx->ring_id_str);
+	strcpy(topology->ring_tag, ctx->ring_tag);
+	copy_node(&topology->self, &ctx->self);
+	copy_node(&topology->succ, &ctx->succ);
+	copy_node(&topology->second_succ, &ctx->second_succ);
+	for (int i = 0; i < MAX_CONNECTIONS && topology->chord_count < MAX_STORED_CHORDS; i++) {
+		struct Connection *conn = &ctx->connections[i];
+		if (conn->socket != -1 && conn->outbound_chord == USER_CHORD && !conn->leaving) {
+			Node *chord = &topology->chords[topology->chord_count++];
+			chord->id = conn->node_id;
+			strcpy(chord->ip_addr, conn->ip_addr);
+			strcpy(chord->tcp_port, conn->tcp_port);
+		}
+	}
+}
+
+static void write_copy(const StoredTopology *topology) {
+	int entry = ctx->store_entry;
+	StoredRouting *previous = latest[entry];
+	// The latest copy stays intact until this one is complete
+	StoredRouting *copy = previous == &store->entries[entry][0] ? &store->entries[entry][1] : &store->entries[entry][0];
+
+	copy->topology = *topology;
+	memcpy(copy->recipient_ids, ctx->recipient_ids, sizeof(copy->recipient_ids));
+	memcpy(copy->neighbor_ids, ctx->neighbor_ids, sizeof(copy->neighbor_ids));
+	memcpy(copy->routing_table, ctx->routing_table, sizeof(copy->routing_table));
+	memcpy(copy->forwarding_table, ctx->forwarding_table, sizeof(copy->forwarding_table));
+	memcpy(copy->peer_tables, ctx->peer_tables, sizeof(copy->peer_tables));
+	copy->sequence = (previous != NULL ? previous->sequence : 0) + 1;
+	copy->checksum = get_checksum(copy);
+
+	latest[entry] = copy;
+	ctx->store_dirty = false;
+}
+
+static void flush_routing_state(void) {
+	start_timer(&ctx->store_timer, STORE_FLUSH_INTERVAL_MS, flush_routing_state);
+	// The state of a ring we are joining or leaving isn't worth restoring
+	if (ctx->connection_state != CONNECTED || ctx->store_entry == -1) {
+		return;
+	}
+
+	StoredTopology topology;
+	get_topology(&topology);
+	StoredRouting *previous = latest[ctx->store_entry];
+	if (!ctx->store_dirty && previous != NULL && memcmp(&topology, &previous->topology, sizeof(StoredTopology)) == 0) {
+		return;
+	}
+	long long start_us = monotonic_us();
+	write_copy(&topology);
+	vv_printf("Saved the routing state in %lld us.\n", monotonic_us() - start_us);
+}
+
+void drop_restored_paths(NodeID neighbor_id) {
+	if (ctx->restored_neighbors[neighbor_id]) {
+		v_printf("Dropping the restored routes via node "NODE_ID_OUT".\n", neighbor_id);
+		remove_routing_neighbor(neighbor_id);
+	}
+}
+
+static void end_revalidation(void) {
+	int count = 0;
+	for (NodeID id = 0; id <= MAX_NODE_ID; id++) {
+		if (ctx->restored_neighbors[id]) {
+			remove_routing_neighbor(id);
+			count++;
+		}
+	}
+	if (count > 0) {
+		v_printf("Dropped the restored routes via %d neighbors which didn't reconnect in time.\n", count);
+	}
+}
+
+void start_saving_routing_state(void) {
+	if (store == NULL) {
+		return;
+	}
+	release_entry();
+	claim_entry();
+	ctx->store_dirty = true;
+	if (!ctx->store_timer.active) {
+		start_timer(&ctx->store_timer, STORE_FLUSH_INTERVAL_MS, flush_routing_state);
+	}
+}
+
+bool restore_routing_state(void) {
+	start_saving_routing_state();
+	if (store == NULL || !is_saved_ring(ctx->store_entry)) {
+		return false;
+	}
+
+	const StoredRouting *copy = latest[ctx->store_entry];
+	memcpy(ctx->recipient_ids, copy->recipient_ids, sizeof(ctx->recipient_ids));
+	memcpy(ctx->neighbor_ids, copy->neighbor_ids, sizeof(ctx->neighbor_ids));
+	memcpy(ctx->routing_table, copy->routing_table, sizeof(ctx->routing_table));
+	memcpy(ctx->forwarding_table, copy->forwarding_table, sizeof(ctx->forwarding_table));
+	memcpy(ctx->peer_tables, copy->peer_tables, sizeof(ctx->peer_tables));
+
+	int recipient_count = 0;
+	for (int i = 0; i < MAX_RECIPIENTS; i++) {
+		if (ctx->recipient_ids[i] != NO_NODE_ID) recipient_count++;
+	}
+	int neighbor_count = 0;
+	for (int i = 0; i < MAX_NEIGHBORS; i++) {
+		NodeID id = ctx->neighbor_ids[i];
+		if (id >= 0 && id <= MAX_NODE_ID) {
+			ctx->restored_neighbors[id] = true;
+			neighbor_count++;
+		}
+	}
+	start_timer(&ctx->revalidation_timer, REVALIDATION_TIMEOUT_MS, end_revalidation);
+	printf("Restored the routes to %d nodes via %d neighbors from the state file.\n", recipient_count, neighbor_count);
+	return true;
+}
+
+void restore_chords(void) {
+	if (store == NULL || ctx->store_entry == -1 || !is_saved_ring(ctx->store_entry)) {
+		return;
+	}
+	StoredTopology topology = latest[ctx->store_entry]->topology;
+	for (int i = 0; i < topology.chord_count; i++) {
+		Node *chord = &topology.chords[i];
+		if (chord->id == ctx->self.id || find_connection_by_node_id(chord->id) != NULL) continue;
+		struct Connection *conn = open_chord(chord);
+		if (conn != NULL) {
+			conn->outbound_chord = USER_CHORD;
+		}
+	}
+}
+
+bool get_stored_topology(int entry, StoredTopology *topology) {
+	if (store == NULL || claimed[entry] || latest[entry] == NULL) {
+		return false;
+	}
+	*topology = latest[entry]->topology;
+	return true;
+}
+
+void forget_routing_state(void) {
+	if (store == NULL || ctx->store_entry == -1) {
+		return;
+	}
+	store->entries[ctx->store_entry][0].sequence = 0;
+	store->entries[ctx->store_entry][1].sequence = 0;
+	latest[ctx->store_entry] = NULL;
+	release_entry();
+}
@@ -0,0 +1,42 @@
+#ifndef ROUTING_STORE_H
+#define ROUTING_STORE_H
+
+#include "main.h"
+
+// Time between the checks for changes to save, in milliseconds
+#define STORE_FLUSH_INTERVAL_MS 250
+// Time after the tables are restored before the routes via neighbors which didn't reconnect are dropped
+#define REVALIDATION_TIMEOUT_MS 5000
+// Outbound chords kept in the saved topology
+#define MAX_STORED_CHORDS 8
+
+// Where we were in a ring, so that we can join it again at the same place
+typedef struct StoredTopology {
+	char ring_id_str[4];
+	char ring_tag[4];
+	Node self, succ, second_succ;
+	int chord_count;
+	// The outbound chords opened with the chord commands
+	Node chords[MAX_STORED_CHORDS];
+} StoredTopology;
+
+// Maps the state file, creating it if needed. The routing state of the rings we are in is saved in
+// it from then on.
+void open_routing_store(const char *path);
+// Saves the state of the ring from now on, in the entry of the ring and node ID in `ctx` if there
+// is one. Called when we start a ring.
+void start_saving_routing_state(void);
+// Same, and restores the tables saved in the entry, if there are any. Called when joining a ring,
+// after the tables are reset. Returns `true` if they were restored.
+bool restore_routing_state(void);
+// Opens the saved outbound chords again. Called once we are in the ring.
+void restore_chords(void);
+// Gets the topology saved in an entry of the state file. Returns `false` if the entry is empty or
+// belongs to a ring we are in.
+bool get_stored_topology(int entry, StoredTopology *topology);
+// Clears the state saved for the ring. Called when we leave it on purpose.
+void forget_routing_state(void);
+// Drops the restored routes via a neighbor if they weren't confirmed yet
+void drop_restored_paths(NodeID neighbor_id);
+
+#endif
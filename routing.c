@@ -1,6 +1,9 @@
+#define _POSIX_C_SOURCE 200809L
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-#include "routing.h"
+#include "main.h"
 
 // The ID arrays indicate which nodes the rows and columns of the routing table correspond to. They
 // contain `NO_NODE_ID` if the index is not allocated and the node ID if it is. The index at which an ID is
@@ -14,16 +17,28 @@
 // Recipient indices are allocated when the node ID is first given to the
 // `update_routing_given_new_path()` function and are deallocated whenever the
 // corresponding row of the routing table contains only invalid paths.
-NodeID recipient_ids[MAX_RECIPIENTS];
-NodeIndex neighbor_ids[MAX_NEIGHBORS];
+//
+// The tables and the other routing state are kept in the node context (see context.h).
 
-RoutingTable routing_table;
-ForwardingTable forwarding_table;
+// Versioned synchronization
+//
+// Every change to our advertised table (i.e. every announcement) increments `table_version` and is
+// recorded in `table_history`. The epoch identifies the table and changes whenever the tables are
+// reset, so versions from before a rejoin are never mixed with new ones.
+//
+// We also keep the last table each neighbor advertised to us (`peer_tables`), even after the
+// connection is closed. When a connection is established, the connecting node sends
+// "SYNC <epoch> <version>" with the version of the peer's table it has, and the peer answers with
+// its own SYNC message. Each side then sends "DELTA <epoch> <base version>" followed by the ROUTE
+// messages for the recipients which changed since that version (or its full table if the base
+// version is 0), followed by "VERSION <epoch> <version>". The receiver restores the stored table
+// before applying the changes. The full table is sent if the history doesn't go back far enough.
+// Nodes which don't send a SYNC message get the full table without any of these messages.
 
 // Gets the recipient index for a specific node. A new index is allocated if needed.
 NodeIndex get_recipient_index(NodeID recipient_id, bool add_if_missing) {
 	for (int i = 0; i < MAX_RECIPIENTS; i++) {
-		if (recipient_ids[i] == recipient_id) {
+		if (ctx->recipient_ids[i] == recipient_id) {
 			return i;
 		}
 	}
@@ -33,13 +48,14 @@ NodeIndex get_recipient_index(NodeID recipient_id, bool add_if_missing) {
 
 	// This node wasn't in the list. Adding it to the list.
 	for (int i = 0; i < MAX_RECIPIENTS; i++) {
-		if (recipient_ids[i] == -1) {
+		if (ctx->recipient_ids[i] == -1) {
 			// Initializing the data structures.
-			recipient_ids[i] = recipient_id;
+			ctx->recipient_ids[i] = recipient_id;
 			for (int j = 0; j < MAX_NEIGHBORS; j++) {
-				routing_table[i][j].hop_count = INVALID_PATH;
+				ctx->routing_table[i][j].hop_count = INVALID_PATH;
 			}
-			forwarding_table[i] = -1;
+			ctx->forwarding_table[i] = -1;
+			ctx->route_message_lengths[i] = 0;
 			return i;
 		}
 	}
@@ -47,7 +63,7 @@ NodeIndex get_recipient_index(NodeID recipient_id, bool add_if_missing) {
 }
 NodeIndex get_neighbor_index(NodeID neighbor_id, bool add_if_missing) {
 	for (int i = 0; i < MAX_NEIGHBORS; i++) {
-		if (neighbor_ids[i] == neighbor_id) {
+		if (ctx->neighbor_ids[i] == neighbor_id) {
 			return i;
 		}
 	}
@@ -57,11 +73,11 @@ NodeIndex get_neighbor_index(NodeID neighbor_id, bool add_if_missing) {
 
 	// This node wasn't in the list. Adding it to the list.
 	for (int i = 0; i < MAX_NEIGHBORS; i++) {
-		if (neighbor_ids[i] == -1) {
+		if (ctx->neighbor_ids[i] == -1) {
 			// Initializing the data structures.
-			neighbor_ids[i] = neighbor_id;
+			ctx->neighbor_ids[i] = neighbor_id;
 			for (int j = 0; j < MAX_RECIPIENTS; j++) {
-				routing_table[j][i].hop_count = INVALID_PATH;
+				ctx->routing_table[j][i].hop_count = INVALID_PATH;
 			}
 			return i;
 		}
@@ -70,6 +86,10 @@ NodeIndex get_neighbor_index(NodeID neighbor_id, bool add_if_missing) {
 }
 
 
+static bool is_valid_node_id(NodeID id) {
+	return id >= 0 && id <= MAX_NODE_ID;
+}
+
 static bool are_paths_equal(const Path *p1, const Path *p2) {
 	return (
 		p1->hop_count == p2->hop_count && (
@@ -86,27 +106,36 @@ static void copy_path(Path *dest, const Path *src) {
 }
 
 
+static void announce_new_paths(const bool *changed);
+
 void remove_routing_neighbor(NodeID neighbor_id) {
+	if (is_valid_node_id(neighbor_id)) {
+		ctx->restored_neighbors[neighbor_id] = false;
+	}
 	NodeIndex neighbor = get_neighbor_index(neighbor_id, false);
 	if (neighbor == -1) {
 		return;
 	}
 
+	// The routes via the neighbor are withdrawn in one batch, so that a neighbor leaving or
+	// restarting costs one write per connection instead of one per recipient
+	bool changed[MAX_NODE_ID + 1] = {false};
 	for (int recipient = 0; recipient < MAX_RECIPIENTS; recipient++) {
-		NodeID recipient_id = recipient_ids[recipient];
-		if (recipient_id != -1) {
-			update_routing_and_announce_given_new_path(neighbor_id, recipient_id, NULL);
+		NodeID recipient_id = ctx->recipient_ids[recipient];
+		if (recipient_id != -1 && update_routing_given_new_path(neighbor_id, recipient_id, NULL)) {
+			changed[recipient_id] = true;
 		}
 	}
-	neighbor_ids[neighbor] = -1;
+	ctx->neighbor_ids[neighbor] = -1;
+	announce_new_paths(changed);
 }
 
 // Updates the routing tables given the shortest path between a neighbor and a recipient.
 // If `path == NULL || path->hop_count == INVALID_PATH`, the path is considered invalid.
 // Returns `true` if the shortest path from this node to the recipient node was changed, `false` otherwise.
 bool update_routing_given_new_path(NodeID neighbor_id, NodeID recipient_id, const Path *path_in) {
-	if (recipient_id == self.id) return false;
-	if (neighbor_id == self.id) {
+	if (recipient_id == ctx->self.id) return false;
+	if (neighbor_id == ctx->self.id) {
 		dbg_warn("update_routing_given_new_path(): neighbor_id == self.id");
 		return false;
 	}
@@ -119,7 +148,7 @@ bool update_routing_given_new_path(NodeID neighbor_id, NodeID recipient_id, cons
 		path.hop_count = INVALID_PATH;
 	} else {
 		for (NodeIndex i = 0; i < path_in->hop_count; i++) {
-			if (path_in->nodes[i] == self.id) {
+			if (path_in->nodes[i] == ctx->self.id) {
 				// The shortest path crosses this node, so it's considered invalid.
 				path.hop_count = INVALID_PATH;
 				goto invalid_path;
@@ -133,28 +162,29 @@ bool update_routing_given_new_path(NodeID neighbor_id, NodeID recipient_id, cons
 	// Here, `path` is either invalid (path.hop_count == INVALID_PATH) or contains the full path, including the neighbor.
 
 	// Store the current shortest path so we know whether it changed
-	NodeIndex old_closest_neighbor = forwarding_table[recipient];
+	NodeIndex old_closest_neighbor = ctx->forwarding_table[recipient];
 	Path old_shortest_path;
 	if (old_closest_neighbor != -1) {
-		copy_path(&old_shortest_path, &routing_table[recipient][old_closest_neighbor]);
+		copy_path(&old_shortest_path, &ctx->routing_table[recipient][old_closest_neighbor]);
 	} else {
 		old_shortest_path.hop_count = INVALID_PATH;
 	}
 
 	// Update the entry
-	Path *entry = &routing_table[recipient][neighbor];
+	Path *entry = &ctx->routing_table[recipient][neighbor];
 	copy_path(entry, &path);
+	ctx->store_dirty = true;
 
 	// Find the new shortest path
 	NodeIndex closest_neighbor = -1;
 	for (NodeIndex ni = 0; ni < MAX_NEIGHBORS; ni++) {
 		if (
-			neighbor_ids[ni] != -1 && // the neighbor exists
-			routing_table[recipient][ni].hop_count != INVALID_PATH && // there is a valid path to the recipient via the neighbor
+			ctx->neighbor_ids[ni] != -1 && // the neighbor exists
+			ctx->routing_table[recipient][ni].hop_count != INVALID_PATH && // there is a valid path to the recipient via the neighbor
 			(
 				closest_neighbor == -1 ||
 				// the path is shorter than the shortest one found so far
-				routing_table[recipient][ni].hop_count < routing_table[recipient][closest_neighbor].hop_count
+				ctx->routing_table[recipient][ni].hop_count < ctx->routing_table[recipient][closest_neighbor].hop_count
 			)
 		) {
 			closest_neighbor = ni;
@@ -165,7 +195,7 @@ bool update_routing_given_new_path(NodeID neighbor_id, NodeID recipient_id, cons
 	if (
 		old_closest_neighbor != -1 &&
 		closest_neighbor != -1 &&
-		routing_table[recipient][old_closest_neighbor].hop_count == routing_table[recipient][closest_neighbor].hop_count
+		ctx->routing_table[recipient][old_closest_neighbor].hop_count == ctx->routing_table[recipient][closest_neighbor].hop_count
 	) {
 		closest_neighbor = old_closest_neighbor;
 	}
@@ -173,20 +203,34 @@ bool update_routing_given_new_path(NodeID neighbor_id, NodeID recipient_id, cons
 	// Free the recipient index if the row is empty
 	if (closest_neighbor == -1) {
 		vv_printf("There are no valid paths to the recipient "NODE_ID_OUT". Removing the row from the routing table.\n", recipient_id);
-		recipient_ids[recipient] = -1;
+		ctx->recipient_ids[recipient] = -1;
 	}
 
-	forwarding_table[recipient] = closest_neighbor;
+	ctx->forwarding_table[recipient] = closest_neighbor;
 
-	return (
+	bool changed = (
 		old_closest_neighbor != closest_neighbor || (
 			closest_neighbor != -1 &&
-			!are_paths_equal(&old_shortest_path, &routing_table[recipient][closest_neighbor])
+			!are_paths_equal(&old_shortest_path, &ctx->routing_table[recipient][closest_neighbor])
 		)
 	);
+	if (changed) {
+		ctx->route_message_lengths[recipient] = 0;
+	}
+	return changed;
 }
 
 
+// Writes a node ID with two digits. Returns the number of characters written.
+static inline int write_node_id(char *s, NodeID id) {
+	if (id < 0 || id > 99) {
+		return sprintf(s, NODE_ID_OUT, id);
+	}
+	s[0] = '0' + id / 10;
+	s[1] = '0' + id % 10;
+	return 2;
+}
+
 // Writes the string representation of `path` into `str`.
 int path_to_string(char *str, NodeID recipient_id, Path *path) {
 	if (path->hop_count == INVALID_PATH) {
@@ -196,95 +240,380 @@ int path_to_string(char *str, NodeID recipient_id, Path *path) {
 		error("Assertion (path->hop_count != -1) failed!");
 	} else {
 		char *s = str;
-		s += sprintf(s, ""NODE_ID_OUT"-", self.id);
+		s += write_node_id(s, ctx->self.id);
+		*s++ = '-';
 		for (NodeIndex i = 0; i < path->hop_count; i++) {
-			s += sprintf(s, ""NODE_ID_OUT"-", path->nodes[i]);
+			s += write_node_id(s, path->nodes[i]);
+			*s++ = '-';
 		}
-		s += sprintf(s, ""NODE_ID_OUT"", recipient_id);
+		s += write_node_id(s, recipient_id);
+		*s = '\0';
 		return s - str;
 	}
 }
 
-static void get_route_message(char *msg, NodeID recipient_id, Path *path) {
-	if (path == NULL || path->hop_count == INVALID_PATH) {
-		sprintf(msg, "ROUTE "NODE_ID_OUT" "NODE_ID_OUT"\n", self.id, recipient_id);
-	} else {
-		char *s = msg;
-		s += sprintf(s, "ROUTE "NODE_ID_OUT" "NODE_ID_OUT" ", self.id, recipient_id);
+// Writes the ROUTE message for a path into `msg` and returns its length
+static int get_route_message(char *msg, NodeID recipient_id, Path *path) {
+	char *s = msg;
+	memcpy(s, "ROUTE ", 6);
+	s += 6;
+	s += write_node_id(s, ctx->self.id);
+	*s++ = ' ';
+	s += write_node_id(s, recipient_id);
+	if (path != NULL && path->hop_count != INVALID_PATH) {
+		*s++ = ' ';
 		s += path_to_string(s, recipient_id, path);
-		s += sprintf(s, "\n");
 	}
+	*s++ = '\n';
+	*s = '\0';
+	return s - msg;
 }
 
-static void announce_new_path(NodeID recipient_id) {
+// Writes the ROUTE message with our shortest path to a recipient into `msg` and returns its length
+static int copy_shortest_route_message(char *msg, NodeID recipient_id) {
 	NodeIndex recipient = get_recipient_index(recipient_id, false);
-	Path *path;
 	if (recipient == -1) {
-		path = NULL;
-	} else {
-		NodeIndex neighbor = forwarding_table[recipient];
-		path = &routing_table[recipient][neighbor];
+		// Withdrawals aren't cached since the recipient index is freed
+		return get_route_message(msg, recipient_id, NULL);
 	}
 
-	char route_msg[14+MAX_PATH_STR_LENGTH];
-	get_route_message(route_msg, recipient_id, path);
-	v_printf("Announcing new shortest path: %s", route_msg);
+	if (ctx->route_message_lengths[recipient] == 0) {
+		NodeIndex neighbor = ctx->forwarding_table[recipient];
+		ctx->route_message_lengths[recipient] = get_route_message(ctx->route_messages[recipient], recipient_id, neighbor == -1 ? NULL : &ctx->routing_table[recipient][neighbor]);
+	}
+	memcpy(msg, ctx->route_messages[recipient], ctx->route_message_lengths[recipient] + 1);
+	return ctx->route_message_lengths[recipient];
+}
+
+static void announce_version(void) {
 	for (int i = 0; i < MAX_CONNECTIONS; i++) {
-		if (connections[i].socket != -1) {
-			conn_printf(connections[i].socket, "%s", route_msg);
+		if (ctx->connections[i].socket != -1 && ctx->connections[i].sync_state == SYNC_ENABLED && !ctx->connections[i].leaving) {
+			conn_printf(ctx->connections[i].socket, "VERSION %u %lu\n", ctx->table_epoch, ctx->table_version);
 		}
 	}
 }
 
-int send_shortest_paths(struct Connection *conn) {
-	v_printf("Sending our shortest path table to node "NODE_ID_OUT".\n", conn->node_id);
-	if (conn_printf(conn->socket, "ROUTE "NODE_ID_OUT" "NODE_ID_OUT" "NODE_ID_OUT"\n", self.id, self.id, self.id) < 0) {
-		return -1;
+static void record_table_change(NodeID recipient_id) {
+	ctx->table_version++;
+	ctx->table_history[ctx->table_version % ROUTING_HISTORY_SIZE] = recipient_id;
+	ctx->pending_announcements[recipient_id] = false;
+
+	// Changes usually come in bursts, so the new version is announced once the burst is over
+	if (!ctx->version_timer.active) {
+		start_timer(&ctx->version_timer, VERSION_ANNOUNCE_DELAY_MS, announce_version);
+	}
+}
+
+// Writes ROUTE messages to every neighbor. Returns the number of neighbors they were sent to.
+static int write_route_messages(const char *messages, int length) {
+	int fanout = 0;
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		// Nodes which haven't identified themselves get the whole table once they do.
+		// Leaving nodes no longer need our routes.
+		if (ctx->connections[i].socket != -1 && !ctx->connections[i].pending && !ctx->connections[i].leaving) {
+			conn_write(ctx->connections[i].socket, messages, length);
+			fanout++;
+		}
+	}
+	return fanout;
+}
+
+static void announce_new_path(NodeID recipient_id) {
+	record_table_change(recipient_id);
+
+	char route_msg[MAX_ROUTE_MSG_SIZE];
+	int length = copy_shortest_route_message(route_msg, recipient_id);
+	v_printf("Announcing new shortest path: %s", route_msg);
+	int fanout = write_route_messages(route_msg, length);
+	ctx->metrics.route_changes++;
+	observe(&ctx->metrics.announce_fanout, fanout);
+}
+
+// Announces the new shortest paths to the recipients marked in `changed`, which is indexed by
+// recipient ID, with a single write to each neighbor
+static void announce_new_paths(const bool *changed) {
+	char buffer[(MAX_NODE_ID + 1) * MAX_ROUTE_MSG_SIZE];
+	char *s = buffer;
+	int change_count = 0;
+	for (NodeID recipient_id = 0; recipient_id <= MAX_NODE_ID; recipient_id++) {
+		if (!changed[recipient_id]) continue;
+		record_table_change(recipient_id);
+		char *route_msg = s;
+		s += copy_shortest_route_message(s, recipient_id);
+		v_printf("Announcing new shortest path: %s", route_msg);
+		change_count++;
 	}
+	if (change_count == 0) {
+		return;
+	}
+
+	int fanout = write_route_messages(buffer, s - buffer);
+	ctx->metrics.route_changes += change_count;
+	for (int i = 0; i < change_count; i++) {
+		observe(&ctx->metrics.announce_fanout, fanout);
+	}
+}
+
+// Writes the ROUTE messages for our whole table into `buffer`, which must have space for
+// `MAX_RECIPIENTS + 1` messages. Returns the length.
+static int get_table_messages(char *buffer) {
+	char *s = buffer;
+	memcpy(s, "ROUTE ", 6);
+	s += 6;
+	s += write_node_id(s, ctx->self.id);
+	*s++ = ' ';
+	s += write_node_id(s, ctx->self.id);
+	*s++ = ' ';
+	s += write_node_id(s, ctx->self.id);
+	*s++ = '\n';
+
 	for (NodeIndex recipient = 0; recipient < MAX_RECIPIENTS; recipient++) {
-		NodeID recipient_id = recipient_ids[recipient];
+		NodeID recipient_id = ctx->recipient_ids[recipient];
 		if (recipient_id != -1) {
-			NodeIndex neighbor = forwarding_table[recipient];
-			char route_msg[14+MAX_PATH_STR_LENGTH];
-			get_route_message(route_msg, recipient_id, neighbor == -1 ? NULL : &routing_table[recipient][neighbor]);
-			if (conn_printf(conn->socket, "%s", route_msg) < 0) {
-				return -1;
-			}
+			s += copy_shortest_route_message(s, recipient_id);
 		}
 	}
+	return s - buffer;
+}
+
+int send_shortest_paths(struct Connection *conn) {
+	v_printf("Sending our shortest path table to node "NODE_ID_OUT".\n", conn->node_id);
+	char buffer[(MAX_RECIPIENTS + 1) * MAX_ROUTE_MSG_SIZE];
+	int length = get_table_messages(buffer);
+	return conn_write(conn->socket, buffer, length) < 0 ? -1 : 0;
+}
+
+int begin_table_sync(struct Connection *conn) {
+	if (!is_valid_node_id(conn->node_id)) {
+		return 0;
+	}
+	PeerTable *peer = &ctx->peer_tables[conn->node_id];
+	conn->sync_state = SYNC_AWAITING_PEER;
+	return conn_printf(conn->socket, "SYNC %u %lu\n", peer->epoch, peer->version);
+}
+
+int reply_table_sync(struct Connection *conn) {
+	if (conn->sync_state == SYNC_REQUESTED && !is_valid_node_id(conn->node_id)) {
+		conn->sync_state = SYNC_NONE;
+	}
+	if (conn->sync_state != SYNC_REQUESTED) {
+		return 0;
+	}
+	PeerTable *peer = &ctx->peer_tables[conn->node_id];
+	return conn_printf(conn->socket, "SYNC %u %lu\n", peer->epoch, peer->version);
+}
+
+int send_routing_table(struct Connection *conn) {
+	if (conn->sync_state == SYNC_NONE) {
+		return send_shortest_paths(conn);
+	}
+	conn->sync_state = SYNC_ENABLED;
+
+	unsigned long base = conn->peer_seen_version;
+	if (conn->peer_seen_epoch != ctx->table_epoch || base > ctx->table_version || ctx->table_version - base >= ROUTING_HISTORY_SIZE) {
+		// The history doesn't go back far enough
+		base = 0;
+	}
+
+	// DELTA message, the ROUTE messages and the VERSION message
+	char buffer[32 + (MAX_NODE_ID + 1) * MAX_ROUTE_MSG_SIZE + 32];
+	char *s = buffer;
+	s += sprintf(s, "DELTA %u %lu\n", ctx->table_epoch, base);
+	if (base == 0) {
+		v_printf("Sending our shortest path table to node "NODE_ID_OUT".\n", conn->node_id);
+		s += get_table_messages(s);
+	} else {
+		v_printf("Sending the %lu changes to our shortest path table since version %lu to node "NODE_ID_OUT".\n", ctx->table_version - base, base, conn->node_id);
+		bool sent[MAX_NODE_ID + 1] = {false};
+		for (unsigned long version = base + 1; version <= ctx->table_version; version++) {
+			NodeID recipient_id = ctx->table_history[version % ROUTING_HISTORY_SIZE];
+			if (sent[recipient_id]) continue;
+			sent[recipient_id] = true;
+			s += copy_shortest_route_message(s, recipient_id);
+		}
+	}
+	s += sprintf(s, "VERSION %u %lu\n", ctx->table_epoch, ctx->table_version);
+
+	return conn_write(conn->socket, buffer, s - buffer) < 0 ? -1 : 0;
+}
+
+int detect_legacy_peer(struct Connection *conn, const char *message) {
+	if (conn->sync_state != SYNC_AWAITING_PEER || strncmp(message, "SYNC ", 5) == 0) {
+		return 0;
+	}
+	vv_printf("Node "NODE_ID_OUT" doesn't support versioned synchronization.\n", conn->node_id);
+	conn->sync_state = SYNC_NONE;
+	// It sends its whole table, so the routes we restored can't be confirmed
+	if (is_valid_node_id(conn->node_id)) {
+		drop_restored_paths(conn->node_id);
+	}
+	return send_shortest_paths(conn);
+}
+
+int handle_sync_message(struct Connection *conn, unsigned int epoch, unsigned long version) {
+	conn->peer_seen_epoch = epoch;
+	conn->peer_seen_version = version;
+	if (conn->sync_state == SYNC_AWAITING_PEER) {
+		return send_routing_table(conn);
+	}
+	conn->sync_state = SYNC_REQUESTED;
 	return 0;
 }
 
+void handle_delta_message(struct Connection *conn, unsigned int epoch, unsigned long base_version) {
+	if (!is_valid_node_id(conn->node_id)) return;
+	PeerTable *peer = &ctx->peer_tables[conn->node_id];
+	if (ctx->restored_neighbors[conn->node_id]) {
+		// The changes since the table we saved confirm the routes we restored. A full table replaces them.
+		if (base_version != 0 && epoch == peer->epoch && base_version <= peer->version) {
+			ctx->restored_neighbors[conn->node_id] = false;
+		} else {
+			drop_restored_paths(conn->node_id);
+		}
+	}
+	if (base_version != 0 && (epoch != peer->epoch || base_version > peer->version)) {
+		warn("Node "NODE_ID_OUT" sent changes to a version of its table we don't have. Routes via it may be incomplete.\n", conn->node_id);
+	}
+
+	ctx->store_dirty = true;
+	if (base_version == 0 || epoch != peer->epoch) {
+		// A full table follows
+		peer->epoch = epoch;
+		peer->version = 0;
+		for (int i = 0; i <= MAX_NODE_ID; i++) {
+			peer->paths[i].hop_count = INVALID_PATH;
+		}
+		return;
+	}
+
+	// Restore the table we had. The announcements are delayed until the changes are applied so that
+	// the other neighbors don't receive outdated paths.
+	v_printf("Restoring the paths node "NODE_ID_OUT" advertised up to version %lu.\n", conn->node_id, peer->version);
+	for (NodeID recipient_id = 0; recipient_id <= MAX_NODE_ID; recipient_id++) {
+		Path *path = &peer->paths[recipient_id];
+		if (path->hop_count != INVALID_PATH && update_routing_given_new_path(conn->node_id, recipient_id, path)) {
+			ctx->pending_announcements[recipient_id] = true;
+		}
+	}
+}
+
+void handle_version_message(struct Connection *conn, unsigned int epoch, unsigned long version) {
+	if (!is_valid_node_id(conn->node_id)) return;
+	PeerTable *peer = &ctx->peer_tables[conn->node_id];
+	if (epoch != peer->epoch) {
+		vv_printf("Ignoring VERSION message for an unknown table of node "NODE_ID_OUT".\n", conn->node_id);
+		return;
+	}
+	peer->version = version;
+	ctx->store_dirty = true;
+
+	announce_new_paths(ctx->pending_announcements);
+}
+
+void remember_advertised_path(NodeID neighbor_id, NodeID recipient_id, const Path *path) {
+	if (!is_valid_node_id(neighbor_id) || !is_valid_node_id(recipient_id)) {
+		return;
+	}
+	ctx->store_dirty = true;
+	Path *entry = &ctx->peer_tables[neighbor_id].paths[recipient_id];
+	if (path == NULL) {
+		entry->hop_count = INVALID_PATH;
+	} else {
+		copy_path(entry, path);
+	}
+}
+
 void update_routing_and_announce_given_new_path(NodeID neighbor_id, NodeID recipient_id, const Path *path) {
 	if (update_routing_given_new_path(neighbor_id, recipient_id, path)) {
 		announce_new_path(recipient_id);
 	}
 }
 
-bool forward_message(NodeIndex sender_id, NodeIndex recipient_id, const char *chat_message) {
+bool forward_message(NodeIndex sender_id, NodeIndex recipient_id, const char *chat_message, const struct Trace *trace) {
 	NodeIndex recipient_index = get_recipient_index(recipient_id, false);
 	if (recipient_index == -1) {
 		v_printf("There are no valid paths to the node "NODE_ID_OUT". Dropping the message.\n", recipient_id);
+		ctx->metrics.forward_drops++;
 		return false;
 	} else {
-		NodeID neighbor_id = neighbor_ids[forwarding_table[recipient_index]];
-		v_printf("Forwarding message "NODE_ID_OUT"->"NODE_ID_OUT" \"%s\" via neighbor "NODE_ID_OUT".\n", sender_id, recipient_id, chat_message, neighbor_id);
+		NodeID neighbor_id = ctx->neighbor_ids[ctx->forwarding_table[recipient_index]];
+		vv_printf("Forwarding message "NODE_ID_OUT"->"NODE_ID_OUT" \"%s\" via neighbor "NODE_ID_OUT".\n", sender_id, recipient_id, chat_message, neighbor_id);
 		struct Connection *neighbor_conn = find_connection_by_node_id(neighbor_id);
 		if (neighbor_conn == NULL) {
 			warn("Couldn't forward message to node "NODE_ID_OUT" via neighbor "NODE_ID_OUT" because the connection with the neighbor was closed.\n", recipient_id, neighbor_id);
+			ctx->metrics.forward_drops++;
+			return false;
 		}
-		if (conn_printf(neighbor_conn->socket, "CHAT "NODE_ID_OUT" "NODE_ID_OUT" %s\n", sender_id, recipient_id, chat_message) < 0) {
+
+		ctx->traffic_stats[recipient_id].messages++;
+		ctx->traffic_stats[recipient_id].hops += shortest_path_to(recipient_index).hop_count + 1;
+
+		char line[MAX_NODE_MESSAGE_SIZE];
+		if (trace != NULL && supports_extensions(neighbor_conn)) {
+			format_trace_line(line, sender_id, recipient_id, trace, chat_message);
+			stamp_trace_line(line);
+		} else {
+			if (trace != NULL) {
+				v_printf("Neighbor "NODE_ID_OUT" doesn't support traces. Forwarding the message without its trace.\n", neighbor_id);
+			}
+			snprintf(line, MAX_NODE_MESSAGE_SIZE, "CHAT "NODE_ID_OUT" "NODE_ID_OUT" %s\n", sender_id, recipient_id, chat_message);
+		}
+		if (sender_id != ctx->self.id) {
+			// Relayed messages are subject to the neighbor's rate limit
+			if (rate_limited_send(neighbor_conn, sender_id, line) < 0) {
+				ctx->metrics.forward_drops++;
+				return false;
+			}
+			return true;
+		}
+		if (conn_printf(neighbor_conn->socket, "%s", line) < 0) {
+			ctx->metrics.forward_drops++;
 			return false;
 		}
 		return true;
 	}
 }
 
+int get_hop_count(NodeID recipient_id) {
+	NodeIndex recipient_index = get_recipient_index(recipient_id, false);
+	if (recipient_index == -1) {
+		return -1;
+	}
+	return shortest_path_to(recipient_index).hop_count + 1;
+}
+
+void print_traffic_stats(void) {
+	printf("\
++----+-----------+----------+\n\
+| ID | Messages  | Avg hops |\n\
++----+-----------+----------+\n\
+");
+	for (NodeID id = 0; id <= MAX_NODE_ID; id++) {
+		TrafficStats *stats = &ctx->traffic_stats[id];
+		if (stats->messages == 0) continue;
+		printf("| "NODE_ID_OUT" | %9lu | %8.2f |\n", id, stats->messages, (double) stats->hops / stats->messages);
+	}
+	printf("+----+-----------+----------+\n");
+}
+
 void init_routing(void) {
+	// Any non-zero value which is unlikely to have been used before
+	ctx->table_epoch = run_seed() | 1;
+	ctx->table_version = 0;
+	for (int i = 0; i <= MAX_NODE_ID; i++) {
+		ctx->pending_announcements[i] = false;
+		ctx->restored_neighbors[i] = false;
+	}
+	for (int i = 0; i < MAX_RECIPIENTS; i++) {
+		ctx->route_message_lengths[i] = 0;
+	}
+	stop_timer(&ctx->revalidation_timer);
+	ctx->store_dirty = true;
+
 	for (int i = 0; i < MAX_RECIPIENTS; i++) {
-		recipient_ids[i] = -1;
+		ctx->recipient_ids[i] = -1;
 	}
 	for (int i = 0; i < MAX_NEIGHBORS; i++) {
-		neighbor_ids[i] = -1;
+		ctx->neighbor_ids[i] = -1;
 	}
 }
@@ -12,6 +12,14 @@
 #define NO_NODE_INDEX ((NodeIndex) -1)
 #define NO_NODE_ID ((NodeID) -1)
 
+// "ROUTE <id> <id> <path>\n" plus the null character
+#define MAX_ROUTE_MSG_SIZE (14 + MAX_PATH_STR_LENGTH)
+
+// Number of past table changes kept for delta synchronization
+#define ROUTING_HISTORY_SIZE 128
+// Time after a table change before the new version is announced to synchronized neighbors
+#define VERSION_ANNOUNCE_DELAY_MS 200
+
 typedef struct Path {
 	// Equal to `INVALID_PATH` if the path doesn't exist. May be `-1` if the sender and the recipient are the same node.
 	NodeIndex hop_count;
@@ -20,17 +28,27 @@ typedef struct Path {
 	NodeID nodes[MAX_NODES];
 } Path;
 
+// Counters of the CHAT messages we sent or relayed to a recipient
+typedef struct TrafficStats {
+	unsigned long messages;
+	// Sum of the number of hops between us and the recipient over all the messages
+	unsigned long hops;
+} TrafficStats;
+
 // Indexed by [recipient_index][neighbor_index]
 typedef Path RoutingTable[MAX_RECIPIENTS][MAX_NEIGHBORS];
 typedef NodeIndex ForwardingTable[MAX_RECIPIENTS];
 
-#define shortest_path_to(recipient_index) (routing_table[recipient_index][forwarding_table[recipient_index]])
+#define shortest_path_to(recipient_index) (ctx->routing_table[recipient_index][ctx->forwarding_table[recipient_index]])
 
-extern NodeID recipient_ids[MAX_RECIPIENTS];
-extern NodeIndex neighbor_ids[MAX_NEIGHBORS];
-
-extern RoutingTable routing_table;
-extern ForwardingTable forwarding_table;
+// The last table a neighbor advertised to us. See routing.c
+typedef struct PeerTable {
+	// `0` if we don't have a table from this node
+	unsigned int epoch;
+	unsigned long version;
+	// Indexed by recipient ID. Paths are stored as received.
+	Path paths[MAX_NODE_ID + 1];
+} PeerTable;
 
 
 void init_routing(void);
@@ -40,9 +58,29 @@ void remove_routing_neighbor(NodeID neighbor_id);
 int path_to_string(char *str, NodeID recipient_id, Path *path);
 bool update_routing_given_new_path(NodeID neighbor_id, NodeID recipient_id, const Path *path_in);
 void update_routing_and_announce_given_new_path(NodeID neighbor_id, NodeID recipient_id, const Path *path);
-bool forward_message(NodeIndex sender_id, NodeIndex recipient_id, const char *chat_message);
+struct Trace;
+// `trace` is the trace of a traced message (see trace.c), or NULL
+bool forward_message(NodeIndex sender_id, NodeIndex recipient_id, const char *chat_message, const struct Trace *trace);
+// Returns the number of hops of the shortest path to a node, or -1 if it's unreachable
+int get_hop_count(NodeID recipient_id);
+void print_traffic_stats(void);
 
 // Sends the shortest path table to a connection. Returns -1 if there was an error sending the messages.
 int send_shortest_paths(Connection *conn);
 
+// Versioned synchronization. All of these return -1 if there was an error sending the messages.
+// Called by the connecting node before the PRED or CHORD message
+int begin_table_sync(Connection *conn);
+// Called by the accepting node after the PRED or CHORD message, before any other message
+int reply_table_sync(Connection *conn);
+// Sends the changes since the version the peer has, or the full table if it's not known
+int send_routing_table(Connection *conn);
+// Sends the full table if the peer answered our SYNC message with anything else (it doesn't support it)
+int detect_legacy_peer(Connection *conn, const char *message);
+int handle_sync_message(Connection *conn, unsigned int epoch, unsigned long version);
+void handle_delta_message(Connection *conn, unsigned int epoch, unsigned long base_version);
+void handle_version_message(Connection *conn, unsigned int epoch, unsigned long version);
+// Stores a path advertised by a neighbor so that it can be restored when reconnecting
+void remember_advertised_path(NodeID neighbor_id, NodeID recipient_id, const Path *path);
+
 #endif
@@ -0,0 +1,832 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "main.h"
+
+// Deterministic simulator: runs many nodes in one process, on in-memory links and a virtual clock,
+// and reports how long the routing takes to converge after joins, chords and failures, how many
+// messages that takes and how much memory each node uses. Built with `make SIM`.
+//
+// Every virtual node runs the code of the program. The simulator replaces the TCP transport and
+// the clock, and calls the handlers itself instead of the select() loop:
+//  - Every node has its own context (see context.h), which is made current before the node
+//    handles an event, so the modules don't need to know about the simulation.
+//  - Events are handled in order of virtual time, and in the order they were scheduled at the same
+//    instant. Link latencies come from a seeded generator, so a run is reproducible.
+//  - The data of each write is delivered after the link latency, in order per direction, like TCP.
+//    Killing a node closes its links, like the kernel does when a process dies.
+//
+// Without a script, the simulator builds one or more rings by joining the nodes one by one through
+// random members, optionally adds random chords and kills random nodes, and checks the routing
+// after each phase. A script
+// has one action per line, at a virtual time in milliseconds:
+//   <ms> join <id> [<id of the successor>]   Direct join. Without a successor, starts a new ring.
+//   <ms> chord <id> <id of the other node>
+//   <ms> leave <id>
+//   <ms> kill <id>
+//   <ms> message <id> <id of the recipient> <text>
+//   <ms> run <id> <any user command>
+//   <ms> check [<label>]                     Reports the routing and the messages since the last check
+// A join or a command to a node which isn't running starts it, with a fresh state.
+//
+// Node IDs are two digits in the protocol, so a simulation has at most 100 nodes, and the routing
+// tables have room for MAX_NODES, so bigger simulations are split into several rings.
+
+#define DEFAULT_NODE_COUNT 16
+#define DEFAULT_SEED 1
+// Latency of a link is between these bounds, in microseconds
+#define DEFAULT_MIN_LATENCY_US 200
+#define DEFAULT_MAX_LATENCY_US 1000
+// Time given to each phase of the generated scenario before it's checked
+#define DEFAULT_SETTLE_MS 5000
+// Time between joins in the generated scenario
+#define JOIN_INTERVAL_MS 100
+// The node with ID n listens on this port plus n
+#define SIM_BASE_PORT 50000
+#define SIM_IP_ADDR "127.0.0.1"
+// Sockets of a node are numbered from here, after the standard streams
+#define FIRST_SOCKET 3
+// The virtual clock starts here rather than at 0, which some modules use as "never"
+#define START_TIME_US 1000000LL
+#define MAX_SCRIPT_LINE 512
+
+enum EventType {
+	// A node runs a command, which starts it if it isn't running
+	COMMAND_EVENT,
+	KILL_EVENT,
+	// A connection reaches the node it was opened to
+	ACCEPT_EVENT,
+	DATA_EVENT,
+	// The other end of a link was closed
+	CLOSE_EVENT,
+	TIMER_EVENT,
+	CHECK_EVENT,
+};
+
+typedef struct Event {
+	long long time_us;
+	// Breaks ties between events at the same instant
+	unsigned long sequence;
+	enum EventType type;
+	int node;
+	// The receiving end of the link, for ACCEPT, DATA and CLOSE events
+	int endpoint;
+	// The command, the data or the label of the check
+	char *data;
+	int length;
+} Event;
+
+// One end of a link
+typedef struct Endpoint {
+	int node;
+	int socket;
+	int peer;
+	// Whether the node hasn't closed it yet
+	bool open;
+	// Whether a CLOSE event arrived from the other end
+	bool peer_closed;
+	// Data written to this end isn't delivered before this instant, which keeps the writes in order
+	long long last_delivery_us;
+} Endpoint;
+
+typedef struct SimNode {
+	bool alive;
+	NodeContext *context;
+	// Endpoint of each socket of the node, or -1
+	int endpoints[FD_SETSIZE];
+	// Instant of the TIMER event scheduled for the node, or -1
+	long long timer_event_us;
+	// The counters of the node when it last handled an event
+	unsigned long route_changes;
+	unsigned long messages_out[MESSAGE_TYPE_COUNT];
+} SimNode;
+
+static long long now_us = START_TIME_US;
+static unsigned long long random_state;
+static long long min_latency_us = DEFAULT_MIN_LATENCY_US;
+static long long max_latency_us = DEFAULT_MAX_LATENCY_US;
+
+static Event *events;
+static size_t event_count;
+static size_t event_capacity;
+static unsigned long next_sequence;
+static unsigned long handled_events;
+
+static Endpoint *endpoints;
+static size_t endpoint_count;
+static size_t endpoint_capacity;
+
+static SimNode nodes[MAX_NODE_ID + 1];
+// The node `ctx` points to, or -1
+static int current_node = -1;
+
+// The report. Standard output is where the nodes print.
+static FILE *report;
+
+// Totals over every node, updated after each event
+static unsigned long messages_sent[MESSAGE_TYPE_COUNT];
+static unsigned long long bytes_sent;
+static long long last_route_change_us = -1;
+// The last join, chord, kill or other command, from which convergence is measured
+static long long last_action_us = START_TIME_US;
+static unsigned long messages_at_last_check[MESSAGE_TYPE_COUNT];
+static int peak_connections;
+
+// xorshift64*, so that the runs don't depend on the C library
+static unsigned long long next_random(void) {
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+	return random_state * 2685821657736338717ULL;
+}
+
+static int random_below(int bound) {
+	return (int) (next_random() % (unsigned long long) bound);
+}
+
+
+// EVENT QUEUE
+// A binary heap ordered by time, then by sequence
+
+static bool event_before(const Event *a, const Event *b) {
+	return a->time_us < b->time_us || (a->time_us == b->time_us && a->sequence < b->sequence);
+}
+
+static void schedule(long long time_us, enum EventType type, int node, int endpoint, char *data, int length) {
+	if (event_count == event_capacity) {
+		event_capacity = event_capacity == 0 ? 1024 : event_capacity * 2;
+		events = realloc(events, event_capacity * sizeof(Event));
+		if (events == NULL) {
+			error("Allocation failed.");
+		}
+	}
+	Event event = {
+		.time_us = time_us,
+		.sequence = next_sequence++,
+		.type = type,
+		.node = node,
+		.endpoint = endpoint,
+		.data = data,
+		.length = length,
+	};
+	size_t i = event_count++;
+	while (i > 0 && event_before(&event, &events[(i - 1) / 2])) {
+		events[i] = events[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	events[i] = event;
+}
+
+static Event pop_event(void) {
+	Event first = events[0];
+	Event last = events[--event_count];
+	size_t i = 0;
+	while (true) {
+		size_t child = 2 * i + 1;
+		if (child >= event_count) break;
+		if (child + 1 < event_count && event_before(&events[child + 1], &events[child])) child++;
+		if (!event_before(&events[child], &last)) break;
+		events[i] = events[child];
+		i = child;
+	}
+	if (event_count > 0) {
+		events[i] = last;
+	}
+	return first;
+}
+
+static char *copy_string(const char *string) {
+	char *copy = malloc_f(strlen(string) + 1);
+	strcpy(copy, string);
+	return copy;
+}
+
+
+// NODE STATE
+
+static void switch_to(int id) {
+	ctx = nodes[id].context;
+	current_node = id;
+}
+
+static void start_node(int id) {
+	SimNode *node = &nodes[id];
+	free(node->context);
+	node->context = new_context();
+	switch_to(id);
+
+	node->alive = true;
+	for (int i = 0; i < FD_SETSIZE; i++) {
+		node->endpoints[i] = -1;
+	}
+	node->timer_event_us = -1;
+	node->route_changes = 0;
+	memset(node->messages_out, 0, sizeof(node->messages_out));
+
+	// What main() does before the loop, without the node server and the TCP server
+	ctx->self.id = id;
+	strcpy(ctx->self.ip_addr, SIM_IP_ADDR);
+	snprintf(ctx->self.tcp_port, TCP_PORT_STR_SIZE, "%d", SIM_BASE_PORT + id % (MAX_NODE_ID + 1));
+	init_heartbeat();
+}
+
+// Called after the current node handled an event
+static void after_event(void) {
+	SimNode *node = &nodes[current_node];
+
+	if (ctx->metrics.route_changes != node->route_changes) {
+		node->route_changes = ctx->metrics.route_changes;
+		last_route_change_us = now_us;
+	}
+	for (int type = 0; type < MESSAGE_TYPE_COUNT; type++) {
+		messages_sent[type] += ctx->metrics.messages_out[type] - node->messages_out[type];
+		node->messages_out[type] = ctx->metrics.messages_out[type];
+	}
+
+	int connection_count = 0;
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		if (ctx->connections[i].socket != -1) connection_count++;
+	}
+	if (connection_count > peak_connections) {
+		peak_connections = connection_count;
+	}
+
+	long long instant_ms = next_timer_instant();
+	if (instant_ms != -1) {
+		long long instant_us = instant_ms * 1000 > now_us ? instant_ms * 1000 : now_us;
+		if (node->timer_event_us == -1 || instant_us < node->timer_event_us) {
+			node->timer_event_us = instant_us;
+			schedule(instant_us, TIMER_EVENT, current_node, -1, NULL, 0);
+		}
+	}
+}
+
+
+// TRANSPORT
+// In-memory links between the nodes. The functions act for the current node.
+
+static long long link_latency(void) {
+	return min_latency_us + random_below(max_latency_us - min_latency_us + 1);
+}
+
+// The instant at which data written to `endpoint` now arrives
+static long long delivery_time(Endpoint *endpoint) {
+	long long time_us = now_us + link_latency();
+	if (time_us < endpoint->last_delivery_us) {
+		time_us = endpoint->last_delivery_us;
+	}
+	endpoint->last_delivery_us = time_us;
+	return time_us;
+}
+
+static int add_endpoint(int node_id) {
+	SimNode *node = &nodes[node_id];
+	int socket = FIRST_SOCKET;
+	while (socket < FD_SETSIZE && node->endpoints[socket] != -1) socket++;
+	if (socket == FD_SETSIZE) {
+		return -1;
+	}
+
+	if (endpoint_count == endpoint_capacity) {
+		endpoint_capacity = endpoint_capacity == 0 ? 256 : endpoint_capacity * 2;
+		endpoints = realloc(endpoints, endpoint_capacity * sizeof(Endpoint));
+		if (endpoints == NULL) {
+			error("Allocation failed.");
+		}
+	}
+	int index = endpoint_count++;
+	endpoints[index] = (Endpoint) {
+		.node = node_id,
+		.socket = socket,
+		.peer = -1,
+		.open = true,
+	};
+	node->endpoints[socket] = index;
+	return index;
+}
+
+static void close_endpoint(int index) {
+	Endpoint *endpoint = &endpoints[index];
+	endpoint->open = false;
+	nodes[endpoint->node].endpoints[endpoint->socket] = -1;
+	if (!endpoint->peer_closed) {
+		schedule(delivery_time(endpoint), CLOSE_EVENT, endpoints[endpoint->peer].node, endpoint->peer, NULL, 0);
+	}
+}
+
+static int find_endpoint(int socket) {
+	if (socket < 0 || socket >= FD_SETSIZE) {
+		return -1;
+	}
+	return nodes[current_node].endpoints[socket];
+}
+
+static int sim_connect(const Node *node) {
+	int id = atoi(node->tcp_port) - SIM_BASE_PORT;
+	if (id < 0 || id > MAX_NODE_ID || !nodes[id].alive) {
+		printf("Couldn't connect to the node (%s:%s) via TCP: %s\n", node->ip_addr, node->tcp_port, strerror(ECONNREFUSED));
+		return -1;
+	}
+
+	int local = add_endpoint(current_node);
+	if (local == -1) {
+		printf("Connection error: Couldn't create TCP socket to connect to node: %s\n", strerror(EMFILE));
+		return -1;
+	}
+	int remote = add_endpoint(id);
+	if (remote == -1) {
+		nodes[current_node].endpoints[endpoints[local].socket] = -1;
+		endpoint_count--;
+		printf("Couldn't connect to the node (%s:%s) via TCP: %s\n", node->ip_addr, node->tcp_port, strerror(ECONNREFUSED));
+		return -1;
+	}
+	endpoints[local].peer = remote;
+	endpoints[remote].peer = local;
+
+	// The connection is established at once, and the other node takes it over when the first packet
+	// arrives. Data written in the meantime arrives after that.
+	schedule(delivery_time(&endpoints[local]), ACCEPT_EVENT, id, remote, NULL, 0);
+	return endpoints[local].socket;
+}
+
+static ssize_t sim_write(int socket, const void *data, size_t length) {
+	int index = find_endpoint(socket);
+	if (index == -1) {
+		errno = EBADF;
+		return -1;
+	}
+	Endpoint *endpoint = &endpoints[index];
+	// Like TCP, writes succeed until the other end's close is noticed. The data is lost.
+	if (!endpoint->peer_closed) {
+		char *copy = malloc_f(length);
+		memcpy(copy, data, length);
+		schedule(delivery_time(endpoint), DATA_EVENT, endpoints[endpoint->peer].node, endpoint->peer, copy, length);
+		bytes_sent += length;
+	}
+	return length;
+}
+
+static int sim_close(int socket) {
+	int index = find_endpoint(socket);
+	if (index == -1) {
+		errno = EBADF;
+		return -1;
+	}
+	close_endpoint(index);
+	return 0;
+}
+
+static void sim_configure(int socket) {
+	(void) socket;
+}
+
+static const Transport sim_transport = {
+	.connect = sim_connect,
+	.write = sim_write,
+	.close = sim_close,
+	.configure = sim_configure,
+};
+
+
+// EVENT HANDLING
+
+// Passes every line of the data to the node, like read_lines(). Writes always end with a line feed.
+static void deliver_data(int socket, const char *data, int length) {
+	int start = 0;
+	for (int i = 0; i < length; i++) {
+		if (data[i] != '\n') continue;
+
+		char line[MAX_NODE_MESSAGE_SIZE];
+		int line_length = i - start < MAX_NODE_MESSAGE_SIZE - 1 ? i - start : MAX_NODE_MESSAGE_SIZE - 1;
+		memcpy(line, data + start, line_length);
+		line[line_length] = '\0';
+		start = i + 1;
+		if (!handle_message(socket, line)) {
+			return;
+		}
+	}
+}
+
+static void kill_node(int id) {
+	SimNode *node = &nodes[id];
+	for (int socket = FIRST_SOCKET; socket < FD_SETSIZE; socket++) {
+		if (node->endpoints[socket] != -1) {
+			close_endpoint(node->endpoints[socket]);
+		}
+	}
+	node->alive = false;
+	if (current_node == id) {
+		current_node = -1;
+	}
+}
+
+static void print_check(const char *label);
+
+static void handle_event(Event *event) {
+	now_us = event->time_us;
+	loop_wakeup_us = now_us;
+	handled_events++;
+	SimNode *node = event->node >= 0 ? &nodes[event->node] : NULL;
+
+	switch (event->type) {
+		case COMMAND_EVENT:
+			last_action_us = now_us;
+			if (!node->alive) {
+				start_node(event->node);
+			}
+			switch_to(event->node);
+			handle_user_input(0, event->data);
+			after_event();
+			break;
+
+		case KILL_EVENT:
+			last_action_us = now_us;
+			if (node->alive) {
+				kill_node(event->node);
+			}
+			break;
+
+		case ACCEPT_EVENT:
+			if (!node->alive || !endpoints[event->endpoint].open) break;
+			switch_to(event->node);
+			accept_node_connection(endpoints[event->endpoint].socket, SIM_IP_ADDR);
+			after_event();
+			break;
+
+		case DATA_EVENT:
+			if (!node->alive || !endpoints[event->endpoint].open) break;
+			switch_to(event->node);
+			if (find_connection_by_socket(endpoints[event->endpoint].socket) != NULL) {
+				deliver_data(endpoints[event->endpoint].socket, event->data, event->length);
+			}
+			after_event();
+			break;
+
+		case CLOSE_EVENT: {
+			Endpoint *endpoint = &endpoints[event->endpoint];
+			if (!node->alive || !endpoint->open) break;
+			endpoint->peer_closed = true;
+			switch_to(event->node);
+			if (find_connection_by_socket(endpoint->socket) != NULL) {
+				handle_broken_socket(endpoint->socket);
+			} else {
+				close_endpoint(event->endpoint);
+			}
+			after_event();
+			break;
+		}
+
+		case TIMER_EVENT:
+			// Stale if an earlier TIMER event was scheduled after this one
+			if (!node->alive || node->timer_event_us != event->time_us) break;
+			node->timer_event_us = -1;
+			switch_to(event->node);
+			run_expired_timers();
+			after_event();
+			break;
+
+		case CHECK_EVENT:
+			print_check(event->data);
+			break;
+	}
+	free(event->data);
+}
+
+
+// REPORT
+
+static void print_messages_since_last_check(void) {
+	unsigned long total = 0;
+	fprintf(report, "  Messages:");
+	for (int type = 0; type < MESSAGE_TYPE_COUNT; type++) {
+		unsigned long count = messages_sent[type] - messages_at_last_check[type];
+		total += count;
+		if (count > 0) {
+			fprintf(report, " %s %lu", message_type_names[type], count);
+		}
+	}
+	fprintf(report, " (total %lu)\n", total);
+	memcpy(messages_at_last_check, messages_sent, sizeof(messages_sent));
+}
+
+// Union-find over the node IDs, to group the nodes which are connected directly or indirectly
+static int find_group(int groups[], int id) {
+	while (groups[id] != id) {
+		groups[id] = groups[groups[id]];
+		id = groups[id];
+	}
+	return id;
+}
+
+static void print_check(const char *label) {
+	int groups[MAX_NODE_ID + 1];
+	for (int id = 0; id <= MAX_NODE_ID; id++) {
+		groups[id] = id;
+	}
+	int alive_count = 0;
+	int connected_count = 0;
+	for (int a = 0; a <= MAX_NODE_ID; a++) {
+		if (!nodes[a].alive) continue;
+		alive_count++;
+		switch_to(a);
+		if (ctx->connection_state == CONNECTED) connected_count++;
+		for (int i = 0; i < MAX_CONNECTIONS; i++) {
+			const struct Connection *conn = &ctx->connections[i];
+			NodeID b = conn->node_id;
+			if (conn->socket != -1 && !conn->pending && b >= 0 && b <= MAX_NODE_ID && nodes[b].alive) {
+				groups[find_group(groups, a)] = find_group(groups, b);
+			}
+		}
+	}
+
+	// Every node should have a path to the other nodes of its group
+	int group_sizes[MAX_NODE_ID + 1] = {0};
+	for (int id = 0; id <= MAX_NODE_ID; id++) {
+		if (nodes[id].alive) group_sizes[find_group(groups, id)]++;
+	}
+	int group_count = 0;
+	long pairs = 0;
+	for (int id = 0; id <= MAX_NODE_ID; id++) {
+		if (group_sizes[id] == 0) continue;
+		group_count++;
+		pairs += (long) group_sizes[id] * (group_sizes[id] - 1);
+	}
+
+	// Paths to running nodes outside the group are left over from before a failure
+	long reachable_pairs = 0;
+	long stale_pairs = 0;
+	for (int a = 0; a <= MAX_NODE_ID; a++) {
+		if (!nodes[a].alive) continue;
+		switch_to(a);
+		for (int b = 0; b <= MAX_NODE_ID; b++) {
+			if (b == a || !nodes[b].alive || get_hop_count(b) <= 0) continue;
+			if (find_group(groups, a) == find_group(groups, b)) {
+				reachable_pairs++;
+			} else {
+				stale_pairs++;
+			}
+		}
+	}
+
+	fprintf(report, "[%9.3f s] %s: %d nodes running, %d in a ring, %d groups of connected nodes.\n", (now_us - START_TIME_US) / 1e6, label, alive_count, connected_count, group_count);
+	fprintf(report, "  Routing: %ld of %ld paths within the groups, %ld to nodes outside them", reachable_pairs, pairs, stale_pairs);
+	if (last_route_change_us < last_action_us) {
+		fprintf(report, ", unchanged since the last action.\n");
+	} else {
+		fprintf(report, ", last changed %.1f ms after the last action and %.1f ms ago.\n", (last_route_change_us - last_action_us) / 1e3, (now_us - last_route_change_us) / 1e3);
+	}
+	print_messages_since_last_check();
+	fflush(report);
+}
+
+
+// SCENARIOS
+
+static void schedule_command(long long ms, int id, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+static void schedule_command(long long ms, int id, const char *format, ...) {
+	char command[USER_COMMAND_BUF_SIZE];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(command, sizeof(command), format, args);
+	va_end(args);
+	schedule(START_TIME_US + ms * 1000, COMMAND_EVENT, id, -1, copy_string(command), 0);
+}
+
+static void schedule_check(long long ms, const char *label) {
+	schedule(START_TIME_US + ms * 1000, CHECK_EVENT, -1, -1, copy_string(label), 0);
+}
+
+static void schedule_join(long long ms, int id, int succ_id) {
+	schedule_command(ms, id, "dj "NODE_ID_OUT" "NODE_ID_OUT" "SIM_IP_ADDR" %d", id, succ_id, SIM_BASE_PORT + succ_id);
+}
+
+// Builds `ring_count` rings by joining their nodes one by one, adds random chords within the rings,
+// then kills random nodes. Returns the time of the last check.
+static long long generate_scenario(int node_count, int ring_count, int chords_per_node, int kill_count, long long settle_ms) {
+	// Random distinct IDs. Node i is in ring i % ring_count.
+	int ids[MAX_NODE_ID + 1];
+	for (int i = 0; i <= MAX_NODE_ID; i++) {
+		ids[i] = i;
+	}
+	for (int i = 0; i < node_count; i++) {
+		int j = i + random_below(MAX_NODE_ID + 1 - i);
+		int id = ids[i];
+		ids[i] = ids[j];
+		ids[j] = id;
+	}
+
+	// The rings grow at the same time, each through its own members
+	long long ms = 0;
+	for (int i = 0; i < node_count; i++) {
+		int ring = i % ring_count;
+		int members = i / ring_count;
+		ms = (long long) members * JOIN_INTERVAL_MS;
+		int succ = members == 0 ? i : ring + random_below(members) * ring_count;
+		schedule_join(ms, ids[i], ids[succ]);
+	}
+	ms += settle_ms;
+	schedule_check(ms, "joins");
+
+	if (chords_per_node > 0) {
+		for (int i = 0; i < node_count; i++) {
+			int ring = i % ring_count;
+			int ring_size = (node_count - ring + ring_count - 1) / ring_count;
+			for (int c = 0; c < chords_per_node; c++) {
+				int j = random_below(ring_size - 1);
+				if (j >= i / ring_count) j++;
+				j = ring + j * ring_count;
+				schedule_command(++ms, ids[i], "dc "NODE_ID_OUT" "SIM_IP_ADDR" %d", ids[j], SIM_BASE_PORT + ids[j]);
+			}
+		}
+		ms += settle_ms;
+		schedule_check(ms, "chords");
+	}
+
+	if (kill_count > 0) {
+		ms++;
+		for (int i = 0; i < kill_count; i++) {
+			// The first kill_count IDs after a shuffle of the members
+			int j = i + random_below(node_count - i);
+			int id = ids[i];
+			ids[i] = ids[j];
+			ids[j] = id;
+			schedule(START_TIME_US + ms * 1000, KILL_EVENT, ids[i], -1, NULL, 0);
+		}
+		ms += settle_ms;
+		schedule_check(ms, "kills");
+	}
+	return ms;
+}
+
+static bool parse_node_id(const char *string, int *id) {
+	char *end;
+	long value = strtol(string, &end, 10);
+	if (end == string || *end != '\0' || value < 0 || value > MAX_NODE_ID) {
+		return false;
+	}
+	*id = value;
+	return true;
+}
+
+// Returns the time of the last action
+static long long load_script(const char *path) {
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		error("Couldn't open the script %s: %s\n", path, strerror(errno));
+	}
+
+	long long last_ms = 0;
+	char line[MAX_SCRIPT_LINE];
+	int line_number = 0;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		line_number++;
+		line[strcspn(line, "\r\n")] = '\0';
+
+		long long ms;
+		char action[16];
+		int rest_start = -1;
+		if (line[strspn(line, " \t")] == '#' || line[strspn(line, " \t")] == '\0') continue;
+		if (sscanf(line, "%lld %15s %n", &ms, action, &rest_start) != 2 || ms < 0) {
+			error("%s:%d: Expected \"<ms> <action> ...\".\n", path, line_number);
+		}
+		if (rest_start == -1) rest_start = strlen(line);
+		char *rest = line + rest_start;
+		if (ms > last_ms) last_ms = ms;
+
+		char first[16] = "", second[16] = "";
+		int text_start = -1;
+		sscanf(rest, "%15s %15s %n", first, second, &text_start);
+		int id = -1, other_id = -1;
+		bool valid_id = parse_node_id(first, &id);
+
+		if (strcmp(action, "join") == 0 && valid_id) {
+			if (second[0] == '\0') {
+				other_id = id;
+			} else if (!parse_node_id(second, &other_id)) {
+				error("%s:%d: Invalid successor ID.\n", path, line_number);
+			}
+			schedule_join(ms, id, other_id);
+		} else if (strcmp(action, "chord") == 0 && valid_id && parse_node_id(second, &other_id)) {
+			schedule_command(ms, id, "dc "NODE_ID_OUT" "SIM_IP_ADDR" %d", other_id, SIM_BASE_PORT + other_id);
+		} else if (strcmp(action, "leave") == 0 && valid_id) {
+			schedule_command(ms, id, "l");
+		} else if (strcmp(action, "kill") == 0 && valid_id) {
+			schedule(START_TIME_US + ms * 1000, KILL_EVENT, id, -1, NULL, 0);
+		} else if (strcmp(action, "message") == 0 && valid_id && parse_node_id(second, &other_id) && text_start != -1) {
+			schedule_command(ms, id, "m "NODE_ID_OUT" %s", other_id, rest + text_start);
+		} else if (strcmp(action, "run") == 0 && valid_id) {
+			schedule_command(ms, id, "%s", rest + strlen(first) + strspn(rest + strlen(first), " \t"));
+		} else if (strcmp(action, "check") == 0) {
+			schedule_check(ms, rest[0] != '\0' ? rest : "check");
+		} else {
+			error("%s:%d: Invalid action: %s\n", path, line_number, line);
+		}
+	}
+	fclose(file);
+	return last_ms;
+}
+
+
+static void usage(void) {
+	fprintf(stderr, "Usage: SIM [-n <nodes>] [-r <rings>] [-c <chords per node>] [-k <nodes to kill>] [-t <settle time in ms>] [-f <script>] [-s <seed>] [-l <min latency in us>] [-L <max latency in us>] [-o] [-v <verbosity level>]\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	int node_count = DEFAULT_NODE_COUNT;
+	int ring_count = 1;
+	int chords_per_node = 0;
+	int kill_count = 0;
+	long long settle_ms = DEFAULT_SETTLE_MS;
+	const char *script_path = NULL;
+	unsigned long long seed = DEFAULT_SEED;
+	bool show_output = false;
+
+	while (true) {
+		int opt = getopt(argc, argv, "n:r:c:k:t:f:s:l:L:ov:");
+		if (opt == -1) break;
+		switch (opt) {
+			case 'n': node_count = atoi(optarg); break;
+			case 'r': ring_count = atoi(optarg); break;
+			case 'c': chords_per_node = atoi(optarg); break;
+			case 'k': kill_count = atoi(optarg); break;
+			case 't': settle_ms = atoll(optarg); break;
+			case 'f': script_path = optarg; break;
+			case 's': seed = strtoull(optarg, NULL, 10); break;
+			case 'l': min_latency_us = atoll(optarg); break;
+			case 'L': max_latency_us = atoll(optarg); break;
+			case 'o': show_output = true; break;
+			case 'v':
+				verbose_level = atoi(optarg);
+				if (verbose_level < 0) verbose_level = 0;
+				break;
+			default: usage(); break;
+		}
+	}
+	if (optind != argc) usage();
+
+	if (node_count < 2 || node_count > MAX_NODE_ID + 1) {
+		error("The number of nodes must be between 2 and %d.\n", MAX_NODE_ID + 1);
+	}
+	// The routing tables have room for MAX_NODES nodes, so bigger simulations need several rings
+	if (ring_count < 1 || node_count < 2 * ring_count || node_count > MAX_NODES * ring_count) {
+		error("Each ring must have between 2 and %d nodes.\n", MAX_NODES);
+	}
+	if (kill_count < 0 || kill_count > node_count - 2) {
+		error("At least 2 nodes must be left after the kills.\n");
+	}
+	if (chords_per_node < 0 || settle_ms < 0 || min_latency_us < 0 || max_latency_us < min_latency_us) {
+		usage();
+	}
+
+	// The nodes print to standard output, so the report gets its own stream
+	report = fdopen(dup(STDOUT_FILENO), "w");
+	if (report == NULL) {
+		error("Couldn't duplicate standard output: %s\n", strerror(errno));
+	}
+	if (!show_output && freopen("/dev/null", "w", stdout) == NULL) {
+		error("Couldn't discard the output of the nodes: %s\n", strerror(errno));
+	}
+
+	// Zero would stay zero
+	random_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+	use_virtual_clock(&now_us);
+	transport = &sim_transport;
+
+	long long end_ms;
+	if (script_path != NULL) {
+		end_ms = load_script(script_path);
+	} else {
+		end_ms = generate_scenario(node_count, ring_count, chords_per_node, kill_count, settle_ms);
+	}
+	long long end_us = START_TIME_US + end_ms * 1000;
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (event_count > 0 && events[0].time_us <= end_us) {
+		Event event = pop_event();
+		handle_event(&event);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	while (event_count > 0) {
+		free(pop_event().data);
+	}
+
+	double wall_s = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	int started_count = 0;
+	for (int i = 0; i <= MAX_NODE_ID; i++) {
+		if (nodes[i].context != NULL) started_count++;
+	}
+	fprintf(report, "Simulated %.3f s in %.3f s: %lu events, %llu bytes sent.\n", (end_us - START_TIME_US) / 1e6, wall_s, handled_events, bytes_sent);
+	fprintf(report, "Memory per node: %zu bytes of node state, at most %d connections. %d nodes: %zu bytes.\n",
+		sizeof(NodeContext), peak_connections, started_count, sizeof(NodeContext) * started_count);
+	fclose(report);
+	return 0;
+}
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "main.h"
+
+// Per-hop tracing of CHAT messages, to find out which hop or queue delays a message.
+//
+// A traced message is sent as "TRACE <sender> <recipient> <trace ID> <origin> <hops> <message>"
+// instead of CHAT. Every node which sends it appends a hop record "<id>/<arrival>/<time in node>":
+// the arrival is the time since the origin instant at which the message was read, and the time in
+// node is filled in when the message is written to the socket, so it includes the time spent in
+// the rate limit queue. The recipient prints the message and the breakdown of the route.
+//
+// The time in each node is measured with the node's own clock, so it's always accurate. Arrival
+// and link times compare clocks of different nodes, so they're only accurate if the nodes run on
+// the same host.
+//
+// TRACE messages are only sent to neighbors which support our extensions. Other neighbors get a
+// plain CHAT message, so the message is still delivered but the recipient can't print the trace.
+
+bool send_traced_message(NodeID recipient_id, const char *chat_message) {
+	Trace trace = {
+		.id = ctx->next_trace_id++,
+		.origin_us = loop_wakeup_us,
+	};
+	trace.hops[0] = '\0';
+	bool sent = forward_message(ctx->self.id, recipient_id, chat_message, &trace);
+	if (sent) {
+		printf("Traced message sent (trace "NODE_ID_OUT":%lu).\n", ctx->self.id, trace.id);
+	}
+	return sent;
+}
+
+int format_trace_line(char *line, NodeID sender_id, NodeID recipient_id, const Trace *trace, const char *chat_message) {
+	int length = sprintf(line, "TRACE "NODE_ID_OUT" "NODE_ID_OUT" %lu %lld %s", sender_id, recipient_id, trace->id, trace->origin_us, trace->hops);
+
+	char record[64];
+	int record_length = sprintf(record, "%s"NODE_ID_OUT"/%lld/%0*d", trace->hops[0] != '\0' ? "," : "",
+		ctx->self.id, loop_wakeup_us - trace->origin_us, TRACE_RESIDENCE_DIGITS, 0);
+	// Room left after the space, the message and the line feed
+	int room = MAX_NODE_MESSAGE_SIZE - 1 - length - (int) strlen(chat_message) - 2;
+	bool truncated = trace->hops[0] != '\0' && line[length - 1] == '+';
+	if (!truncated && record_length <= room) {
+		strcpy(line + length, record);
+		length += record_length;
+	} else if (!truncated && room >= 1) {
+		line[length++] = '+';
+	}
+
+	length += snprintf(line + length, MAX_NODE_MESSAGE_SIZE - length, " %s\n", chat_message);
+	return length < MAX_NODE_MESSAGE_SIZE ? length : MAX_NODE_MESSAGE_SIZE - 1;
+}
+
+void stamp_trace_line(char *line) {
+	long long origin_us;
+	int hops_start = -1;
+	if (sscanf(line, "TRACE %*d %*d %*u %lld %n", &origin_us, &hops_start) != 1 || hops_start == -1) {
+		return;
+	}
+	char *hops = line + hops_start;
+	char *hops_end = strchr(hops, ' ');
+	// Our record was left out
+	if (hops_end == NULL || hops_end == hops || hops_end[-1] == '+') {
+		return;
+	}
+
+	// Our record is the last one
+	char *record = hops_end - 1;
+	while (record > hops && record[-1] != ',') {
+		record--;
+	}
+	NodeID id;
+	long long arrival_us;
+	int residence_start = -1;
+	if (
+		sscanf(record, NODE_ID_IN"/%lld/%n", &id, &arrival_us, &residence_start) != 2 ||
+		id != ctx->self.id || hops_end - (record + residence_start) != TRACE_RESIDENCE_DIGITS
+	) {
+		return;
+	}
+
+	long long residence_us = monotonic_us() - (origin_us + arrival_us);
+	if (residence_us < 0) residence_us = 0;
+	if (residence_us > 9999999) residence_us = 9999999;
+	char digits[TRACE_RESIDENCE_DIGITS + 1];
+	sprintf(digits, "%0*lld", TRACE_RESIDENCE_DIGITS, residence_us);
+	memcpy(record + residence_start, digits, TRACE_RESIDENCE_DIGITS);
+}
+
+static void print_trace(NodeID sender_id, const Trace *trace) {
+	long long arrival_us = loop_wakeup_us - trace->origin_us;
+	printf("Trace "NODE_ID_OUT":%lu from node "NODE_ID_OUT" took %lld us. Times in us since it was sent:\n", sender_id, trace->id, sender_id, arrival_us);
+	printf("\
++----+-----------+-----------+-----------+\n\
+| ID | Arrived   | In node   | Next link |\n\
++----+-----------+-----------+-----------+\n\
+");
+
+	const char *record = trace->hops;
+	bool truncated = false;
+	while (*record != '\0') {
+		if (*record == '+') {
+			truncated = true;
+			break;
+		}
+		NodeID id;
+		long long arrived, residence;
+		int length = -1;
+		if (sscanf(record, NODE_ID_IN"/%lld/%lld%n", &id, &arrived, &residence, &length) != 3 || length == -1) {
+			printf("| Invalid hop record: %-18.18s |\n", record);
+			break;
+		}
+		record += length;
+		if (*record == ',') record++;
+
+		// The link ends where the next record, or the recipient, starts
+		long long next_arrived = arrival_us;
+		if (*record != '\0' && *record != '+') {
+			sscanf(record, "%*d/%lld", &next_arrived);
+		}
+		if (*record == '+') {
+			printf("| "NODE_ID_OUT" | %9lld | %9lld | %9s |\n", id, arrived, residence, "?");
+		} else {
+			printf("| "NODE_ID_OUT" | %9lld | %9lld | %9lld |\n", id, arrived, residence, next_arrived - arrived - residence);
+		}
+	}
+	printf("| "NODE_ID_OUT" | %9lld | %9s | %9s |\n", ctx->self.id, arrival_us, "", "");
+	printf("+----+-----------+-----------+-----------+\n");
+	if (truncated) {
+		printf("Some hops weren't recorded because the message was full.\n");
+	}
+}
+
+bool handle_trace_message(struct Connection *conn, char *message) {
+	if (strncmp(message, "TRACE ", 6) != 0) {
+		return false;
+	}
+
+	NodeID sender_id;
+	NodeID recipient_id;
+	Trace trace;
+	int hops_start = -1;
+	int hops_end = -1;
+	if (
+		sscanf(message, "TRACE "NODE_ID_IN" "NODE_ID_IN" %lu %lld %n%*s%n", &sender_id, &recipient_id, &trace.id, &trace.origin_us, &hops_start, &hops_end) != 4 ||
+		hops_end == -1 || message[hops_end] != ' ' || hops_end - hops_start >= TRACE_HOPS_SIZE
+	) {
+		warn("Received invalid TRACE message from node "NODE_ID_OUT". Ignoring.\n", conn->node_id);
+		return true;
+	}
+	memcpy(trace.hops, message + hops_start, hops_end - hops_start);
+	trace.hops[hops_end - hops_start] = '\0';
+	// Make sure we get the entire message even if it starts with a whitespace character
+	char *chat_message = message + hops_end + 1;
+
+	if (recipient_id == ctx->self.id) {
+		printf("Node "NODE_ID_OUT" said: \"%s\"\n", sender_id, chat_message);
+		print_trace(sender_id, &trace);
+		fflush(stdout);
+	} else {
+		forward_message(sender_id, recipient_id, chat_message, &trace);
+	}
+	return true;
+}
@@ -0,0 +1,36 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "main.h"
+
+// Room for the hop records in a TRACE message. Records which don't fit are left out.
+#define TRACE_HOPS_SIZE (MAX_NODE_MESSAGE_SIZE - 32)
+// Longer messages would leave room for only a few hop records
+#define TRACE_MAX_MESSAGE_LENGTH 64
+// The time spent in a node is written with this many digits, so that it can be filled in when the
+// message is written to the socket
+#define TRACE_RESIDENCE_DIGITS 7
+
+typedef struct Trace {
+	// Unique among the traces started by the sender
+	unsigned long id;
+	// The CLOCK_MONOTONIC instant at which the sender received the command, in microseconds
+	long long origin_us;
+	// Hop records "<id>/<arrival>/<time in node>" separated by commas, followed by "+" if some were
+	// left out because the message was full
+	char hops[TRACE_HOPS_SIZE];
+} Trace;
+
+struct Connection;
+
+// Sends a traced CHAT message. Returns `false` if there's no path to the recipient.
+bool send_traced_message(NodeID recipient_id, const char *chat_message);
+// Writes a TRACE line with our own hop record appended. Returns the length of the line.
+int format_trace_line(char *line, NodeID sender_id, NodeID recipient_id, const Trace *trace, const char *chat_message);
+// Fills in the time spent in this node in a TRACE line which is about to be written.
+// Other lines are left unchanged.
+void stamp_trace_line(char *line);
+// If `message` is a TRACE message, this relays it or prints it and returns `true`
+bool handle_trace_message(struct Connection *conn, char *message);
+
+#endif
@@ -0,0 +1,102 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+
+#include "main.h"
+
+// Chords placed where the CHAT traffic flows.
+//
+// forward_message() counts the messages and hops to each recipient (see `traffic_stats`). Every
+// interval, the policy turns the new counts into a decaying rate, and opens a chord to the
+// recipient for which a direct connection would save the most hops: the rate times the hops
+// beyond the first one. Traffic chords whose node stopped getting messages are closed.
+//
+// Like the finger table, this takes the address of the node from the cached node list. If the node
+// isn't in it, the list is invalidated once, in case the node joined after it was fetched.
+
+static void close_traffic_chord(struct Connection *conn) {
+	NodeID id = conn->node_id;
+	close_connection(conn);
+	if (find_connection_by_node_id(id) == NULL) {
+		remove_routing_neighbor(id);
+	}
+}
+
+static void run_policy(void) {
+	start_timer(&ctx->policy_timer, TRAFFIC_POLICY_INTERVAL_MS, run_policy);
+
+	for (NodeID id = 0; id <= MAX_NODE_ID; id++) {
+		ctx->traffic_rates[id] = ctx->traffic_rates[id] / 2 + (ctx->traffic_stats[id].messages - ctx->counted_messages[id]);
+		ctx->counted_messages[id] = ctx->traffic_stats[id].messages;
+	}
+
+	if (ctx->connection_state != CONNECTED || ctx->ring_id_str[0] == '\0') {
+		return;
+	}
+
+	int chord_count = 0;
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		struct Connection *conn = &ctx->connections[i];
+		if (conn->socket == -1 || conn->outbound_chord != TRAFFIC_CHORD) continue;
+
+		if (ctx->traffic_rates[conn->node_id] < TRAFFIC_CHORD_IDLE_RATE) {
+			v_printf("Closing the traffic chord to node "NODE_ID_OUT", which no longer gets messages.\n", conn->node_id);
+			close_traffic_chord(conn);
+		} else {
+			chord_count++;
+		}
+	}
+	if (chord_count >= MAX_TRAFFIC_CHORDS) {
+		return;
+	}
+
+	NodeID best_id = -1;
+	double best_savings = 0;
+	for (NodeID id = 0; id <= MAX_NODE_ID; id++) {
+		int hop_count = get_hop_count(id);
+		if (id == ctx->self.id || hop_count < 2 || find_connection_by_node_id(id) != NULL) continue;
+
+		double savings = ctx->traffic_rates[id] * (hop_count - 1);
+		if (savings > best_savings) {
+			best_id = id;
+			best_savings = savings;
+		}
+	}
+	if (best_savings < TRAFFIC_CHORD_MIN_SAVINGS) {
+		return;
+	}
+
+	const NodeArray *list = get_node_list(ctx->ring_id_str, NULL);
+	const Node *found = list != NULL ? find_node(list, best_id) : NULL;
+	if (found != NULL) {
+		v_printf("Opening a traffic chord to node "NODE_ID_OUT", which would save %.0f hops per interval.\n", best_id, best_savings);
+		Node node = *found;
+		struct Connection *conn = open_chord(&node);
+		if (conn != NULL) {
+			conn->outbound_chord = TRAFFIC_CHORD;
+		}
+		return;
+	}
+
+	if (list != NULL && ctx->missing_id != best_id) {
+		vv_printf("Node "NODE_ID_OUT" isn't in the node list. Requesting it again.\n", best_id);
+		ctx->missing_id = best_id;
+		invalidate_node_list(ctx->ring_id_str);
+	}
+}
+
+void set_traffic_chords(bool enabled) {
+	ctx->traffic_chords_enabled = enabled;
+	if (enabled) {
+		start_timer(&ctx->policy_timer, TRAFFIC_POLICY_INTERVAL_MS, run_policy);
+		return;
+	}
+
+	stop_timer(&ctx->policy_timer);
+	ctx->missing_id = -1;
+	for (int i = 0; i < MAX_CONNECTIONS; i++) {
+		if (ctx->connections[i].socket != -1 && ctx->connections[i].outbound_chord == TRAFFIC_CHORD) {
+			close_traffic_chord(&ctx->connections[i]);
+		}
+	}
+}
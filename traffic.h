@@ -0,0 +1,18 @@
+#ifndef TRAFFIC_H
+#define TRAFFIC_H
+
+#include "main.h"
+
+// How often the traffic chords are reconsidered
+#define TRAFFIC_POLICY_INTERVAL_MS 2000
+// Maximum number of chords opened because of the traffic
+#define MAX_TRAFFIC_CHORDS 3
+// Hops per interval a chord must save before it is opened
+#define TRAFFIC_CHORD_MIN_SAVINGS 20
+// A traffic chord is closed once its node gets fewer messages than this per interval
+#define TRAFFIC_CHORD_IDLE_RATE 1
+
+// Enables or disables the traffic chords. Disabling them closes them.
+void set_traffic_chords(bool enabled);
+
+#endif
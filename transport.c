@@ -0,0 +1,79 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "main.h"
+
+static int tcp_connect(const Node *node) {
+	struct addrinfo hints = {
+		.ai_family = AF_INET,      // IPv4
+		.ai_socktype = SOCK_STREAM // TCP
+	};
+
+	struct addrinfo *ai;
+	int ret = getaddrinfo(node->ip_addr, node->tcp_port, &hints, &ai);
+	if (ret != 0) {
+		printf("Connection error: Invalid node IP address: %s\n", gai_strerror(ret));
+		return -1;
+	}
+
+	int s = socket(AF_INET, SOCK_STREAM, 0); // TCP over IPv4
+	if (s == -1) {
+		printf("Connection error: Couldn't create TCP socket to connect to node: %s\n", strerror(errno));
+		freeaddrinfo(ai);
+		return -1;
+	}
+
+	// The connection is established while the event loop runs, so that a node which is gone
+	// without unregistering, e.g. a stale entry in the node list, doesn't hold up the other rings
+	// and connections. See `connect_to_node()`.
+	int flags = fcntl(s, F_GETFL);
+	if (flags == -1 || fcntl(s, F_SETFL, flags | O_NONBLOCK) == -1) {
+		printf("Connection error: Couldn't make the TCP socket nonblocking: %s\n", strerror(errno));
+		freeaddrinfo(ai);
+		close(s);
+		return -1;
+	}
+	ret = connect(s, ai->ai_addr, ai->ai_addrlen);
+	freeaddrinfo(ai);
+	if (ret != 0 && errno != EINPROGRESS) {
+		printf("Couldn't connect to the node (%s:%s) via TCP: %s\n", node->ip_addr, node->tcp_port, strerror(errno));
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+static int tcp_finish_connect(int socket) {
+	int error_code = 0;
+	socklen_t length = sizeof(error_code);
+	if (getsockopt(socket, SOL_SOCKET, SO_ERROR, &error_code, &length) == -1) {
+		return -1;
+	}
+	if (error_code != 0) {
+		errno = error_code;
+		return -1;
+	}
+	// Writes to nodes are blocking once the connection is established
+	int flags = fcntl(socket, F_GETFL);
+	if (flags == -1 || fcntl(socket, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+const Transport tcp_transport = {
+	.connect = tcp_connect,
+	.finish_connect = tcp_finish_connect,
+	.write = write,
+	.close = close,
+	.configure = set_keepalive_options,
+};
+
+const Transport *transport = &tcp_transport;
@@ -0,0 +1,31 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <sys/types.h>
+
+#include "main.h"
+
+// How the connections to other nodes are opened, written and closed. The program uses TCP, and the
+// simulator (see sim.c) replaces it with in-memory links. Incoming connections are passed to
+// `accept_node_connection()` by whoever accepts them.
+typedef struct Transport {
+	// Opens a connection to the node. Returns the socket, or -1 after printing why it failed. The
+	// connection may still be in progress: the socket becomes writable once it's established or it
+	// failed, and `finish_connect()` tells which.
+	int (*connect)(const Node *node);
+	// Returns 0 if the connection is established, or -1 with `errno` set if it failed. NULL if
+	// `connect()` always returns established connections.
+	int (*finish_connect)(int socket);
+	// Same contract as write()
+	ssize_t (*write)(int socket, const void *data, size_t length);
+	// Same contract as close()
+	int (*close)(int socket);
+	// Applies the heartbeat settings to a node socket
+	void (*configure)(int socket);
+} Transport;
+
+extern const Transport tcp_transport;
+// The transport in use. Points to `tcp_transport` unless a simulation replaces it.
+extern const Transport *transport;
+
+#endif
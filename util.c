@@ -1,10 +1,12 @@
 // Various general utility functions
+#define _POSIX_C_SOURCE 200809L
 
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "util.h"
 
@@ -16,4 +18,39 @@ void *malloc_f(size_t size) {
 	return p;
 }
 
+static const long long *virtual_clock;
+
+long long monotonic_ms(void) {
+	if (virtual_clock != NULL) {
+		return *virtual_clock / 1000;
+	}
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+		return -1;
+	}
+	return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+long long monotonic_us(void) {
+	if (virtual_clock != NULL) {
+		return *virtual_clock;
+	}
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+		return -1;
+	}
+	return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void use_virtual_clock(const long long *now_us) {
+	virtual_clock = now_us;
+}
+
+unsigned int run_seed(void) {
+	if (virtual_clock != NULL) {
+		return (unsigned int) *virtual_clock;
+	}
+	return (unsigned int) time(NULL) ^ ((unsigned int) getpid() << 16);
+}
+
 int verbose_level;
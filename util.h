@@ -9,13 +9,36 @@
 // Like `malloc`, but terminates the program if allocation fails
 void *malloc_f(size_t size);
 
+// TIME
+// Returns the current CLOCK_MONOTONIC time in milliseconds, or -1 on error
+long long monotonic_ms(void);
+// Same, in microseconds
+long long monotonic_us(void);
+// Makes the functions above return `*now_us` instead, which must stay valid. Used by the simulator
+// (see sim.c), which runs every node on one virtual clock.
+void use_virtual_clock(const long long *now_us);
+// A value which is unlikely to repeat in another run of the program. Derived from the virtual time
+// in simulations, so that they are reproducible.
+unsigned int run_seed(void);
+
 // LOGGING
+// Messages up to `verbose_level` are printed, and messages up to `record_level` are kept in the
+// flight recorder (see flight-recorder.c). Warnings are always printed and recorded.
+// Messages above MAX_VERBOSE_LEVEL are removed at compile time.
+#ifndef MAX_VERBOSE_LEVEL
+#define MAX_VERBOSE_LEVEL 2
+#endif
 extern int verbose_level;
+extern int record_level;
+void log_message(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+// Writes to stderr, which is unbuffered, and records the message
+void log_warning(const char *format, ...) __attribute__((format(printf, 1, 2)));
 #define error(...) do { fprintf(stderr, "ERROR: " __VA_ARGS__); exit(1); } while (0)
-#define warn(...) do { fprintf(stderr, "WARNING: " __VA_ARGS__); fflush(stderr); } while (0)
-#define dbg_warn(...) do { fprintf(stderr, "DEBUG WARNING: " __VA_ARGS__); fflush(stderr); } while (0)
-#define v_printf(...) do { if (verbose_level >= 1) { printf(__VA_ARGS__); fflush(stderr); } } while (0)
-#define vv_printf(...) do { if (verbose_level >= 2) { printf(__VA_ARGS__); fflush(stderr); } } while (0)
+#define warn(...) log_warning("WARNING: " __VA_ARGS__)
+#define dbg_warn(...) log_warning("DEBUG WARNING: " __VA_ARGS__)
+#define LOG_ENABLED(level) (MAX_VERBOSE_LEVEL >= (level) && (verbose_level >= (level) || record_level >= (level)))
+#define v_printf(...) do { if (LOG_ENABLED(1)) log_message(1, __VA_ARGS__); } while (0)
+#define vv_printf(...) do { if (LOG_ENABLED(2)) log_message(2, __VA_ARGS__); } while (0)
 
 // MACROS
 #define STR_HELPER(x) #x